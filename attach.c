@@ -237,13 +237,70 @@ out:
     return err;
 }
 
+#define ALIGN16(n) (((n) + 15) & ~(size_t)15)
+
+static void set_call(struct remote_syscall *call, long sysno, int stop,
+                     unsigned long a0, unsigned long a1, unsigned long a2,
+                     unsigned long a3, unsigned long a4, unsigned long a5) {
+    call->sysno = sysno;
+    call->stop_on_error = stop;
+    call->args[0] = a0;
+    call->args[1] = a1;
+    call->args[2] = a2;
+    call->args[3] = a3;
+    call->args[4] = a4;
+    call->args[5] = a5;
+    call->ran = 0;
+    call->rv = 0;
+}
+
+#define SET_CALL(call, child, name, stop, a0, a1, a2, a3, a4, a5)      \
+    set_call((call), ptrace_syscall_numbers((child))->nr_##name, (stop), \
+             a0, a1, a2, a3, a4, a5)
+
+/*
+ * Make a list of syscalls in the child, all in one round trip with
+ * ptrace_remote_program() if we can, and otherwise one remote syscall
+ * at a time with the same results. A program of len 0 isn't tried.
+ */
+static int run_calls(struct ptrace_child *child, child_addr_t program,
+                     size_t len, struct remote_syscall *calls, int n) {
+    struct remote_syscall *c;
+
+    for (c = calls; c < calls + n; c++)
+        c->ran = 0;
+    if (len) {
+        if (ptrace_remote_program(child, program, len, calls, n) == 0)
+            return 0;
+        if (calls[0].ran)
+            return -1;
+        debug("Unable to run a syscall program in the child: %s",
+              strerror(child->error));
+    }
+    for (c = calls; c < calls + n; c++) {
+        c->rv = ptrace_remote_syscall(child, c->sysno,
+                                      c->args[0], c->args[1], c->args[2],
+                                      c->args[3], c->args[4], c->args[5]);
+        c->ran = 1;
+        if (c->stop_on_error && c->rv >= (unsigned long)-4096)
+            break;
+    }
+    return 0;
+}
+
 int attach_child(pid_t pid, const char *pty, int force_stdio) {
     struct ptrace_child child;
     child_addr_t scratch_page = -1;
     int *child_tty_fds = NULL, n_fds, child_fd, statfd = -1;
-    int i;
+    struct remote_syscall *calls = NULL;
+    child_addr_t act_addr, program;
+    size_t program_len;
+    int i, n, tiocsctty;
     int err = 0;
     long page_size = sysconf(_SC_PAGE_SIZE);
+    struct sigaction act = {
+        .sa_handler = SIG_IGN,
+    };
 #ifdef __linux__
     char stat_path[PATH_MAX];
 #endif
@@ -296,15 +353,43 @@ int attach_child(pid_t pid, const char *pty, int force_stdio) {
         }
     }
 
-    if (ptrace_memcpy_to_child(&child, scratch_page, pty, strlen(pty) + 1)) {
+    act_addr = scratch_page + ALIGN16(strlen(pty) + 1);
+    program = act_addr + ALIGN16(sizeof act);
+    program_len = scratch_page + page_size - program;
+    if (ptrace_memcpy_to_child(&child, scratch_page, pty, strlen(pty) + 1) ||
+        ptrace_memcpy_to_child(&child, act_addr, &act, sizeof act)) {
         err = child.error;
         error("Unable to memcpy the pty path to child.");
         goto out_free_fds;
     }
 
-    child_fd = do_syscall(&child, open,
-                          scratch_page, O_RDWR | O_NOCTTY,
-                          0, 0, 0, 0);
+    err = do_syscall(&child, mprotect, scratch_page, page_size,
+                     PROT_READ | PROT_WRITE | PROT_EXEC, 0, 0, 0);
+    if (err < 0) {
+        debug("Unable to make the scratch page executable: %s",
+              strerror(-err));
+        program_len = 0;
+    }
+
+    calls = calloc(n_fds + 3, sizeof *calls);
+    if (!calls) {
+        err = ENOMEM;
+        goto out_free_fds;
+    }
+
+    SET_CALL(&calls[0], &child, open, 1,
+             scratch_page, O_RDWR | O_NOCTTY, 0, 0, 0, 0);
+    SET_CALL(&calls[1], &child, rt_sigaction, 1,
+             SIGHUP, act_addr, 0, 8, 0, 0);
+    SET_CALL(&calls[2], &child, getsid, 0, 0, 0, 0, 0, 0, 0);
+    if (run_calls(&child, program, program_len, calls, 3) < 0) {
+        err = -child.error;
+        /* The open may still have run before the program failed. */
+        child_fd = calls[0].ran && (long)calls[0].rv >= 0 ? calls[0].rv : -1;
+        goto out_close;
+    }
+
+    child_fd = calls[0].rv;
     if (child_fd < 0) {
         err = child_fd;
         error("Unable to open the tty in the child.");
@@ -313,40 +398,58 @@ int attach_child(pid_t pid, const char *pty, int force_stdio) {
 
     debug("Opened the new tty in the child: %d", child_fd);
 
-    err = ignore_hup(&child, scratch_page);
+    err = calls[1].rv;
     if (err < 0)
         goto out_close;
 
-    err = do_syscall(&child, getsid, 0, 0, 0, 0, 0, 0);
+    n = 0;
+    err = calls[2].rv;
     if (err != child.pid) {
         debug("Target is not a session leader, attempting to setsid.");
         err = do_setsid(&child);
     } else {
-        do_syscall(&child, ioctl, child_tty_fds[0], TIOCNOTTY, 0, 0, 0, 0);
+        SET_CALL(&calls[n++], &child, ioctl, 0,
+                 child_tty_fds[0], TIOCNOTTY, 0, 0, 0, 0);
     }
     if (err < 0)
         goto out_close;
 
-    err = do_syscall(&child, ioctl, child_fd, TIOCSCTTY, 1, 0, 0, 0);
-    if (err != 0) { /* Seems to be returning >0 for error */
-        error("Unable to set controlling terminal: %s", strerror(err));
+    /* TIOCSCTTY seems to return >0 for error, which won't stop the program */
+    tiocsctty = n;
+    SET_CALL(&calls[n++], &child, ioctl, 1, child_fd, TIOCSCTTY, 1, 0, 0, 0);
+    for (i = 0; i < n_fds; i++)
+        SET_CALL(&calls[n++], &child, dup2, 0,
+                 child_fd, child_tty_fds[i], 0, 0, 0, 0);
+    SET_CALL(&calls[n++], &child, close, 0, child_fd, 0, 0, 0, 0, 0);
+    if (run_calls(&child, program, program_len, calls, n) < 0) {
+        err = -child.error;
+        goto out_close;
+    }
+    if (calls[n - 1].ran)
+        child_fd = -1;
+
+    err = calls[tiocsctty].rv;
+    if (err != 0) {
+        error("Unable to set controlling terminal: %s",
+              strerror(err < 0 ? -err : err));
         goto out_close;
     }
 
     debug("Set the controlling tty");
 
     for (i = 0; i < n_fds; i++) {
-        err = do_syscall(&child, dup2, child_fd, child_tty_fds[i], 0, 0, 0, 0);
+        err = calls[tiocsctty + 1 + i].rv;
         if (err < 0)
-            error("Problem moving child fd number %d to new tty: %s", child_tty_fds[i], strerror(errno));
+            error("Problem moving child fd number %d to new tty: %s", child_tty_fds[i], strerror(-err));
     }
 
-
     err = 0;
 
 out_close:
-    do_syscall(&child, close, child_fd, 0, 0, 0, 0, 0);
+    if (child_fd >= 0)
+        do_syscall(&child, close, child_fd, 0, 0, 0, 0, 0);
 out_free_fds:
+    free(calls);
     free(child_tty_fds);
 
 out_unmap:
@@ -0,0 +1,306 @@
+/*
+ * Copyright (C) 2011 by Nelson Elhage
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+#include "reptyr.h"
+#include "capture.h"
+#include "event.h"
+#include "proxy.h"
+
+struct capture {
+    const struct capture_options *opts;
+    int pty;
+    int fd;
+    /* Size of the log, counting what's still in the buffer */
+    off_t size;
+    long long opened_at;
+    char *buf;
+    size_t len;
+    long long flush_at;
+    /* With filters, where reads go first */
+    char *raw;
+    int done;
+
+    struct event_loop loop;
+    struct watch pty_watch;
+    struct watch exit_watch;
+    struct watch hup_watch;
+    struct watch term_watch;
+
+    unsigned long long bytes;
+    unsigned long long writes;
+    unsigned long long rotations;
+};
+
+static int capture_open(struct capture *c) {
+    struct stat st;
+
+    c->fd = open(c->opts->path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0600);
+    if (c->fd < 0) {
+        error("Unable to open %s: %s", c->opts->path, strerror(errno));
+        return -1;
+    }
+    c->size = fstat(c->fd, &st) == 0 ? st.st_size : 0;
+    c->opened_at = ev_now();
+    return 0;
+}
+
+static void capture_flush(struct capture *c) {
+    if (c->len && c->fd >= 0 && writeall(c->fd, c->buf, c->len) < 0)
+        error("Unable to write to %s: %s", c->opts->path, strerror(errno));
+    c->writes += c->len > 0;
+    c->len = 0;
+    c->flush_at = 0;
+}
+
+/* path.(keep-1) becomes path.keep, and so on down to path becoming path.1. */
+static void capture_rotate(struct capture *c) {
+    const char *path = c->opts->path;
+    size_t size = strlen(path) + 16;
+    char *from = malloc(size), *to = malloc(size);
+    int i;
+
+    capture_flush(c);
+    if (from && to) {
+        for (i = c->opts->keep; i > 0; i--) {
+            if (i > 1)
+                snprintf(from, size, "%s.%d", path, i - 1);
+            else
+                snprintf(from, size, "%s", path);
+            snprintf(to, size, "%s.%d", path, i);
+            if (rename(from, to) < 0 && errno != ENOENT)
+                error("Unable to rename %s: %s", from, strerror(errno));
+        }
+        /* With nothing to keep, start over. */
+        if (c->opts->keep == 0 && ftruncate(c->fd, 0) < 0)
+            error("Unable to truncate %s: %s", path, strerror(errno));
+    }
+    free(from);
+    free(to);
+    close(c->fd);
+    c->rotations++;
+    if (capture_open(c) < 0)
+        c->done = 1;
+}
+
+static int capture_rotate_due(struct capture *c) {
+    const struct capture_options *opts = c->opts;
+
+    return (opts->rotate_size && (size_t)c->size >= opts->rotate_size) ||
+        (opts->rotate_time && ev_now() - c->opened_at >= opts->rotate_time * 1000000LL);
+}
+
+/* Take n bytes just put at the end of the buffer, and flush it if that filled it. */
+static void capture_commit(struct capture *c, size_t n) {
+    if (c->opts->triggers)
+        triggers_scan(c->opts->triggers, c->buf + c->len, n);
+    if (c->len == 0)
+        c->flush_at = ev_now() + CAPTURE_FLUSH_MS * 1000LL;
+    c->len += n;
+    c->size += n;
+    c->bytes += n;
+    if (c->len == CAPTURE_BUFFER)
+        capture_flush(c);
+}
+
+/* Copy what came out of the filters into the buffer. */
+static void capture_put(struct capture *c, const struct iovec *iov, ssize_t count) {
+    const char *p;
+    size_t len, n;
+
+    for (; count > 0; iov++, count--) {
+        for (p = iov->iov_base, len = iov->iov_len; len > 0; p += n, len -= n) {
+            n = CAPTURE_BUFFER - c->len < len ? CAPTURE_BUFFER - c->len : len;
+            memcpy(c->buf + c->len, p, n);
+            capture_commit(c, n);
+        }
+    }
+}
+
+/*
+ * Read once from the pty: straight into the buffer, or with filters,
+ * into c->raw and then through them.
+ */
+static ssize_t capture_read(struct capture *c) {
+    const struct iovec *out;
+    struct iovec in;
+    ssize_t n, count;
+
+    if (c->opts->filters == NULL) {
+        n = read(c->pty, c->buf + c->len, CAPTURE_BUFFER - c->len);
+        if (n > 0)
+            capture_commit(c, n);
+        return n;
+    }
+    n = read(c->pty, c->raw, CAPTURE_READ);
+    if (n > 0) {
+        in.iov_base = c->raw;
+        in.iov_len = n;
+        if ((count = filter_run(c->opts->filters, &in, 1, &out)) > 0)
+            capture_put(c, out, count);
+    }
+    return n;
+}
+
+static void pty_ready(struct event_loop *loop, struct watch *w, int revents) {
+    struct capture *c = w->data;
+    ssize_t n;
+
+    n = capture_read(c);
+    if (n < 0 && (errno == EAGAIN || errno == EINTR))
+        return;
+    if (n <= 0) {
+        /* EIO: whatever had the other end open is gone. */
+        debug("Nothing left on the pty.");
+        c->done = 1;
+        return;
+    }
+    if (capture_rotate_due(c))
+        capture_rotate(c);
+}
+
+static void target_exited(struct event_loop *loop, struct watch *w, int revents) {
+    struct capture *c = w->data;
+
+    debug("Target exited.");
+    /* Pick up what it wrote on the way out. */
+    while (capture_read(c) > 0)
+        ;
+    c->done = 1;
+}
+
+/* A trigger types into the program; there's nobody else to. */
+static void capture_send(void *data, const char *buf, size_t len) {
+    struct capture *c = data;
+
+    if (writeall(c->pty, buf, len) < 0)
+        debug("Unable to send a trigger's input: %s", strerror(errno));
+}
+
+static void hup_ready(struct event_loop *loop, struct watch *w, int revents) {
+    struct capture *c = w->data;
+
+    debug("Rotating %s on SIGHUP.", c->opts->path);
+    capture_rotate(c);
+}
+
+static void term_ready(struct event_loop *loop, struct watch *w, int revents) {
+    struct capture *c = w->data;
+
+    debug("Stopping on SIGTERM.");
+    c->done = 1;
+}
+
+/* How long the loop may sleep (in ms, or -1) before a flush or rotation is due. */
+static int capture_timeout(struct capture *c) {
+    long long deadline = c->flush_at;
+
+    if (c->opts->rotate_time) {
+        long long rotate_at = c->opened_at + c->opts->rotate_time * 1000000LL;
+
+        if (!deadline || rotate_at < deadline)
+            deadline = rotate_at;
+    }
+    return deadline ? ev_timeout_until(deadline) : -1;
+}
+
+void do_capture(int pty, pid_t target, const struct capture_options *opts) {
+    struct capture c = { .opts = opts, .pty = pty, .fd = -1 };
+    const struct iovec *held;
+    ssize_t count;
+    char ready;
+
+    if (ev_init(&c.loop) < 0) {
+        error("Unable to create event loop: %s", strerror(errno));
+        return;
+    }
+    c.buf = malloc(CAPTURE_BUFFER);
+    if (opts->filters)
+        c.raw = malloc(CAPTURE_READ);
+    ready = c.buf && (c.raw || !opts->filters) && capture_open(&c) == 0;
+    if (opts->ready_fd > 0) {
+        if (write(opts->ready_fd, &ready, 1) < 0)
+            debug("Unable to say we're ready: %s", strerror(errno));
+        close(opts->ready_fd);
+    }
+    if (!ready)
+        goto out;
+
+    /* Nobody's there to answer, but a size keeps programs happy. */
+    resize_pty(pty);
+    fcntl(pty, F_SETFL, fcntl(pty, F_GETFL) | O_NONBLOCK);
+    if (opts->triggers) {
+        opts->triggers->target = target;
+        opts->triggers->send = capture_send;
+        opts->triggers->data = &c;
+    }
+    ev_watch_init(&c.pty_watch, pty, pty_ready, &c);
+    ev_watch_init(&c.exit_watch, -1, target_exited, &c);
+    ev_watch_init(&c.hup_watch, -1, hup_ready, &c);
+    ev_watch_init(&c.term_watch, -1, term_ready, &c);
+    if (ev_add(&c.loop, &c.pty_watch, EV_READ) < 0) {
+        error("Unable to watch the pty: %s", strerror(errno));
+        goto out;
+    }
+    if (ev_add_signal(&c.loop, &c.hup_watch, SIGHUP) < 0 ||
+        ev_add_signal(&c.loop, &c.term_watch, SIGTERM) < 0)
+        error("Unable to watch for signals: %s", strerror(errno));
+    if (target > 0 && ev_add_exit(&c.loop, &c.exit_watch, target) < 0)
+        debug("Unable to watch pid %d for exit: %s", (int)target, strerror(errno));
+
+    while (!c.done) {
+        if (ev_run_once(&c.loop, capture_timeout(&c)) < 0 && errno != EINTR) {
+            error("Event loop failed: %s", strerror(errno));
+            break;
+        }
+        if (c.flush_at && ev_now() >= c.flush_at)
+            capture_flush(&c);
+        if (!c.done && capture_rotate_due(&c))
+            capture_rotate(&c);
+    }
+    if (opts->filters && (count = filter_finish(opts->filters, &held)) > 0)
+        capture_put(&c, held, count);
+    capture_flush(&c);
+    debug("capture: %llu bytes in %llu writes, %llu rotations",
+          c.bytes, c.writes, c.rotations);
+    if (opts->filters)
+        filter_report(opts->filters);
+    if (opts->triggers)
+        triggers_report(opts->triggers);
+
+out:
+    if (c.exit_watch.fd >= 0)
+        close(c.exit_watch.fd);
+    if (c.fd >= 0)
+        close(c.fd);
+    free(c.buf);
+    free(c.raw);
+    ev_free(&c.loop);
+}
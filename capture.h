@@ -0,0 +1,61 @@
+/*
+ * Copyright (C) 2011 by Nelson Elhage
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#ifndef CAPTURE_H
+#define CAPTURE_H
+
+#include <sys/types.h>
+
+#include "filter.h"
+#include "trigger.h"
+
+/*
+ * Keeping a program's output with no terminal at all: the pty master is
+ * read straight into a buffer, which goes to a log file in big writes.
+ * The log is rotated by size or age, or on SIGHUP.
+ */
+
+#define CAPTURE_BUFFER (256 * 1024)
+/* With filters, reads go through a buffer of this size first */
+#define CAPTURE_READ (64 * 1024)
+/* The longest output waits in the buffer */
+#define CAPTURE_FLUSH_MS 1000
+#define CAPTURE_DEFAULT_KEEP 5
+
+struct capture_options {
+    const char *path;
+    /* Rotate once the log is this big, or this many seconds old, if set */
+    size_t rotate_size;
+    int rotate_time;
+    /* How many rotated logs to keep: path.1 (the newest) to path.keep */
+    int keep;
+    /* If set, write a byte here once the log is open: 1 if it worked */
+    int ready_fd;
+    /* If set, compiled triggers to fire on the output */
+    struct triggers *triggers;
+    /* If set, the log gets the output as these leave it */
+    struct filter_chain *filters;
+};
+
+/* Capture the output of the pty until everything on the other end is gone. */
+void do_capture(int pty, pid_t target, const struct capture_options *opts);
+
+#endif
@@ -0,0 +1,431 @@
+/*
+ * Copyright (C) 2011 by Nelson Elhage
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <string.h>
+#include <stdlib.h>
+#include <signal.h>
+#include <time.h>
+
+#if defined(__linux__) && !defined(EV_USE_POLL)
+#define EV_EPOLL
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <sys/syscall.h>
+#else
+#include <poll.h>
+#endif
+
+#include "event.h"
+#include "reallocarray.h"
+
+#if defined(EV_EPOLL) && !defined(__NR_pidfd_open)
+#define __NR_pidfd_open 434
+#endif
+
+#define EV_BATCH 64
+
+static void dispatch_signals(struct event_loop *loop, struct watch *w, int revents);
+
+void ev_watch_init(struct watch *w, int fd, watch_cb cb, void *data) {
+    memset(w, 0, sizeof *w);
+    w->fd = fd;
+    w->cb = cb;
+    w->data = data;
+    w->slot = -1;
+}
+
+static void dispatch_one(struct event_loop *loop, struct watch *w, int revents) {
+    if (w == &loop->sig_source)
+        dispatch_signals(loop, w, revents);
+    else
+        w->cb(loop, w, revents);
+}
+
+#ifdef EV_EPOLL
+
+static uint32_t to_epoll(int events) {
+    uint32_t ev = 0;
+    if (events & EV_READ)
+        ev |= EPOLLIN;
+    if (events & EV_WRITE)
+        ev |= EPOLLOUT;
+    if (events & EV_PRI)
+        ev |= EPOLLPRI;
+    return ev;
+}
+
+const char *ev_backend_name(void) {
+    return "epoll";
+}
+
+int ev_init(struct event_loop *loop) {
+    memset(loop, 0, sizeof *loop);
+    loop->sigfd = -1;
+    sigemptyset(&loop->sigmask);
+    loop->fd = epoll_create1(EPOLL_CLOEXEC);
+    return loop->fd < 0 ? -1 : 0;
+}
+
+static int ev_ctl(struct event_loop *loop, int op, struct watch *w, int events) {
+    struct epoll_event ev = {
+        .events = to_epoll(events),
+        .data.ptr = w,
+    };
+    return epoll_ctl(loop->fd, op, w->fd, &ev);
+}
+
+int ev_add(struct event_loop *loop, struct watch *w, int events) {
+    if (ev_ctl(loop, EPOLL_CTL_ADD, w, events) < 0)
+        return -1;
+    w->events = events;
+    w->active = 1;
+    return 0;
+}
+
+int ev_modify(struct event_loop *loop, struct watch *w, int events) {
+    if (w->events == events)
+        return 0;
+    if (ev_ctl(loop, EPOLL_CTL_MOD, w, events) < 0)
+        return -1;
+    w->events = events;
+    return 0;
+}
+
+void ev_del(struct event_loop *loop, struct watch *w) {
+    struct epoll_event *pending = loop->pending;
+    int i;
+
+    if (!w->active)
+        return;
+    epoll_ctl(loop->fd, EPOLL_CTL_DEL, w->fd, NULL);
+    w->active = 0;
+    /* Don't dispatch anything still queued from this batch. */
+    for (i = 0; i < loop->n_pending; i++)
+        if (pending[i].data.ptr == w)
+            pending[i].data.ptr = NULL;
+}
+
+int ev_run_once(struct event_loop *loop, int timeout_ms) {
+    struct epoll_event events[EV_BATCH];
+    int n, i, pass, revents;
+
+    n = epoll_wait(loop->fd, events, EV_BATCH, timeout_ms);
+    if (n < 0)
+        return errno == EINTR ? 0 : -1;
+
+    loop->pending = events;
+    loop->n_pending = n;
+    for (pass = 0; pass < 2; pass++) {
+        for (i = 0; i < n; i++) {
+            struct watch *w = events[i].data.ptr;
+            if (w == NULL || (pass == 0 && !w->priority))
+                continue;
+            revents = 0;
+            if (events[i].events & EPOLLIN)
+                revents |= EV_READ;
+            if (events[i].events & EPOLLOUT)
+                revents |= EV_WRITE;
+            if (events[i].events & EPOLLPRI)
+                revents |= EV_PRI;
+            if (events[i].events & (EPOLLERR | EPOLLHUP))
+                revents |= EV_ERROR;
+            events[i].data.ptr = NULL;
+            dispatch_one(loop, w, revents);
+        }
+    }
+    loop->pending = NULL;
+    loop->n_pending = 0;
+    return n;
+}
+
+int ev_add_signal(struct event_loop *loop, struct watch *w, int signo) {
+    sigset_t one;
+    int fd;
+
+    sigemptyset(&one);
+    sigaddset(&one, signo);
+    if (sigisemptyset(&loop->sigmask))
+        sigprocmask(SIG_BLOCK, &one, &loop->saved_sigmask);
+    else
+        sigprocmask(SIG_BLOCK, &one, NULL);
+    sigaddset(&loop->sigmask, signo);
+
+    fd = signalfd(loop->sigfd, &loop->sigmask, SFD_NONBLOCK | SFD_CLOEXEC);
+    if (fd < 0)
+        return -1;
+    if (loop->sigfd < 0) {
+        loop->sigfd = fd;
+        ev_watch_init(&loop->sig_source, fd, NULL, NULL);
+        if (ev_add(loop, &loop->sig_source, EV_READ) < 0)
+            return -1;
+    }
+    loop->sig_watches[signo] = w;
+    w->active = 1;
+    return 0;
+}
+
+static void dispatch_signals(struct event_loop *loop, struct watch *w, int revents) {
+    struct signalfd_siginfo si;
+    struct watch *sw;
+
+    while (read(loop->sigfd, &si, sizeof si) == sizeof si) {
+        if (si.ssi_signo >= NSIG)
+            continue;
+        sw = loop->sig_watches[si.ssi_signo];
+        if (sw)
+            sw->cb(loop, sw, EV_READ);
+    }
+}
+
+int ev_add_exit(struct event_loop *loop, struct watch *w, pid_t pid) {
+    int fd = syscall(__NR_pidfd_open, pid, 0);
+    if (fd < 0)
+        return -1;
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+    w->fd = fd;
+    if (ev_add(loop, w, EV_READ) < 0) {
+        close(fd);
+        w->fd = -1;
+        return -1;
+    }
+    return 0;
+}
+
+#else /* !EV_EPOLL */
+
+static int sig_pipe[2] = {-1, -1};
+
+static void sig_to_pipe(int signo) {
+    int saved = errno;
+    unsigned char c = signo;
+    if (write(sig_pipe[1], &c, 1) < 0) {
+        /* The pipe is full; the signal is coalesced with a pending one. */
+    }
+    errno = saved;
+}
+
+static short to_poll(int events) {
+    short ev = 0;
+    if (events & EV_READ)
+        ev |= POLLIN;
+    if (events & EV_WRITE)
+        ev |= POLLOUT;
+    if (events & EV_PRI)
+        ev |= POLLPRI;
+    return ev;
+}
+
+const char *ev_backend_name(void) {
+    return "poll";
+}
+
+int ev_init(struct event_loop *loop) {
+    memset(loop, 0, sizeof *loop);
+    loop->fd = -1;
+    loop->sigfd = -1;
+    sigemptyset(&loop->sigmask);
+    return 0;
+}
+
+int ev_add(struct event_loop *loop, struct watch *w, int events) {
+    struct watch **tmp;
+
+    if (loop->n_watches == loop->allocated) {
+        loop->allocated = loop->allocated ? 2 * loop->allocated : 8;
+        tmp = xreallocarray(loop->watches, loop->allocated, sizeof *tmp);
+        if (tmp == NULL)
+            return -1;
+        loop->watches = tmp;
+    }
+    w->slot = loop->n_watches;
+    loop->watches[loop->n_watches++] = w;
+    w->events = events;
+    w->active = 1;
+    return 0;
+}
+
+int ev_modify(struct event_loop *loop, struct watch *w, int events) {
+    w->events = events;
+    return 0;
+}
+
+void ev_del(struct event_loop *loop, struct watch *w) {
+    if (!w->active)
+        return;
+    /* Compacted at the start of the next ev_run_once() */
+    loop->watches[w->slot] = NULL;
+    w->slot = -1;
+    w->active = 0;
+}
+
+static void compact(struct event_loop *loop) {
+    int i, j;
+    for (i = j = 0; i < loop->n_watches; i++) {
+        if (loop->watches[i] == NULL)
+            continue;
+        loop->watches[i]->slot = j;
+        loop->watches[j++] = loop->watches[i];
+    }
+    loop->n_watches = j;
+}
+
+int ev_run_once(struct event_loop *loop, int timeout_ms) {
+    struct pollfd *pfds;
+    int n, i, pass, count, ran = 0, revents;
+
+    compact(loop);
+    pfds = xreallocarray(NULL, loop->n_watches ? loop->n_watches : 1, sizeof *pfds);
+    if (pfds == NULL)
+        return -1;
+    for (i = 0; i < loop->n_watches; i++) {
+        pfds[i].fd = loop->watches[i]->fd;
+        pfds[i].events = to_poll(loop->watches[i]->events);
+        pfds[i].revents = 0;
+    }
+
+    /* Callbacks may add watches; those wait for the next round. */
+    count = loop->n_watches;
+    n = poll(pfds, count, timeout_ms);
+    if (n < 0) {
+        free(pfds);
+        return errno == EINTR ? 0 : -1;
+    }
+
+    for (pass = 0; pass < 2 && n > 0; pass++) {
+        for (i = 0; i < count; i++) {
+            struct watch *w = loop->watches[i];
+            if (!pfds[i].revents || w == NULL || (pass == 0 && !w->priority))
+                continue;
+            revents = 0;
+            if (pfds[i].revents & POLLIN)
+                revents |= EV_READ;
+            if (pfds[i].revents & POLLOUT)
+                revents |= EV_WRITE;
+            if (pfds[i].revents & POLLPRI)
+                revents |= EV_PRI;
+            if (pfds[i].revents & (POLLERR | POLLHUP | POLLNVAL))
+                revents |= EV_ERROR;
+            pfds[i].revents = 0;
+            dispatch_one(loop, w, revents);
+            ran++;
+        }
+    }
+    free(pfds);
+    return ran;
+}
+
+int ev_add_signal(struct event_loop *loop, struct watch *w, int signo) {
+    struct sigaction act;
+
+    if (sig_pipe[0] < 0) {
+        if (pipe(sig_pipe) < 0)
+            return -1;
+        fcntl(sig_pipe[0], F_SETFL, O_NONBLOCK);
+        fcntl(sig_pipe[1], F_SETFL, O_NONBLOCK);
+        fcntl(sig_pipe[0], F_SETFD, FD_CLOEXEC);
+        fcntl(sig_pipe[1], F_SETFD, FD_CLOEXEC);
+    }
+    if (loop->sigfd < 0) {
+        loop->sigfd = sig_pipe[0];
+        ev_watch_init(&loop->sig_source, loop->sigfd, NULL, NULL);
+        if (ev_add(loop, &loop->sig_source, EV_READ) < 0)
+            return -1;
+    }
+
+    memset(&act, 0, sizeof act);
+    act.sa_handler = sig_to_pipe;
+    act.sa_flags = SA_RESTART;
+    if (sigaction(signo, &act, NULL) < 0)
+        return -1;
+    sigaddset(&loop->sigmask, signo);
+    loop->sig_watches[signo] = w;
+    w->active = 1;
+    return 0;
+}
+
+static void dispatch_signals(struct event_loop *loop, struct watch *w, int revents) {
+    unsigned char signo;
+    struct watch *sw;
+
+    while (read(loop->sigfd, &signo, 1) == 1) {
+        if (signo >= NSIG)
+            continue;
+        sw = loop->sig_watches[signo];
+        if (sw)
+            sw->cb(loop, sw, EV_READ);
+    }
+}
+
+int ev_add_exit(struct event_loop *loop, struct watch *w, pid_t pid) {
+    errno = ENOSYS;
+    return -1;
+}
+
+#endif /* EV_EPOLL */
+
+long long ev_now(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+int ev_timeout_until(long long deadline) {
+    long long left = deadline - ev_now();
+
+    return left <= 0 ? 0 : (int)((left + 999) / 1000);
+}
+
+int ev_set(struct event_loop *loop, struct watch *w, int events) {
+    if (events == 0) {
+        ev_del(loop, w);
+        return 0;
+    }
+    if (!w->active)
+        return ev_add(loop, w, events);
+    return ev_modify(loop, w, events);
+}
+
+void ev_free(struct event_loop *loop) {
+    int signo;
+
+    if (loop->sigfd >= 0) {
+        ev_del(loop, &loop->sig_source);
+#ifdef EV_EPOLL
+        close(loop->sigfd);
+        sigprocmask(SIG_SETMASK, &loop->saved_sigmask, NULL);
+#else
+        for (signo = 1; signo < NSIG; signo++)
+            if (sigismember(&loop->sigmask, signo))
+                signal(signo, SIG_DFL);
+#endif
+    }
+    for (signo = 0; signo < NSIG; signo++)
+        loop->sig_watches[signo] = NULL;
+    if (loop->fd >= 0)
+        close(loop->fd);
+    free(loop->watches);
+    loop->fd = loop->sigfd = -1;
+    loop->watches = NULL;
+}
@@ -0,0 +1,113 @@
+/*
+ * Copyright (C) 2011 by Nelson Elhage
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#ifndef EVENT_H
+#define EVENT_H
+
+#include <signal.h>
+#include <sys/types.h>
+
+/*
+ * A minimal readiness-based event loop. On Linux this is epoll, with
+ * signals delivered through a signalfd and process exit through a pidfd;
+ * elsewhere it falls back to poll() and a self-pipe. Nothing here ever
+ * wakes up unless one of the registered sources actually fires.
+ */
+
+#define EV_READ   0x1
+#define EV_WRITE  0x2
+#define EV_ERROR  0x4
+/* Exceptional condition, e.g. a status change on a packet mode pty */
+#define EV_PRI    0x8
+
+struct event_loop;
+struct watch;
+
+typedef void (*watch_cb)(struct event_loop *loop, struct watch *w, int revents);
+
+struct watch {
+    int fd;
+    int events;
+    watch_cb cb;
+    void *data;
+    /* Ready watches with priority set are dispatched before the rest. */
+    int priority;
+    /* Private to event.c */
+    int slot;
+    int active;
+};
+
+struct event_loop {
+    int fd;
+    struct watch **watches;
+    int n_watches;
+    int allocated;
+    void *pending;
+    int n_pending;
+
+    int sigfd;
+    sigset_t sigmask;
+    sigset_t saved_sigmask;
+    struct watch sig_source;
+    struct watch *sig_watches[NSIG];
+};
+
+int ev_init(struct event_loop *loop);
+void ev_free(struct event_loop *loop);
+const char *ev_backend_name(void);
+
+void ev_watch_init(struct watch *w, int fd, watch_cb cb, void *data);
+int ev_add(struct event_loop *loop, struct watch *w, int events);
+int ev_modify(struct event_loop *loop, struct watch *w, int events);
+void ev_del(struct event_loop *loop, struct watch *w);
+
+/*
+ * Make `w' wait for exactly `events', adding or removing it from the
+ * loop as needed. Unlike ev_modify(), events == 0 really stops the
+ * watch, so a hung-up fd we aren't interested in can't spin the loop.
+ */
+int ev_set(struct event_loop *loop, struct watch *w, int events);
+
+/*
+ * Deliver `signo' to `w->cb' from the event loop instead of
+ * asynchronously. The signal is blocked for as long as the loop lives.
+ */
+int ev_add_signal(struct event_loop *loop, struct watch *w, int signo);
+
+/*
+ * Fire `w->cb' once when the (not necessarily child) process `pid'
+ * exits. Returns -1 with errno == ENOSYS if the platform can't do this.
+ */
+int ev_add_exit(struct event_loop *loop, struct watch *w, pid_t pid);
+
+/*
+ * Wait up to timeout_ms (or forever, if negative) for events and
+ * dispatch them. Returns the number of callbacks run, or -1 on error.
+ */
+int ev_run_once(struct event_loop *loop, int timeout_ms);
+
+/* Monotonic time in microseconds, for computing timeouts. */
+long long ev_now(void);
+
+/* Milliseconds from now until `deadline' (an ev_now() value), rounded up. */
+int ev_timeout_until(long long deadline);
+
+#endif
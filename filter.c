@@ -0,0 +1,343 @@
+/*
+ * Copyright (C) 2011 by Nelson Elhage
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "reptyr.h"
+#include "filter.h"
+
+typedef unsigned char filter_vec __attribute__((vector_size(16)));
+
+enum ansi_state {
+    ANSI_TEXT = 0,
+    /* After ESC */
+    ANSI_ESC,
+    /* ESC and intermediate bytes, waiting for the final one */
+    ANSI_ESC_INTER,
+    /* CSI parameters, up to a final byte */
+    ANSI_CSI,
+    /* OSC, DCS and the like, up to BEL or ST */
+    ANSI_STRING,
+    /* ... and an ESC in one, which may start the ST */
+    ANSI_STRING_ESC,
+};
+
+static int slices_push(struct filter_slices *s, const void *base, size_t len) {
+    struct iovec *last = s->count ? &s->iov[s->count - 1] : NULL;
+    struct iovec *grown;
+
+    if (len == 0)
+        return 0;
+    /* Runs of what was already one slice stay one slice. */
+    if (last && (const char *)last->iov_base + last->iov_len == base) {
+        last->iov_len += len;
+        return 0;
+    }
+    if (s->count == s->cap) {
+        grown = realloc(s->iov, (s->cap ? s->cap * 2 : 64) * sizeof *grown);
+        if (grown == NULL)
+            return -1;
+        s->iov = grown;
+        s->cap = s->cap ? s->cap * 2 : 64;
+    }
+    s->iov[s->count].iov_base = (void *)base;
+    s->iov[s->count++].iov_len = len;
+    return 0;
+}
+
+int filter_add(struct filter_chain *c, const char *spec) {
+    struct filter *f;
+    size_t k, b;
+
+    if (c->count == FILTER_MAX) {
+        errno = E2BIG;
+        return -1;
+    }
+    f = &c->f[c->count];
+    memset(f, 0, sizeof *f);
+    if (!strcmp(spec, "strip-ansi")) {
+        f->kind = FILTER_STRIP_ANSI;
+    } else if (!strcmp(spec, "timestamp")) {
+        f->kind = FILTER_TIMESTAMP;
+        f->bol = 1;
+    } else if (!strncmp(spec, "redact=", 7) && spec[7]) {
+        f->kind = FILTER_REDACT;
+        f->len = strlen(spec + 7);
+        f->secret = strdup(spec + 7);
+        f->fail = calloc(f->len + 1, sizeof *f->fail);
+        if (!f->secret || !f->fail) {
+            free(f->secret);
+            free(f->fail);
+            return -1;
+        }
+        /* fail[k]: the longest proper prefix of secret[0..k) that's also a suffix */
+        for (k = 2; k <= f->len; k++) {
+            for (b = f->fail[k - 1]; b && f->secret[b] != f->secret[k - 1]; b = f->fail[b])
+                ;
+            f->fail[k] = f->secret[b] == f->secret[k - 1] ? b + 1 : 0;
+        }
+    } else {
+        errno = EINVAL;
+        return -1;
+    }
+    c->count++;
+    return 0;
+}
+
+/* The next byte at or after p that's a control character other than tab or newline */
+static const unsigned char *find_control(const unsigned char *p, const unsigned char *end) {
+    filter_vec v, hit;
+    uint64_t half[2];
+
+    for (; end - p >= (ptrdiff_t)sizeof v; p += sizeof v) {
+        memcpy(&v, p, sizeof v);
+        hit = (filter_vec)((v < 0x20) & (v != '\n') & (v != '\t')) | (filter_vec)(v == 0x7f);
+        memcpy(half, &hit, sizeof half);
+        if (half[0] | half[1]) {
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+            return p + (half[0] ? __builtin_ctzll(half[0]) / 8
+                                : 8 + __builtin_ctzll(half[1]) / 8);
+#else
+            return p + (half[0] ? __builtin_clzll(half[0]) / 8
+                                : 8 + __builtin_clzll(half[1]) / 8);
+#endif
+        }
+    }
+    for (; p < end; p++)
+        if ((*p < 0x20 && *p != '\n' && *p != '\t') || *p == 0x7f)
+            return p;
+    return end;
+}
+
+static int strip_ansi(struct filter *f, const unsigned char *p, const unsigned char *end,
+                      struct filter_slices *out) {
+    const unsigned char *q;
+
+    while (p < end) {
+        if (f->esc == ANSI_TEXT) {
+            q = find_control(p, end);
+            if (slices_push(out, p, q - p) < 0)
+                return -1;
+            if (q == end)
+                break;
+            if (*q == '\033')
+                f->esc = ANSI_ESC;
+            p = q + 1;
+            continue;
+        }
+        switch (f->esc) {
+        case ANSI_ESC:
+            if (*p == '[')
+                f->esc = ANSI_CSI;
+            else if (*p == ']' || *p == 'P' || *p == 'X' || *p == '^' || *p == '_')
+                f->esc = ANSI_STRING;
+            else if (*p >= 0x20 && *p <= 0x2f)
+                f->esc = ANSI_ESC_INTER;
+            else
+                f->esc = ANSI_TEXT;
+            break;
+        case ANSI_ESC_INTER:
+            if (*p < 0x20 || *p > 0x2f)
+                f->esc = ANSI_TEXT;
+            break;
+        case ANSI_CSI:
+            if (*p >= 0x40 && *p <= 0x7e)
+                f->esc = ANSI_TEXT;
+            break;
+        case ANSI_STRING:
+            if (*p == '\a')
+                f->esc = ANSI_TEXT;
+            else if (*p == '\033')
+                f->esc = ANSI_STRING_ESC;
+            break;
+        case ANSI_STRING_ESC:
+            f->esc = *p == '\\' ? ANSI_TEXT : ANSI_STRING;
+            break;
+        }
+        p++;
+    }
+    return 0;
+}
+
+static int timestamp(struct filter *f, const unsigned char *p, const unsigned char *end,
+                     struct filter_slices *out) {
+    const unsigned char *nl;
+    struct timespec ts;
+    struct tm tm;
+
+    while (p < end) {
+        if (f->bol) {
+            /* Everything that came in one read turned up at the same time. */
+            if (f->stamp_len == 0) {
+                clock_gettime(CLOCK_REALTIME, &ts);
+                localtime_r(&ts.tv_sec, &tm);
+                f->stamp_len = strftime(f->stamp, sizeof f->stamp, "%Y-%m-%d %H:%M:%S", &tm);
+                f->stamp_len += snprintf(f->stamp + f->stamp_len, sizeof f->stamp - f->stamp_len,
+                                         ".%03ld ", ts.tv_nsec / 1000000);
+            }
+            if (slices_push(out, f->stamp, f->stamp_len) < 0)
+                return -1;
+            f->bol = 0;
+        }
+        nl = memchr(p, '\n', end - p);
+        if (nl == NULL)
+            return slices_push(out, p, end - p);
+        if (slices_push(out, p, nl + 1 - p) < 0)
+            return -1;
+        f->bol = 1;
+        p = nl + 1;
+    }
+    return 0;
+}
+
+/*
+ * Bytes that might be the start of the secret are held back, rather than
+ * copied: until we know, they are just secret[0..matched).
+ */
+static int redact(struct filter *f, const unsigned char *p, const unsigned char *end,
+                  struct filter_slices *out) {
+    const unsigned char *run = p, *q;
+    size_t b;
+
+    while (p < end) {
+        if (f->matched == 0) {
+            q = memchr(p, f->secret[0], end - p);
+            if (q == NULL)
+                break;
+            if (slices_push(out, run, q - run) < 0)
+                return -1;
+            p = q;
+        } else {
+            /* Let go of whatever can no longer be part of a match. */
+            for (b = f->matched; b && f->secret[b] != *p; b = f->fail[b])
+                ;
+            if (f->secret[b] != *p) {
+                if (slices_push(out, f->secret, f->matched) < 0)
+                    return -1;
+                f->matched = 0;
+                run = p;
+                continue;
+            }
+            if (slices_push(out, f->secret, f->matched - b) < 0)
+                return -1;
+            f->matched = b;
+        }
+        f->matched++;
+        run = ++p;
+        if (f->matched == f->len) {
+            if (slices_push(out, FILTER_REDACTED, strlen(FILTER_REDACTED)) < 0)
+                return -1;
+            f->matched = 0;
+            f->redacted++;
+        }
+    }
+    if (f->matched == 0)
+        return slices_push(out, run, end - run);
+    return 0;
+}
+
+static int filter_one(struct filter *f, const struct iovec *iov, size_t niov,
+                      struct filter_slices *out, int finishing) {
+    const unsigned char *p;
+    size_t i;
+    int err = 0;
+
+    out->count = 0;
+    f->stamp_len = 0;
+    for (i = 0; i < niov && err == 0; i++) {
+        p = iov[i].iov_base;
+        switch (f->kind) {
+        case FILTER_STRIP_ANSI:
+            err = strip_ansi(f, p, p + iov[i].iov_len, out);
+            break;
+        case FILTER_TIMESTAMP:
+            err = timestamp(f, p, p + iov[i].iov_len, out);
+            break;
+        case FILTER_REDACT:
+            err = redact(f, p, p + iov[i].iov_len, out);
+            break;
+        }
+    }
+    /* The output is over, so what was held back is no secret. */
+    if (finishing && f->kind == FILTER_REDACT && err == 0) {
+        err = slices_push(out, f->secret, f->matched);
+        f->matched = 0;
+    }
+    return err;
+}
+
+ssize_t filter_run(struct filter_chain *c, const struct iovec *iov, size_t niov,
+                   const struct iovec **out) {
+    size_t i;
+    int k;
+
+    for (i = 0; i < niov; i++)
+        c->in += iov[i].iov_len;
+    for (k = 0; k < c->count; k++) {
+        if (filter_one(&c->f[k], iov, niov, &c->slices[k % 2], c->finishing) < 0) {
+            error("Out of memory filtering output; some was lost.");
+            return -1;
+        }
+        iov = c->slices[k % 2].iov;
+        niov = c->slices[k % 2].count;
+    }
+    for (i = 0; i < niov; i++)
+        c->out += iov[i].iov_len;
+    *out = iov;
+    return niov;
+}
+
+ssize_t filter_finish(struct filter_chain *c, const struct iovec **out) {
+    ssize_t n;
+
+    c->finishing = 1;
+    n = filter_run(c, NULL, 0, out);
+    c->finishing = 0;
+    return n;
+}
+
+void filter_report(const struct filter_chain *c) {
+    int k;
+
+    if (c->count == 0)
+        return;
+    debug("filters: %llu bytes in, %llu out", c->in, c->out);
+    for (k = 0; k < c->count; k++)
+        if (c->f[k].kind == FILTER_REDACT)
+            debug("  redacted \"%s\" %llu times", c->f[k].secret, c->f[k].redacted);
+}
+
+void filter_free(struct filter_chain *c) {
+    int k;
+
+    for (k = 0; k < c->count; k++) {
+        free(c->f[k].secret);
+        free(c->f[k].fail);
+    }
+    free(c->slices[0].iov);
+    free(c->slices[1].iov);
+    memset(c, 0, sizeof *c);
+}
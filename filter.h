@@ -0,0 +1,102 @@
+/*
+ * Copyright (C) 2011 by Nelson Elhage
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#ifndef FILTER_H
+#define FILTER_H
+
+#include <stddef.h>
+#include <sys/uio.h>
+
+/*
+ * A chain of filters that output goes through on its way to everything
+ * but our own terminal: the screen model and viewers, the history, the
+ * recording, the ring, the triggers and --capture's log.
+ *
+ * Output travels down the chain as a list of slices. A filter passes on
+ * slices of what it was given wherever it leaves bytes alone, and adds
+ * slices of its own (a timestamp, a redaction) where it changes them,
+ * so nothing is copied on the way. Slices are only good until the chain
+ * runs again.
+ */
+
+enum filter_kind {
+    /* Drop escape sequences, and control characters but tab and newline */
+    FILTER_STRIP_ANSI = 1,
+    /* Start each line with the local time it turned up */
+    FILTER_TIMESTAMP,
+    /* Replace a string with FILTER_REDACTED */
+    FILTER_REDACT,
+};
+
+#define FILTER_MAX 16
+#define FILTER_REDACTED "[redacted]"
+
+struct filter {
+    enum filter_kind kind;
+    /* FILTER_STRIP_ANSI: how far into an escape sequence we are */
+    int esc;
+    /* FILTER_TIMESTAMP: at the start of a line, and this run's stamp */
+    int bol;
+    char stamp[40];
+    size_t stamp_len;
+    /* FILTER_REDACT: the string, its KMP failure function, and how much has matched */
+    char *secret;
+    size_t len;
+    size_t *fail;
+    size_t matched;
+    unsigned long long redacted;
+};
+
+struct filter_slices {
+    struct iovec *iov;
+    size_t count;
+    size_t cap;
+};
+
+struct filter_chain {
+    struct filter f[FILTER_MAX];
+    int count;
+    /* Each filter's output is the next one's input. */
+    struct filter_slices slices[2];
+    int finishing;
+    unsigned long long in;
+    unsigned long long out;
+};
+
+/*
+ * Add a filter to the end of the chain, as given to --filter:
+ * "strip-ansi", "timestamp" or "redact=STRING". Returns -1 with errno
+ * set if `spec' makes no sense.
+ */
+int filter_add(struct filter_chain *c, const char *spec);
+/*
+ * Run `niov' slices of output through the chain, and point `out' at the
+ * result. Returns how many slices that is, or -1 if out of memory, in
+ * which case the output is lost.
+ */
+ssize_t filter_run(struct filter_chain *c, const struct iovec *iov, size_t niov,
+                   const struct iovec **out);
+/* At the end of the output, let go of anything held back. */
+ssize_t filter_finish(struct filter_chain *c, const struct iovec **out);
+void filter_report(const struct filter_chain *c);
+void filter_free(struct filter_chain *c);
+
+#endif
@@ -0,0 +1,420 @@
+/*
+ * Copyright (C) 2011 by Nelson Elhage
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+
+#include "history.h"
+#include "reallocarray.h"
+
+/*
+ * A small LZ77 compressor, laid out like an LZ4 block: a token byte
+ * with the lengths of a run of literals and of the match after it (4
+ * bits each, 15 meaning more bytes follow, LZ4 style), the literals,
+ * then the match as a 16-bit little-endian offset back into the output.
+ * The last sequence has literals only. Terminal output is repetitive
+ * enough that this gets most of what a real compressor would.
+ */
+
+#define LZ_MIN_MATCH 4
+#define LZ_HASH_BITS 12
+/* Leave the last few bytes as literals, so matches never need a bounds check to start. */
+#define LZ_TAIL 12
+
+static uint32_t lz_read32(const unsigned char *p) {
+    uint32_t v;
+
+    memcpy(&v, p, sizeof v);
+    return v;
+}
+
+static unsigned lz_hash(uint32_t v) {
+    return (v * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+static unsigned char *lz_put_len(unsigned char *op, size_t len) {
+    for (; len >= 255; len -= 255)
+        *op++ = 255;
+    *op++ = len;
+    return op;
+}
+
+/* Room needed for a sequence with these lengths, at worst */
+static size_t lz_bound(size_t lit, size_t match) {
+    return 1 + lit / 255 + 1 + lit + 2 + match / 255 + 1;
+}
+
+/* Returns the compressed size, or 0 if it wouldn't fit in `cap'. */
+static size_t lz_compress(const unsigned char *src, size_t len, unsigned char *dst,
+                          size_t cap) {
+    uint32_t table[1 << LZ_HASH_BITS] = { 0 };
+    const unsigned char *ip = src, *anchor = src, *end = src + len;
+    const unsigned char *limit = len > LZ_TAIL ? end - LZ_TAIL : src;
+    const unsigned char *ref, *m, *r;
+    unsigned char *op = dst, *token;
+    size_t lit, match, off;
+    uint32_t seq;
+    unsigned h;
+
+    while (ip < limit) {
+        seq = lz_read32(ip);
+        h = lz_hash(seq);
+        ref = src + table[h];
+        table[h] = ip - src;
+        if (ref >= ip || ip - ref > 65535 || lz_read32(ref) != seq) {
+            ip++;
+            continue;
+        }
+        for (m = ip + LZ_MIN_MATCH, r = ref + LZ_MIN_MATCH; m < end && *m == *r; m++, r++)
+            ;
+        lit = ip - anchor;
+        match = m - ip - LZ_MIN_MATCH;
+        if (lz_bound(lit, match) > cap - (op - dst))
+            return 0;
+        token = op++;
+        *token = (lit < 15 ? lit : 15) << 4 | (match < 15 ? match : 15);
+        if (lit >= 15)
+            op = lz_put_len(op, lit - 15);
+        memcpy(op, anchor, lit);
+        op += lit;
+        off = ip - ref;
+        *op++ = off & 0xff;
+        *op++ = off >> 8;
+        if (match >= 15)
+            op = lz_put_len(op, match - 15);
+        ip = anchor = m;
+    }
+    lit = end - anchor;
+    if (lz_bound(lit, 0) > cap - (op - dst))
+        return 0;
+    token = op++;
+    *token = (lit < 15 ? lit : 15) << 4;
+    if (lit >= 15)
+        op = lz_put_len(op, lit - 15);
+    memcpy(op, anchor, lit);
+    op += lit;
+    return op - dst;
+}
+
+static int lz_get_len(const unsigned char **ip, const unsigned char *end, size_t *len) {
+    unsigned char b;
+
+    do {
+        if (*ip >= end)
+            return -1;
+        b = *(*ip)++;
+        *len += b;
+    } while (b == 255);
+    return 0;
+}
+
+/* Returns the decompressed size, or -1 if `src' is corrupt. */
+static ssize_t lz_decompress(const unsigned char *src, size_t len, unsigned char *dst,
+                             size_t cap) {
+    const unsigned char *ip = src, *end = src + len;
+    unsigned char *op = dst, *oend = dst + cap;
+    size_t lit, match, off;
+    unsigned char token;
+
+    while (ip < end) {
+        token = *ip++;
+        lit = token >> 4;
+        if (lit == 15 && lz_get_len(&ip, end, &lit) < 0)
+            return -1;
+        if (lit > (size_t)(end - ip) || lit > (size_t)(oend - op))
+            return -1;
+        memcpy(op, ip, lit);
+        op += lit;
+        ip += lit;
+        if (ip == end)
+            break;
+        if (end - ip < 2)
+            return -1;
+        off = ip[0] | ip[1] << 8;
+        ip += 2;
+        match = token & 15;
+        if (match == 15 && lz_get_len(&ip, end, &match) < 0)
+            return -1;
+        match += LZ_MIN_MATCH;
+        if (off == 0 || off > (size_t)(op - dst) || match > (size_t)(oend - op))
+            return -1;
+        /* Byte by byte: the match may overlap what it's producing. */
+        for (; match > 0; match--, op++)
+            *op = op[-off];
+    }
+    return op - dst;
+}
+
+int history_init(struct history *h, size_t budget, const char *spill) {
+    memset(h, 0, sizeof *h);
+    h->spill_fd = -1;
+    /* At least the block being filled, the spare and one more */
+    h->budget = budget > 3 * HISTORY_BLOCK_SIZE ? budget : 3 * HISTORY_BLOCK_SIZE;
+    if (spill &&
+        (h->spill_fd = open(spill, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600)) < 0)
+        return -1;
+    if ((h->cur = malloc(HISTORY_BLOCK_SIZE)) == NULL ||
+        (h->spare = malloc(HISTORY_BLOCK_SIZE)) == NULL) {
+        history_free(h);
+        errno = ENOMEM;
+        return -1;
+    }
+    h->memory = 2 * HISTORY_BLOCK_SIZE;
+    return 0;
+}
+
+void history_free(struct history *h) {
+    size_t i;
+
+    for (i = h->first; i < h->first + h->count; i++)
+        free(h->blocks[i].data);
+    free(h->blocks);
+    free(h->cur);
+    free(h->spare);
+    if (h->spill_fd >= 0)
+        close(h->spill_fd);
+    memset(h, 0, sizeof *h);
+    h->spill_fd = -1;
+}
+
+/* Compress the oldest sealed block that isn't yet. */
+static void history_pack(struct history *h) {
+    unsigned char packed[HISTORY_BLOCK_SIZE];
+    struct history_block *b;
+    char *raw, *data;
+    size_t n;
+
+    b = &h->blocks[h->next_pack++];
+    b->state = HISTORY_PACKED;
+    n = lz_compress((unsigned char *)b->data, b->raw_len, packed, b->raw_len - 1);
+    /* If it's incompressible (or we're out of memory), keep it as it is. */
+    if (n == 0 || (data = malloc(n)) == NULL)
+        return;
+    memcpy(data, packed, n);
+    raw = b->data;
+    b->data = data;
+    b->len = n;
+    h->packed_in += b->raw_len;
+    h->packed_out += n;
+    h->memory += n;
+    /* Keep one buffer around for the next block to fill. */
+    if (h->spare == NULL && b->raw_len == HISTORY_BLOCK_SIZE) {
+        h->spare = raw;
+    } else {
+        free(raw);
+        h->memory -= b->raw_len;
+    }
+}
+
+/* Reuse the slots of dropped blocks, once there are enough of them. */
+static void history_compact(struct history *h) {
+    if (h->first < h->alloc / 2)
+        return;
+    memmove(h->blocks, h->blocks + h->first, h->count * sizeof *h->blocks);
+    h->next_spill -= h->first;
+    h->next_pack -= h->first;
+    h->first = 0;
+}
+
+/*
+ * Move the oldest block in memory out of it, one way or the other,
+ * compressing it first (as a step of its own) if it isn't yet.
+ */
+static void history_evict(struct history *h) {
+    struct history_block *b;
+    ssize_t n;
+
+    if (h->next_pack == h->next_spill) {
+        history_pack(h);
+        return;
+    }
+    b = &h->blocks[h->next_spill];
+    if (h->spill_fd >= 0) {
+        n = pwrite(h->spill_fd, b->data, b->len, h->spill_size);
+        if (n == (ssize_t)b->len) {
+            free(b->data);
+            b->data = NULL;
+            b->offset = h->spill_size;
+            b->state = HISTORY_SPILLED;
+            h->spill_size += n;
+            h->memory -= b->len;
+            h->spilled += b->raw_len;
+            h->next_spill++;
+            return;
+        }
+        /* The disk is full, say: carry on without it. */
+        close(h->spill_fd);
+        h->spill_fd = -1;
+    }
+    /* What's kept has to be contiguous, so anything older goes too. */
+    while (h->first <= h->next_spill) {
+        b = &h->blocks[h->first++];
+        h->count--;
+        if (b->state != HISTORY_SPILLED) {
+            free(b->data);
+            h->memory -= b->len;
+        }
+        h->dropped += b->raw_len;
+    }
+    h->next_spill = h->first;
+    if (h->next_pack < h->first)
+        h->next_pack = h->first;
+    history_compact(h);
+}
+
+void history_work(struct history *h) {
+    if (h->memory > h->budget && h->next_spill < h->first + h->count)
+        history_evict(h);
+    else if (h->next_pack < h->first + h->count)
+        history_pack(h);
+    /* Have a buffer ready, so sealing the next block doesn't need one. */
+    if (h->spare == NULL && (h->spare = malloc(HISTORY_BLOCK_SIZE)) != NULL)
+        h->memory += HISTORY_BLOCK_SIZE;
+}
+
+static void history_seal(struct history *h) {
+    struct history_block *b;
+
+    if (h->first + h->count == h->alloc) {
+        size_t alloc = h->alloc ? h->alloc * 2 : 64;
+        struct history_block *blocks = xreallocarray(h->blocks, alloc, sizeof *blocks);
+
+        if (blocks == NULL) {
+            /* Lose this block rather than what comes after it. */
+            h->dropped += h->cur_len;
+            h->cur_len = 0;
+            return;
+        }
+        h->blocks = blocks;
+        h->alloc = alloc;
+    }
+    b = &h->blocks[h->first + h->count++];
+    memset(b, 0, sizeof *b);
+    b->state = HISTORY_RAW;
+    b->data = h->cur;
+    b->len = b->raw_len = h->cur_len;
+    if (h->spare) {
+        h->cur = h->spare;
+        h->spare = NULL;
+    } else {
+        /* Only if history_work() hasn't run since the last block filled up */
+        h->cur = malloc(HISTORY_BLOCK_SIZE);
+        h->memory += HISTORY_BLOCK_SIZE;
+    }
+    h->cur_len = 0;
+    if (h->cur == NULL) {
+        /* Out of memory: keep going with what's already sealed. */
+        h->memory -= HISTORY_BLOCK_SIZE;
+        h->cur = b->data;
+        h->count--;
+        h->dropped += b->raw_len;
+    }
+}
+
+void history_write(struct history *h, const void *buf, size_t len) {
+    size_t n;
+
+    h->total += len;
+    while (len > 0) {
+        n = HISTORY_BLOCK_SIZE - h->cur_len;
+        if (n > len)
+            n = len;
+        memcpy(h->cur + h->cur_len, buf, n);
+        h->cur_len += n;
+        buf = (const char *)buf + n;
+        len -= n;
+        if (h->cur_len == HISTORY_BLOCK_SIZE)
+            history_seal(h);
+    }
+}
+
+static int write_all(int fd, const char *buf, size_t len) {
+    ssize_t n;
+
+    while (len > 0) {
+        n = write(fd, buf, len);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -1;
+        buf += n;
+        len -= n;
+    }
+    return 0;
+}
+
+int history_dump(struct history *h, int fd) {
+    struct history_block *b;
+    char *map = MAP_FAILED, *raw, *data;
+    ssize_t n;
+    size_t i;
+    int err = 0;
+
+    if ((raw = malloc(HISTORY_BLOCK_SIZE)) == NULL)
+        return -1;
+    if (h->spill_size > 0 && h->spill_fd >= 0)
+        map = mmap(NULL, h->spill_size, PROT_READ, MAP_SHARED, h->spill_fd, 0);
+    for (i = h->first; i < h->first + h->count && err == 0; i++) {
+        b = &h->blocks[i];
+        if (b->state == HISTORY_SPILLED && map == MAP_FAILED) {
+            err = -1;
+            break;
+        }
+        data = b->state == HISTORY_SPILLED ? map + b->offset : b->data;
+        if (b->len == b->raw_len) {
+            err = write_all(fd, data, b->len);
+            continue;
+        }
+        n = lz_decompress((unsigned char *)data, b->len, (unsigned char *)raw,
+                          HISTORY_BLOCK_SIZE);
+        err = n < 0 ? -1 : write_all(fd, raw, n);
+    }
+    if (err == 0)
+        err = write_all(fd, h->cur, h->cur_len);
+    if (map != MAP_FAILED)
+        munmap(map, h->spill_size);
+    free(raw);
+    return err;
+}
+
+int history_dump_background(struct history *h, int fd) {
+    pid_t pid = fork();
+
+    /* Fork twice, so nobody has to reap the one doing the work. */
+    if (pid == 0) {
+        if (fork() == 0) {
+            /* fd may be a viewer's socket, which is usually non-blocking. */
+            fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK);
+            _exit(history_dump(h, fd) < 0);
+        }
+        _exit(0);
+    }
+    if (pid < 0)
+        return -1;
+    waitpid(pid, NULL, 0);
+    return 0;
+}
@@ -0,0 +1,122 @@
+/*
+ * Copyright (C) 2011 by Nelson Elhage
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#ifndef HISTORY_H
+#define HISTORY_H
+
+#include <sys/types.h>
+
+/*
+ * Everything the program ever wrote, kept in a bounded amount of
+ * memory. Output is copied into fixed-size blocks. Once a block fills
+ * up it is sealed, and later compressed when there's nothing better to
+ * do. When the blocks take more than the budget, the oldest ones move
+ * to a spill file, or are thrown away if there isn't one. That also
+ * waits for history_work(), so memory can run a block or two over.
+ */
+
+#define HISTORY_BLOCK_SIZE (64 * 1024)
+
+enum history_state {
+    /* Sealed, but not yet compressed */
+    HISTORY_RAW = 0,
+    /* Compressed, unless that didn't make it smaller (len == raw_len) */
+    HISTORY_PACKED,
+    /* Only in the spill file, at `offset' */
+    HISTORY_SPILLED,
+};
+
+struct history_block {
+    enum history_state state;
+    char *data;
+    size_t len;
+    size_t raw_len;
+    off_t offset;
+};
+
+struct history {
+    size_t budget;
+    /* Sealed blocks, oldest first; blocks[first] is the oldest kept. */
+    struct history_block *blocks;
+    size_t first;
+    size_t count;
+    size_t alloc;
+    /* The oldest block that's neither spilled nor compressed */
+    size_t next_spill;
+    size_t next_pack;
+    /* The block being filled */
+    char *cur;
+    size_t cur_len;
+    /* A compressed block's old buffer, for the next one to reuse */
+    char *spare;
+    /* Bytes of blocks in memory, including the current one */
+    size_t memory;
+    int spill_fd;
+    off_t spill_size;
+
+    unsigned long long total;
+    unsigned long long packed_in;
+    unsigned long long packed_out;
+    unsigned long long spilled;
+    unsigned long long dropped;
+};
+
+/*
+ * Keep at most about `budget' bytes in memory, spilling to a file
+ * created at `spill' if that's set. Returns -1 and sets errno on error.
+ */
+int history_init(struct history *h, size_t budget, const char *spill);
+void history_free(struct history *h);
+
+/* Append output. This only copies; the rest is left to history_work(). */
+void history_write(struct history *h, const void *buf, size_t len);
+
+/* Is there a sealed block that history_work() could compress or spill? */
+static inline int history_pending(const struct history *h) {
+    size_t end = h->first + h->count;
+
+    return h->next_pack < end || (h->memory > h->budget && h->next_spill < end);
+}
+
+/*
+ * Has so much output come in without the loop going idle that
+ * history_work() has to run anyway?
+ */
+static inline int history_overdue(const struct history *h) {
+    return h->memory > h->budget + 2 * HISTORY_BLOCK_SIZE && history_pending(h);
+}
+
+/*
+ * Compress or spill one sealed block. Call when the loop has nothing
+ * else to do, or when history_overdue().
+ */
+void history_work(struct history *h);
+
+/* Write everything that's kept, in order, to fd. Blocks until done. */
+int history_dump(struct history *h, int fd);
+
+/*
+ * Write the history to fd from a copy of this process, so that the
+ * caller doesn't wait. Returns -1 if the copy couldn't be made.
+ */
+int history_dump_background(struct history *h, int fd);
+
+#endif
@@ -0,0 +1,616 @@
+/*
+ * Copyright (C) 2011 by Nelson Elhage
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+
+#include "reptyr.h"
+#include "mux.h"
+#include "reallocarray.h"
+#include "platform/platform.h"
+
+static struct mux_session *mux_find(struct mux *m, unsigned id) {
+    size_t lo = 0, hi = m->n_sessions;
+
+    /* Sessions are kept in the order they were made, so by id. */
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+
+        if (m->sessions[mid]->id < id)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    if (lo < m->n_sessions && m->sessions[lo]->id == id)
+        return m->sessions[lo];
+    return NULL;
+}
+
+static void session_update(struct mux_session *s) {
+    int events = EV_READ;
+
+    if (ringbuf_used(&s->in))
+        events |= EV_WRITE;
+    if (ev_set(&s->mux->loop, &s->pty_watch, events) < 0)
+        error("Unable to watch session %u: %s", s->id, strerror(errno));
+}
+
+static void session_flush(struct mux_session *s) {
+    struct iovec iov[2];
+    ssize_t n;
+    int cnt;
+
+    while ((cnt = ringbuf_used_iov(&s->in, iov)) > 0) {
+        n = writev(s->pty, iov, cnt);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0) {
+            /* Either the pty is full, or it's gone and reading will notice. */
+            if (errno != EAGAIN)
+                ringbuf_consume(&s->in, ringbuf_used(&s->in));
+            return;
+        }
+        ringbuf_consume(&s->in, n);
+    }
+}
+
+static void session_input(void *data, const char *buf, size_t len) {
+    struct mux_session *s = data;
+
+    if (ringbuf_put(&s->in, buf, len) < len)
+        debug("Dropped input to session %u: the input buffer is full.", s->id);
+    session_flush(s);
+    session_update(s);
+}
+
+static void session_resize(void *data, int rows, int cols) {
+    struct mux_session *s = data;
+    struct winsize sz = { .ws_row = rows, .ws_col = cols };
+
+    if (ioctl(s->pty, TIOCSWINSZ, &sz) < 0) {
+        debug("Unable to resize session %u: %s", s->id, strerror(errno));
+        return;
+    }
+    if (term_resize(&s->screen, rows, cols) < 0) {
+        error("Out of memory resizing session %u.", s->id);
+        return;
+    }
+    share_resync(&s->share);
+}
+
+static void session_dump(void *data, int fd) {
+    struct mux_session *s = data;
+
+    if (history_dump_background(&s->history, fd) < 0)
+        error("Unable to fork to dump the history: %s", strerror(errno));
+}
+
+static void session_free(struct mux_session *s) {
+    struct mux *m = s->mux;
+    size_t i;
+
+    debug("Session %u ended after %llu bytes in %llu reads; %llu of history "
+          "compressed to %llu, %llu dropped.", s->id, s->bytes, s->reads,
+          s->history.packed_in, s->history.packed_out, s->history.dropped);
+    for (i = 0; i < m->n_sessions && m->sessions[i] != s; i++)
+        ;
+    if (i < m->n_sessions) {
+        memmove(m->sessions + i, m->sessions + i + 1,
+                (m->n_sessions - i - 1) * sizeof *m->sessions);
+        m->n_sessions--;
+    }
+    share_close(&s->share);
+    ev_del(&m->loop, &s->pty_watch);
+    ev_del(&m->loop, &s->exit_watch);
+    if (s->exit_watch.fd >= 0)
+        close(s->exit_watch.fd);
+    close(s->pty);
+    history_free(&s->history);
+    term_free(&s->screen);
+    ringbuf_free(&s->in);
+    free(s);
+}
+
+/*
+ * Read one quantum of output, at most. Returns 0 once the pty is done
+ * for, e.g. because everything that had it open has exited.
+ */
+static int session_read(struct mux_session *s) {
+    static char buf[MUX_QUANTUM];
+    ssize_t n;
+
+    do {
+        n = read(s->pty, buf, sizeof buf);
+    } while (n < 0 && errno == EINTR);
+    if (n < 0)
+        return errno == EAGAIN;
+    if (n == 0)
+        return 0;
+    s->bytes += n;
+    s->reads++;
+    term_write(&s->screen, buf, n);
+    share_output(&s->share, buf, n);
+    history_write(&s->history, buf, n);
+    return 1;
+}
+
+static void session_ready(struct event_loop *loop, struct watch *w, int revents) {
+    struct mux_session *s = w->data;
+
+    if (revents & EV_WRITE)
+        session_flush(s);
+    /*
+     * Just the one read, even if there's more: the pty stays readable,
+     * so we're back next round, after everyone else has had a go.
+     */
+    if ((revents & (EV_READ | EV_ERROR)) && session_read(s) == 0) {
+        session_free(s);
+        return;
+    }
+    session_update(s);
+}
+
+static void session_exited(struct event_loop *loop, struct watch *w, int revents) {
+    struct mux_session *s = w->data;
+    int i;
+
+    debug("Session %u: pid %d exited.", s->id, (int)s->target);
+    /* Pick up what it wrote on the way out, but don't wait for more. */
+    for (i = 0; i < 64 && session_read(s) > 0; i++)
+        ;
+    session_free(s);
+}
+
+static struct mux_session *session_new(struct mux *m, int pty, pid_t target) {
+    const struct proxy_options *opts = m->opts;
+    struct mux_session *s;
+    struct winsize sz;
+
+    if (m->n_sessions == m->allocated) {
+        size_t n = m->allocated ? 2 * m->allocated : 16;
+        struct mux_session **sessions = xreallocarray(m->sessions, n, sizeof *sessions);
+
+        if (sessions == NULL)
+            return NULL;
+        m->sessions = sessions;
+        m->allocated = n;
+    }
+    if ((s = calloc(1, sizeof *s)) == NULL)
+        return NULL;
+    if (ioctl(pty, TIOCGWINSZ, &sz) < 0 || !sz.ws_row || !sz.ws_col)
+        sz.ws_row = 24, sz.ws_col = 80;
+    if (term_init(&s->screen, sz.ws_row, sz.ws_col) < 0 ||
+        term_set_history(&s->screen, opts->scrollback ? opts->scrollback
+                                                      : MUX_DEFAULT_SCROLLBACK) < 0 ||
+        history_init(&s->history, opts->history ? opts->history
+                                                : MUX_DEFAULT_HISTORY, NULL) < 0 ||
+        ringbuf_init(&s->in, MUX_INPUT_BUFFER) < 0) {
+        history_free(&s->history);
+        term_free(&s->screen);
+        ringbuf_free(&s->in);
+        free(s);
+        return NULL;
+    }
+    s->mux = m;
+    s->id = ++m->next_id;
+    s->pty = pty;
+    s->target = target;
+    fcntl(pty, F_SETFL, fcntl(pty, F_GETFL) | O_NONBLOCK);
+    share_init(&s->share, &m->loop, &s->screen);
+    s->share.input = session_input;
+    s->share.resize = session_resize;
+    s->share.dump = session_dump;
+    s->share.data = s;
+    ev_watch_init(&s->pty_watch, pty, session_ready, s);
+    ev_watch_init(&s->exit_watch, -1, session_exited, s);
+    m->sessions[m->n_sessions++] = s;
+    session_update(s);
+    if (target > 0 && ev_add_exit(&m->loop, &s->exit_watch, target) < 0)
+        debug("Unable to watch pid %d for exit: %s", (int)target, strerror(errno));
+    debug("Session %u: pid %d, %dx%d.", s->id, (int)target, sz.ws_col, sz.ws_row);
+    return s;
+}
+
+static void client_close(struct mux_client *c) {
+    struct mux *m = c->mux;
+    struct mux_client **p;
+
+    for (p = &m->clients; *p != c; p = &(*p)->next)
+        ;
+    *p = c->next;
+    if (c->helper > 0) {
+        /* We're shutting down halfway through attaching. */
+        ev_del(&m->loop, &c->helper_watch);
+        close(c->helper_watch.fd);
+        kill(c->helper, SIGKILL);
+        waitpid(c->helper, NULL, 0);
+    }
+    if (c->watch.fd >= 0) {
+        ev_del(&m->loop, &c->watch);
+        close(c->watch.fd);
+    }
+    free(c);
+}
+
+/* Best effort: replies are short, and whoever asked is waiting for one. */
+static void client_reply(struct mux_client *c, const char *buf, size_t len) {
+    if (send(c->watch.fd, buf, len, MSG_NOSIGNAL) < (ssize_t)len)
+        debug("Unable to reply in full to a client of the mux.");
+}
+
+/*
+ * Runs in a child, so that the mux carries on while we wait for the
+ * target to get around to the syscalls we make it do, and so a failure
+ * takes nobody else down with it. Sends back an errno, then the pty.
+ */
+static void attach_helper(int sock, pid_t pid, int flags) {
+    char cbuf[CMSG_SPACE(sizeof(int))] = {};
+    struct msghdr msg = {};
+    struct iovec iov;
+    struct cmsghdr *cmsg;
+    int pty = -1, err;
+
+    if (flags & SHARE_ATTACH_STEAL) {
+        err = steal_pty(pid, &pty);
+    } else if ((pty = get_pt()) < 0 || unlockpt(pty) < 0 || grantpt(pty) < 0) {
+        err = errno;
+    } else {
+        err = attach_child(pid, ptsname(pty), flags & SHARE_ATTACH_STDIO);
+    }
+    iov.iov_base = &err;
+    iov.iov_len = sizeof err;
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    if (err == 0) {
+        msg.msg_control = cbuf;
+        msg.msg_controllen = sizeof cbuf;
+        cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+        memcpy(CMSG_DATA(cmsg), &pty, sizeof(int));
+    }
+    _exit(sendmsg(sock, &msg, MSG_NOSIGNAL) < 0);
+}
+
+static void helper_ready(struct event_loop *loop, struct watch *w, int revents) {
+    struct mux_client *c = w->data;
+    char cbuf[CMSG_SPACE(sizeof(int))];
+    struct iovec iov;
+    struct msghdr msg = {};
+    struct cmsghdr *cmsg;
+    struct mux_session *s = NULL;
+    char reply[256];
+    int pty = -1, err = EPIPE;
+    ssize_t n;
+
+    iov.iov_base = &err;
+    iov.iov_len = sizeof err;
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = cbuf;
+    msg.msg_controllen = sizeof cbuf;
+    n = recvmsg(w->fd, &msg, MSG_CMSG_CLOEXEC);
+    if (n < 0 && errno == EAGAIN)
+        return;
+    if (n == (ssize_t)sizeof err && err == 0 && (cmsg = CMSG_FIRSTHDR(&msg)) &&
+        cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS)
+        memcpy(&pty, CMSG_DATA(cmsg), sizeof(int));
+    else if (n != (ssize_t)sizeof err || err == 0)
+        err = EPIPE;
+    ev_del(loop, w);
+    close(w->fd);
+    waitpid(c->helper, NULL, 0);
+    c->helper = 0;
+
+    if (pty >= 0 && (s = session_new(c->mux, pty, c->pid)) == NULL) {
+        err = ENOMEM;
+        close(pty);
+    }
+    if (s) {
+        snprintf(reply, sizeof reply, "%u\n", s->id);
+    } else {
+        snprintf(reply, sizeof reply, "error: Unable to attach to pid %d: %s\n",
+                 (int)c->pid, strerror(err));
+        error("Unable to attach to pid %d: %s", (int)c->pid, strerror(err));
+    }
+    client_reply(c, reply, strlen(reply));
+    client_close(c);
+}
+
+static void client_attach(struct mux_client *c, const unsigned char *buf) {
+    int sv[2];
+
+    c->pid = (pid_t)((uint32_t)buf[0] << 24 | buf[1] << 16 | buf[2] << 8 | buf[3]);
+    if (c->pid < 1 || socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv) < 0) {
+        client_close(c);
+        return;
+    }
+    if ((c->helper = fork()) == 0) {
+        close(sv[0]);
+        attach_helper(sv[1], c->pid, buf[4]);
+    }
+    close(sv[1]);
+    if (c->helper < 0) {
+        error("Unable to fork to attach to pid %d: %s", (int)c->pid, strerror(errno));
+        close(sv[0]);
+        client_close(c);
+        return;
+    }
+    /* Nothing more to hear from the client until we have an answer. */
+    ev_del(&c->mux->loop, &c->watch);
+    ev_watch_init(&c->helper_watch, sv[0], helper_ready, c);
+    if (ev_add(&c->mux->loop, &c->helper_watch, EV_READ) < 0) {
+        close(sv[0]);
+        kill(c->helper, SIGKILL);
+        waitpid(c->helper, NULL, 0);
+        c->helper = 0;
+        client_close(c);
+    }
+}
+
+static void client_list(struct mux_client *c) {
+    struct mux *m = c->mux;
+    char *buf;
+    size_t size = 80 * (m->n_sessions + 1), len = 0, i;
+
+    if ((buf = malloc(size)) == NULL) {
+        client_close(c);
+        return;
+    }
+    len += snprintf(buf + len, size - len, "%6s %8s %7s %7s %12s %10s\n",
+                    "ID", "PID", "SIZE", "VIEWERS", "OUTPUT", "HISTORY");
+    for (i = 0; i < m->n_sessions; i++) {
+        struct mux_session *s = m->sessions[i];
+        char dims[16];
+        int j, viewers = 0;
+
+        for (j = 0; j < SHARE_MAX_VIEWERS; j++)
+            viewers += s->share.viewers[j] != NULL;
+        snprintf(dims, sizeof dims, "%dx%d", s->screen.cols, s->screen.rows);
+        len += snprintf(buf + len, size - len, "%6u %8d %7s %7d %12llu %10zu\n",
+                        s->id, (int)s->target, dims, viewers, s->bytes,
+                        s->history.memory);
+    }
+    client_reply(c, buf, len < size ? len : size - 1);
+    free(buf);
+    client_close(c);
+}
+
+/* The client said what it wants, in the message in c->msg. */
+static void client_request(struct mux_client *c) {
+    size_t len = c->len - SHARE_HEADER;
+    unsigned char *buf = c->msg + SHARE_HEADER;
+    struct mux_session *s;
+    unsigned id;
+    int fd;
+
+    switch (c->msg[0]) {
+    case SHARE_SELECT:
+        if (len != 4)
+            break;
+        id = (uint32_t)buf[0] << 24 | buf[1] << 16 | buf[2] << 8 | buf[3];
+        if ((s = mux_find(c->mux, id)) == NULL) {
+            debug("A client asked for session %u, which doesn't exist.", id);
+            client_close(c);
+            return;
+        }
+        /* From here on, the session's server reads what the client sends. */
+        fd = c->watch.fd;
+        ev_del(&c->mux->loop, &c->watch);
+        c->watch.fd = -1;
+        client_close(c);
+        share_adopt(&s->share, fd);
+        return;
+    case SHARE_LIST:
+        client_list(c);
+        return;
+    case SHARE_ATTACH:
+        if (len != 5)
+            break;
+        client_attach(c, buf);
+        return;
+    }
+    debug("Hanging up on a mux client that sent message %d (%zu bytes).",
+          c->msg[0], len);
+    client_close(c);
+}
+
+/*
+ * Read exactly one message, and not a byte more: whatever comes after a
+ * SHARE_SELECT is for the session.
+ */
+static void client_ready(struct event_loop *loop, struct watch *w, int revents) {
+    struct mux_client *c = w->data;
+    size_t want;
+    ssize_t n;
+
+    for (;;) {
+        want = SHARE_HEADER;
+        if (c->len >= SHARE_HEADER)
+            want += c->msg[1] << 8 | c->msg[2];
+        if (want > sizeof c->msg) {
+            client_close(c);
+            return;
+        }
+        if (c->len == want)
+            break;
+        n = read(w->fd, c->msg + c->len, want - c->len);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0 && errno == EAGAIN)
+            return;
+        if (n <= 0) {
+            client_close(c);
+            return;
+        }
+        c->len += n;
+    }
+    client_request(c);
+}
+
+static void mux_accept(struct event_loop *loop, struct watch *w, int revents) {
+    struct mux *m = w->data;
+    struct mux_client *c;
+    int fd;
+
+    while ((fd = accept4(m->fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0) {
+        if ((c = calloc(1, sizeof *c)) == NULL) {
+            close(fd);
+            continue;
+        }
+        c->mux = m;
+        c->next = m->clients;
+        m->clients = c;
+        ev_watch_init(&c->watch, fd, client_ready, c);
+        if (ev_add(loop, &c->watch, EV_READ) < 0)
+            client_close(c);
+    }
+}
+
+static void mux_stop(struct event_loop *loop, struct watch *w, int revents) {
+    struct mux *m = w->data;
+
+    debug("Stopping the mux.");
+    m->done = 1;
+}
+
+static int mux_listen(struct mux *m, const char *path) {
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    mode_t mask;
+    int err;
+
+    if (strlen(path) >= sizeof addr.sun_path) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    strcpy(addr.sun_path, path);
+    if ((m->fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) < 0)
+        return -1;
+    /* Anyone who can connect can attach to our processes. */
+    mask = umask(0077);
+    err = bind(m->fd, (struct sockaddr *)&addr, sizeof addr);
+    umask(mask);
+    if (err < 0 || listen(m->fd, 64) < 0)
+        return -1;
+    m->path = strdup(path);
+    ev_watch_init(&m->watch, m->fd, mux_accept, m);
+    return ev_add(&m->loop, &m->watch, EV_READ);
+}
+
+/* Does any session have history to compress or spill? */
+static int mux_pending(struct mux *m) {
+    size_t i;
+
+    for (i = 0; i < m->n_sessions; i++)
+        if (history_pending(&m->sessions[i]->history))
+            return 1;
+    return 0;
+}
+
+/*
+ * Compress or spill a block of some session's history, taking turns.
+ * With `idle' unset, only sessions that are history_overdue() get one.
+ */
+static void mux_work(struct mux *m, int idle) {
+    size_t i, n = m->n_sessions;
+
+    for (i = 0; i < n; i++) {
+        struct mux_session *s = m->sessions[(m->next_pack + i) % n];
+
+        if (idle ? history_pending(&s->history) : history_overdue(&s->history)) {
+            history_work(&s->history);
+            m->next_pack = (m->next_pack + i + 1) % n;
+            return;
+        }
+    }
+}
+
+/* Every session needs a pty, and every viewer a socket. */
+static void raise_fd_limit(void) {
+    struct rlimit rl;
+
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+        rl.rlim_cur = rl.rlim_max;
+        if (setrlimit(RLIMIT_NOFILE, &rl) < 0)
+            debug("Unable to raise the limit on open files: %s", strerror(errno));
+    }
+}
+
+void do_mux(const char *path, const struct proxy_options *opts) {
+    struct mux m = { .opts = opts, .fd = -1 };
+    char ready;
+    int ran;
+
+    raise_fd_limit();
+    if (ev_init(&m.loop) < 0)
+        die("Unable to set up the event loop: %m");
+    ev_watch_init(&m.term_watch, -1, mux_stop, &m);
+    ev_watch_init(&m.int_watch, -1, mux_stop, &m);
+    if (ev_add_signal(&m.loop, &m.term_watch, SIGTERM) < 0 ||
+        ev_add_signal(&m.loop, &m.int_watch, SIGINT) < 0)
+        error("Unable to watch for SIGTERM: %s", strerror(errno));
+    ready = mux_listen(&m, path) == 0;
+    if (!ready)
+        error("Unable to listen on %s: %s", path, strerror(errno));
+    if (opts->ready_fd > 0) {
+        if (write(opts->ready_fd, &ready, 1) < 0)
+            debug("Unable to say we're ready: %s", strerror(errno));
+        close(opts->ready_fd);
+    }
+
+    while (ready && !m.done) {
+        /* Don't sleep while there's history to compress or spill. */
+        if ((ran = ev_run_once(&m.loop, mux_pending(&m) ? 0 : -1)) < 0 && errno != EINTR) {
+            error("Event loop failed: %s", strerror(errno));
+            break;
+        }
+        /* Only once nothing else needs doing, unless it's falling behind. */
+        mux_work(&m, ran == 0);
+    }
+
+    while (m.clients)
+        client_close(m.clients);
+    while (m.n_sessions)
+        session_free(m.sessions[m.n_sessions - 1]);
+    free(m.sessions);
+    if (m.fd >= 0) {
+        ev_del(&m.loop, &m.watch);
+        close(m.fd);
+    }
+    if (m.path) {
+        unlink(m.path);
+        free(m.path);
+    }
+    ev_free(&m.loop);
+}
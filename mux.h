@@ -0,0 +1,114 @@
+/*
+ * Copyright (C) 2011 by Nelson Elhage
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#ifndef MUX_H
+#define MUX_H
+
+#include <sys/types.h>
+
+#include "event.h"
+#include "history.h"
+#include "proxy.h"
+#include "ringbuf.h"
+#include "share.h"
+#include "term.h"
+
+/*
+ * One process looking after many sessions: each is a pty master taken
+ * from a process we attached to, with a screen, scrollback, history and
+ * viewers of its own, all served from a single event loop.
+ *
+ * Clients connect to the mux's socket and say which session they want
+ * with SHARE_SELECT, then talk to it as to any shared session. The mux
+ * also answers SHARE_LIST and SHARE_ATTACH.
+ */
+
+/*
+ * The most we read from one session's pty before looking at the others,
+ * so one that floods can't starve the rest.
+ */
+#define MUX_QUANTUM 16384
+#define MUX_INPUT_BUFFER 16384
+#define MUX_DEFAULT_SCROLLBACK 1000
+#define MUX_DEFAULT_HISTORY (1024 * 1024)
+/* The largest request the mux itself answers */
+#define MUX_MAX_REQUEST 8
+
+struct mux;
+
+struct mux_session {
+    struct mux *mux;
+    unsigned id;
+    int pty;
+    pid_t target;
+    struct watch pty_watch;
+    struct watch exit_watch;
+    struct term screen;
+    struct share_server share;
+    struct history history;
+    /* Keystrokes from the writer, on their way to the pty */
+    struct ringbuf in;
+
+    unsigned long long bytes;
+    unsigned long long reads;
+};
+
+/* Someone connected to the mux who hasn't been handed to a session. */
+struct mux_client {
+    struct mux *mux;
+    struct mux_client *next;
+    struct watch watch;
+    unsigned char msg[SHARE_HEADER + MUX_MAX_REQUEST];
+    size_t len;
+    /* For SHARE_ATTACH: the process doing it, and what it's attaching to */
+    pid_t helper;
+    pid_t pid;
+    struct watch helper_watch;
+};
+
+struct mux {
+    const struct proxy_options *opts;
+    struct event_loop loop;
+    int fd;
+    char *path;
+    struct watch watch;
+    struct watch term_watch;
+    struct watch int_watch;
+    int done;
+
+    /* Oldest first, which is also by id */
+    struct mux_session **sessions;
+    size_t n_sessions;
+    size_t allocated;
+    unsigned next_id;
+    /* Where to look first for history to compress, so every session gets a turn */
+    size_t next_pack;
+    struct mux_client *clients;
+};
+
+/*
+ * Serve sessions at `path' until SIGTERM or SIGINT. opts->history is
+ * the memory each session may use for its history, and opts->scrollback
+ * the lines it keeps for viewers.
+ */
+void do_mux(const char *path, const struct proxy_options *opts);
+
+#endif
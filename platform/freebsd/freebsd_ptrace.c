@@ -252,6 +252,18 @@ unsigned long ptrace_remote_syscall(struct ptrace_child *child,
     return rv;
 }
 
+/* There's no syscall stub for FreeBSD yet; callers make the calls one by one. */
+int ptrace_remote_program(struct ptrace_child *child,
+                          child_addr_t addr, size_t len,
+                          struct remote_syscall *calls, int n) {
+    int i;
+
+    for (i = 0; i < n; i++)
+        calls[i].ran = 0;
+    child->error = ENOSYS;
+    return -1;
+}
+
 int ptrace_memcpy_to_child(struct ptrace_child *child, child_addr_t dst, const void *src, size_t n) {
     int scratch;
 
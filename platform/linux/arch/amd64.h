@@ -23,6 +23,29 @@
 
 #define ARCH_HAVE_MULTIPLE_PERSONALITIES
 
+/* ptrace_remote_program()'s stub for 64-bit processes. */
+static const unsigned char x86_program_64[] = {
+    0x48, 0x8b, 0x04, 0x24,             /* 1: mov (%rsp),%rax         */
+    0x48, 0x83, 0xf8, 0xff,             /*    cmp $-1,%rax            */
+    0x74, 0x40,                         /*    je 3f                   */
+    0x48, 0x8b, 0x7c, 0x24, 0x10,       /*    mov 16(%rsp),%rdi       */
+    0x48, 0x8b, 0x74, 0x24, 0x18,       /*    mov 24(%rsp),%rsi       */
+    0x48, 0x8b, 0x54, 0x24, 0x20,       /*    mov 32(%rsp),%rdx       */
+    0x4c, 0x8b, 0x54, 0x24, 0x28,       /*    mov 40(%rsp),%r10       */
+    0x4c, 0x8b, 0x44, 0x24, 0x30,       /*    mov 48(%rsp),%r8        */
+    0x4c, 0x8b, 0x4c, 0x24, 0x38,       /*    mov 56(%rsp),%r9        */
+    0x0f, 0x05,                         /*    syscall                 */
+    0x48, 0x89, 0x44, 0x24, 0x40,       /*    mov %rax,64(%rsp)       */
+    0x48, 0x83, 0x4c, 0x24, 0x08, 0x02, /*    orq $2,8(%rsp)          */
+    0x48, 0x3d, 0x00, 0xf0, 0xff, 0xff, /*    cmp $-4096,%rax         */
+    0x72, 0x07,                         /*    jb 2f                   */
+    0xf6, 0x44, 0x24, 0x08, 0x01,       /*    testb $1,8(%rsp)        */
+    0x75, 0x06,                         /*    jne 3f                  */
+    0x48, 0x83, 0xc4, 0x48,             /* 2: add $72,%rsp            */
+    0xeb, 0xb6,                         /*    jmp 1b                  */
+    0xcc,                               /* 3: int3                    */
+};
+
 static struct ptrace_personality arch_personality[2] = {
     {
         offsetof(struct user, regs.rax),
@@ -33,6 +56,8 @@ static struct ptrace_personality arch_personality[2] = {
         offsetof(struct user, regs.r8),
         offsetof(struct user, regs.r9),
         offsetof(struct user, regs.rip),
+        offsetof(struct user, regs.rsp),
+        x86_program_64, sizeof x86_program_64, 8,
     },
     {
         offsetof(struct user, regs.rax),
@@ -43,6 +68,8 @@ static struct ptrace_personality arch_personality[2] = {
         offsetof(struct user, regs.rdi),
         offsetof(struct user, regs.rbp),
         offsetof(struct user, regs.rip),
+        offsetof(struct user, regs.rsp),
+        x86_program_32, sizeof x86_program_32, 4,
     },
 };
 
@@ -70,6 +97,7 @@ struct syscall_numbers arch_syscall_numbers[2] = {
         .nr_mmap    = 90,
         .nr_mmap2   = 192,
         .nr_munmap  = 91,
+        .nr_mprotect = 125,
         .nr_getsid  = 147,
         .nr_setsid  = 66,
         .nr_setpgid = 57,
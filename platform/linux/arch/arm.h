@@ -19,6 +19,30 @@
  * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
  * THE SOFTWARE.
  */
+/*
+ * ptrace_remote_program()'s stub, in ARM (not Thumb) code; see
+ * linux_ptrace.c. sp walks the list of calls.
+ */
+static const uint32_t arm_program[] = {
+    0xe59d7000,                 /* 1: ldr   r7, [sp]            */
+    0xe3770001,                 /*    cmn   r7, #1              */
+    0x0a00000c,                 /*    beq   3f                  */
+    0xe28d0008,                 /*    add   r0, sp, #8          */
+    0xe890003f,                 /*    ldm   r0, {r0-r5}         */
+    0xef000000,                 /*    svc   #0                  */
+    0xe58d0020,                 /*    str   r0, [sp, #32]       */
+    0xe59d1004,                 /*    ldr   r1, [sp, #4]        */
+    0xe3811002,                 /*    orr   r1, r1, #2          */
+    0xe58d1004,                 /*    str   r1, [sp, #4]        */
+    0xe3700a01,                 /*    cmn   r0, #4096           */
+    0x3a000001,                 /*    bcc   2f                  */
+    0xe3110001,                 /*    tst   r1, #1              */
+    0x1a000001,                 /*    bne   3f                  */
+    0xe28dd024,                 /* 2: add   sp, sp, #36         */
+    0xeaffffef,                 /*    b     1b                  */
+    0xe7f001f0,                 /* 3: udf   #16 (breakpoint)    */
+};
+
 static struct ptrace_personality arch_personality[1] = {
     {
         offsetof(struct user, regs.uregs[0]),
@@ -29,6 +53,8 @@ static struct ptrace_personality arch_personality[1] = {
         offsetof(struct user, regs.uregs[4]),
         offsetof(struct user, regs.uregs[5]),
         offsetof(struct user, regs.ARM_pc),
+        offsetof(struct user, regs.ARM_sp),
+        arm_program, sizeof arm_program, 4,
     }
 };
 
@@ -36,11 +62,24 @@ static inline void arch_fixup_regs(struct ptrace_child *child) {
     child->user.regs.ARM_pc -= 4;
 }
 
+/*
+ * ARM takes the syscall number from the kernel's own copy, not from r7,
+ * so that still needs its own PTRACE_SET_SYSCALL.
+ */
 static inline int arch_set_syscall(struct ptrace_child *child,
+                                   struct user *user,
                                    unsigned long sysno) {
+    user->regs.ARM_pc += 4;
+    user->regs.uregs[7] = sysno;
     return ptrace_command(child, PTRACE_SET_SYSCALL, 0, sysno);
 }
 
+/* The stub is ARM code, whatever mode the child was in. */
+static inline void arch_set_program(struct ptrace_child *child,
+                                    struct user *user) {
+    user->regs.ARM_cpsr &= ~PSR_T_BIT;
+}
+
 static inline int arch_save_syscall(struct ptrace_child *child) {
     unsigned long swi;
     swi = ptrace_command(child, PTRACE_PEEKTEXT, child->user.regs.ARM_pc);
@@ -54,5 +93,5 @@ static inline int arch_save_syscall(struct ptrace_child *child) {
 }
 
 static inline int arch_restore_syscall(struct ptrace_child *child) {
-    return arch_set_syscall(child, child->saved_syscall);
+    return ptrace_command(child, PTRACE_SET_SYSCALL, 0, child->saved_syscall);
 }
@@ -12,6 +12,7 @@
     .nr_mmap2 = -1,
 #endif
     SC(munmap),
+    SC(mprotect),
     SC(getsid),
     SC(setsid),
     SC(setpgid),
@@ -20,6 +20,32 @@
  * THE SOFTWARE.
  */
 
+/*
+ * ptrace_remote_program()'s stub for 32-bit x86; see linux_ptrace.c.
+ * %esp walks the list of calls.
+ */
+static const unsigned char x86_program_32[] = {
+    0x8b, 0x04, 0x24,                   /* 1: mov (%esp),%eax         */
+    0x83, 0xf8, 0xff,                   /*    cmp $-1,%eax            */
+    0x74, 0x36,                         /*    je 3f                   */
+    0x8b, 0x5c, 0x24, 0x08,             /*    mov 8(%esp),%ebx        */
+    0x8b, 0x4c, 0x24, 0x0c,             /*    mov 12(%esp),%ecx       */
+    0x8b, 0x54, 0x24, 0x10,             /*    mov 16(%esp),%edx       */
+    0x8b, 0x74, 0x24, 0x14,             /*    mov 20(%esp),%esi       */
+    0x8b, 0x7c, 0x24, 0x18,             /*    mov 24(%esp),%edi       */
+    0x8b, 0x6c, 0x24, 0x1c,             /*    mov 28(%esp),%ebp       */
+    0xcd, 0x80,                         /*    int $0x80               */
+    0x89, 0x44, 0x24, 0x20,             /*    mov %eax,32(%esp)       */
+    0x83, 0x4c, 0x24, 0x04, 0x02,       /*    orl $2,4(%esp)          */
+    0x3d, 0x00, 0xf0, 0xff, 0xff,       /*    cmp $-4096,%eax         */
+    0x72, 0x07,                         /*    jb 2f                   */
+    0xf6, 0x44, 0x24, 0x04, 0x01,       /*    testb $1,4(%esp)        */
+    0x75, 0x05,                         /*    jne 3f                  */
+    0x83, 0xc4, 0x24,                   /* 2: add $36,%esp            */
+    0xeb, 0xc2,                         /*    jmp 1b                  */
+    0xcc,                               /* 3: int3                    */
+};
+
 struct x86_personality {
     size_t orig_ax;
     size_t ax;
@@ -40,11 +66,19 @@ static inline void arch_fixup_regs(struct ptrace_child *child) {
     *ptr(user, x86pers->ax) = *ptr(user, x86pers->orig_ax);
 }
 
+/*
+ * Turn the saved registers back into what the kernel has at the
+ * syscall-entry stop -- past the syscall instruction, with -ENOSYS in
+ * ax -- asking for sysno instead.
+ */
 static inline int arch_set_syscall(struct ptrace_child *child,
+                                   struct user *user,
                                    unsigned long sysno) {
-    return ptrace_command(child, PTRACE_POKEUSER,
-                          x86_pers(child)->orig_ax,
-                          sysno);
+    struct x86_personality *x86pers = x86_pers(child);
+    *ptr(user, personality(child)->reg_ip) += 2;
+    *ptr(user, x86pers->orig_ax) = sysno;
+    *ptr(user, x86pers->ax) = -ENOSYS;
+    return 0;
 }
 
 static inline int arch_save_syscall(struct ptrace_child *child) {
@@ -56,4 +90,8 @@ static inline int arch_restore_syscall(struct ptrace_child *child) {
     return 0;
 }
 
+static inline void arch_set_program(struct ptrace_child *child,
+                                    struct user *user) {
+}
+
 #undef ptr
@@ -22,7 +22,11 @@
 
 #ifdef __linux__
 
+#include <stdint.h>
+#include <sys/uio.h>
+
 #include "../../ptrace.h"
+#include "../../reptyr.h"
 #include "../platform.h"
 
 /*
@@ -63,6 +67,11 @@ struct ptrace_personality {
     size_t syscall_arg4;
     size_t syscall_arg5;
     size_t reg_ip;
+    size_t reg_sp;
+    /* ptrace_remote_program()'s stub, and the word size it works in */
+    const void *program;
+    size_t program_len;
+    size_t word;
 };
 
 static struct ptrace_personality *personality(struct ptrace_child *child);
@@ -211,48 +220,313 @@ int ptrace_restore_regs(struct ptrace_child *child) {
     return arch_restore_syscall(child);
 }
 
+/*
+ * PTRACE_GET_SYSCALL_INFO (Linux 5.3) reads a syscall's return value
+ * without knowing which register it lives in. Older libcs don't know
+ * about it, so spell out the part of the kernel's struct we use.
+ */
+#ifndef PTRACE_GET_SYSCALL_INFO
+#define PTRACE_GET_SYSCALL_INFO 0x420e
+#endif
+#define SYSCALL_INFO_EXIT 2
+
+struct syscall_info {
+    uint8_t op;
+    uint8_t pad[3];
+    uint32_t arch;
+    uint64_t instruction_pointer;
+    uint64_t stack_pointer;
+    union {
+        struct {
+            uint64_t nr;
+            uint64_t args[6];
+        } entry;
+        struct {
+            int64_t rval;
+            uint8_t is_error;
+        } exit;
+    };
+};
+
+static int have_syscall_info = 1;
+
+static unsigned long syscall_result(struct ptrace_child *child) {
+    struct syscall_info info;
+    unsigned long rv;
+
+    if (have_syscall_info) {
+        memset(&info, 0, sizeof info);
+        if (ptrace_command(child, PTRACE_GET_SYSCALL_INFO,
+                           sizeof info, &info) >= 0 &&
+            info.op == SYSCALL_INFO_EXIT)
+            return info.exit.rval;
+        debug("PTRACE_GET_SYSCALL_INFO: %s; reading the return register.",
+              child->error ? strerror(child->error) : "not at syscall exit");
+        have_syscall_info = 0;
+    }
+    rv = ptrace_command(child, PTRACE_PEEKUSER,
+                        personality(child)->syscall_rv);
+    if (child->error)
+        return -1;
+    return rv;
+}
+
+/*
+ * The child is at a syscall-entry stop. Rather than poke the syscall
+ * number and each argument in separately, build the whole register
+ * image from the saved registers and load it with one PTRACE_SETREGS;
+ * arch_set_syscall makes it look like it was taken at syscall entry.
+ */
 unsigned long ptrace_remote_syscall(struct ptrace_child *child,
                                     unsigned long sysno,
                                     unsigned long p0, unsigned long p1,
                                     unsigned long p2, unsigned long p3,
                                     unsigned long p4, unsigned long p5) {
+    struct ptrace_personality *pers = personality(child);
+    struct user user;
     unsigned long rv;
     if (ptrace_advance_to_state(child, ptrace_at_syscall) < 0)
         return -1;
 
-#define setreg(r, v) do {                                               \
-        if (ptrace_command(child, PTRACE_POKEUSER,                      \
-                           personality(child)->r,                       \
-                           (v)) < 0)                                    \
-            return -1;                                                  \
-    } while (0)
+#define reg(user, r) (*(unsigned long*)((void*)(user) + pers->r))
 
-    if (arch_set_syscall(child, sysno) < 0)
+    memcpy(&user, &child->user, sizeof user);
+    if (arch_set_syscall(child, &user, sysno) < 0)
+        return -1;
+    reg(&user, syscall_arg0) = p0;
+    reg(&user, syscall_arg1) = p1;
+    reg(&user, syscall_arg2) = p2;
+    reg(&user, syscall_arg3) = p3;
+    reg(&user, syscall_arg4) = p4;
+    reg(&user, syscall_arg5) = p5;
+    if (ptrace_command(child, PTRACE_SETREGS, 0, &user) < 0)
         return -1;
-    setreg(syscall_arg0, p0);
-    setreg(syscall_arg1, p1);
-    setreg(syscall_arg2, p2);
-    setreg(syscall_arg3, p3);
-    setreg(syscall_arg4, p4);
-    setreg(syscall_arg5, p5);
 
     if (ptrace_advance_to_state(child, ptrace_after_syscall) < 0)
         return -1;
 
-    rv = ptrace_command(child, PTRACE_PEEKUSER,
-                        personality(child)->syscall_rv);
+    rv = syscall_result(child);
     if (child->error)
         return -1;
 
-    setreg(reg_ip, *(unsigned long*)((void*)&child->user +
-                                     personality(child)->reg_ip));
+    if (ptrace_command(child, PTRACE_POKEUSER, pers->reg_ip,
+                       reg(&child->user, reg_ip)) < 0)
+        return -1;
 
-#undef setreg
+#undef reg
 
     return rv;
 }
 
-int ptrace_memcpy_to_child(struct ptrace_child *child, child_addr_t dst, const void *src, size_t n) {
+/*
+ * Run a list of syscalls in the child in one go, rather than stopping
+ * for each one. We write the arch's stub (see arch/) to addr, which
+ * must be executable, with the calls laid out in the child's word size
+ * right above it:
+ *
+ *     sysno, flags, arg0, ..., arg5, rv
+ *
+ * and terminated by a sysno of -1. The child is sent to the stub with
+ * its stack pointer at the first call and the syscall it was stopped in
+ * skipped. The stub walks the stack pointer up the list, making each
+ * call, storing its return value and setting PROGRAM_RAN, and stops
+ * after a failure flagged PROGRAM_STOP. It then hits a breakpoint and
+ * we put the saved registers back, so that the child goes back to its
+ * own syscall.
+ *
+ * Signals that arrive while the stub runs are dropped, as they are
+ * while we single-step remote syscalls -- that keeps them from pushing
+ * a frame onto our list, too.
+ */
+#define PROGRAM_STOP 0x1
+#define PROGRAM_RAN  0x2
+#define PROGRAM_WORDS 9
+
+static unsigned long program_word(struct ptrace_child *child,
+                                  const void *words, int i) {
+    if (personality(child)->word == sizeof(uint32_t))
+        return (long)((const int32_t*)words)[i];
+    return ((const unsigned long*)words)[i];
+}
+
+static void set_program_word(struct ptrace_child *child,
+                             void *words, int i, unsigned long v) {
+    if (personality(child)->word == sizeof(uint32_t))
+        ((uint32_t*)words)[i] = v;
+    else
+        ((unsigned long*)words)[i] = v;
+}
+
+int ptrace_remote_program(struct ptrace_child *child,
+                          child_addr_t addr, size_t len,
+                          struct remote_syscall *calls, int n) {
+    struct ptrace_personality *pers = personality(child);
+    size_t code = (pers->program_len + 15) & ~15;
+    size_t size = code + (n + 1) * PROGRAM_WORDS * pers->word;
+    struct user user;
+    unsigned char *buf;
+    void *list;
+    int i, j, sig, err = -1;
+
+    for (i = 0; i < n; i++)
+        calls[i].ran = 0;
+    if (size > len) {
+        child->error = E2BIG;
+        return -1;
+    }
+    buf = calloc(1, size);
+    if (buf == NULL) {
+        child->error = ENOMEM;
+        return -1;
+    }
+    memcpy(buf, pers->program, pers->program_len);
+    list = buf + code;
+    for (i = 0; i < n; i++) {
+        set_program_word(child, list, i * PROGRAM_WORDS, calls[i].sysno);
+        set_program_word(child, list, i * PROGRAM_WORDS + 1,
+                         calls[i].stop_on_error ? PROGRAM_STOP : 0);
+        for (j = 0; j < 6; j++)
+            set_program_word(child, list, i * PROGRAM_WORDS + 2 + j,
+                             calls[i].args[j]);
+    }
+    set_program_word(child, list, n * PROGRAM_WORDS, -1);
+
+    if (ptrace_memcpy_to_child(child, addr, buf, size) < 0)
+        goto out;
+    if (ptrace_advance_to_state(child, ptrace_at_syscall) < 0)
+        goto out;
+
+#define reg(user, r) (*(unsigned long*)((void*)(user) + pers->r))
+
+    memcpy(&user, &child->user, sizeof user);
+    if (arch_set_syscall(child, &user, -1) < 0)
+        goto out;
+    arch_set_program(child, &user);
+    reg(&user, reg_ip) = addr;
+    reg(&user, reg_sp) = addr + code;
+
+#undef reg
+
+    if (ptrace_command(child, PTRACE_SETREGS, 0, &user) < 0)
+        goto out;
+    do {
+        if (ptrace_command(child, PTRACE_CONT, 0, 0) < 0)
+            goto out;
+        child->state = ptrace_running;
+        if (ptrace_wait(child) < 0)
+            goto out;
+        if (child->state == ptrace_exited) {
+            child->error = ESRCH;
+            goto out;
+        }
+        sig = WSTOPSIG(child->status);
+    } while (sig != SIGTRAP && sig != SIGSEGV &&
+             sig != SIGBUS && sig != SIGILL);
+
+    /* Back to the syscall the child was stopped in. */
+    if (ptrace_command(child, PTRACE_SETREGS, 0, &child->user) < 0)
+        goto out;
+    if (ptrace_memcpy_from_child(child, list, addr + code,
+                                 size - code) < 0)
+        goto out;
+    for (i = 0; i < n; i++) {
+        calls[i].ran = !!(program_word(child, list, i * PROGRAM_WORDS + 1) &
+                          PROGRAM_RAN);
+        calls[i].rv = program_word(child, list, i * PROGRAM_WORDS + 8);
+    }
+    if (sig == SIGTRAP) {
+        err = 0;
+        goto out;
+    }
+
+    debug("The syscall program stopped with signal %d.", sig);
+    /*
+     * ptrace_advance_to_state() won't step a child stopped with SIGSEGV,
+     * so take it into its syscall ourselves, dropping the signal, for
+     * any remote syscalls that come next.
+     */
+    if (ptrace_command(child, PTRACE_SYSCALL, 0, 0) < 0)
+        goto out;
+    child->state = ptrace_stopped;
+    if (ptrace_wait(child) < 0)
+        goto out;
+    child->error = EFAULT;
+
+out:
+    free(buf);
+    return err;
+}
+
+/*
+ * Memory is copied to and from the child in one process_vm_writev() or
+ * process_vm_readv() where the kernel has them, else through
+ * /proc/PID/mem, and a word at a time with PTRACE_POKEDATA and
+ * PTRACE_PEEKDATA as a last resort. Whatever one way leaves undone, say
+ * because it can't reach that mapping, falls to the next.
+ */
+enum memcpy_method {
+    memcpy_none = 0,
+    memcpy_vm,
+    memcpy_proc,
+    memcpy_words,
+};
+
+static void memcpy_used(struct ptrace_child *child, enum memcpy_method method) {
+    static const char *names[] = {
+        [memcpy_vm] = "process_vm_readv/writev",
+        [memcpy_proc] = "/proc/PID/mem",
+        [memcpy_words] = "PTRACE_PEEKDATA/POKEDATA",
+    };
+
+    if (child->memcpy_method != method)
+        debug("Copying memory to and from the child with %s.", names[method]);
+    child->memcpy_method = method;
+}
+
+/* Returns how many of the n bytes one process_vm_{read,write}v() moved. */
+static size_t memcpy_vm_child(struct ptrace_child *child, int write, void *local,
+                              child_addr_t remote, size_t n) {
+#ifdef __NR_process_vm_writev
+    struct iovec liov = { .iov_base = local, .iov_len = n };
+    struct iovec riov = { .iov_base = (void*)remote, .iov_len = n };
+    long rv;
+
+    rv = syscall(write ? __NR_process_vm_writev : __NR_process_vm_readv,
+                 child->pid, &liov, 1, &riov, 1, 0);
+    return rv > 0 ? rv : 0;
+#else
+    return 0;
+#endif
+}
+
+/* Returns how many of the n bytes went through /proc/PID/mem. */
+static size_t memcpy_proc_child(struct ptrace_child *child, int write, void *local,
+                                child_addr_t remote, size_t n) {
+    char path[64];
+    size_t done = 0;
+    ssize_t rv;
+    int fd;
+
+    snprintf(path, sizeof path, "/proc/%d/mem", (int)child->pid);
+    if ((fd = open(path, (write ? O_WRONLY : O_RDONLY) | O_CLOEXEC)) < 0)
+        return 0;
+    while (done < n) {
+        if (write)
+            rv = pwrite64(fd, local + done, n - done, (off64_t)(remote + done));
+        else
+            rv = pread64(fd, local + done, n - done, (off64_t)(remote + done));
+        if (rv < 0 && errno == EINTR)
+            continue;
+        if (rv <= 0)
+            break;
+        done += rv;
+    }
+    close(fd);
+    return done;
+}
+
+static int memcpy_words_to_child(struct ptrace_child *child, child_addr_t dst,
+                                 const void *src, size_t n) {
     unsigned long scratch;
 
     while (n >= sizeof(unsigned long)) {
@@ -275,7 +549,8 @@ int ptrace_memcpy_to_child(struct ptrace_child *child, child_addr_t dst, const v
     return 0;
 }
 
-int ptrace_memcpy_from_child(struct ptrace_child *child, void *dst, child_addr_t src, size_t n) {
+static int memcpy_words_from_child(struct ptrace_child *child, void *dst,
+                                   child_addr_t src, size_t n) {
     unsigned long scratch;
 
     while (n) {
@@ -293,6 +568,46 @@ int ptrace_memcpy_from_child(struct ptrace_child *child, void *dst, child_addr_t
     return 0;
 }
 
+int ptrace_memcpy_to_child(struct ptrace_child *child, child_addr_t dst, const void *src, size_t n) {
+    size_t done;
+
+    done = memcpy_vm_child(child, 1, (void*)src, dst, n);
+    if (done == n) {
+        memcpy_used(child, memcpy_vm);
+        return 0;
+    }
+    dst += done;
+    src += done;
+    n -= done;
+    done = memcpy_proc_child(child, 1, (void*)src, dst, n);
+    if (done == n) {
+        memcpy_used(child, memcpy_proc);
+        return 0;
+    }
+    memcpy_used(child, memcpy_words);
+    return memcpy_words_to_child(child, dst + done, src + done, n - done);
+}
+
+int ptrace_memcpy_from_child(struct ptrace_child *child, void *dst, child_addr_t src, size_t n) {
+    size_t done;
+
+    done = memcpy_vm_child(child, 0, dst, src, n);
+    if (done == n) {
+        memcpy_used(child, memcpy_vm);
+        return 0;
+    }
+    dst += done;
+    src += done;
+    n -= done;
+    done = memcpy_proc_child(child, 0, dst, src, n);
+    if (done == n) {
+        memcpy_used(child, memcpy_proc);
+        return 0;
+    }
+    memcpy_used(child, memcpy_words);
+    return memcpy_words_from_child(child, dst + done, src + done, n - done);
+}
+
 static long __ptrace_command(struct ptrace_child *child, enum __ptrace_request req,
                              void *addr, void *data) {
     long rv;
@@ -304,6 +619,9 @@ static long __ptrace_command(struct ptrace_child *child, enum __ptrace_request r
 
 
 #ifdef BUILD_PTRACE_MAIN
+void debug(const char *msg, ...) {
+}
+
 int main(int argc, char **argv) {
     struct ptrace_child child;
     pid_t pid;
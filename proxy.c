@@ -0,0 +1,1345 @@
+/*
+ * Copyright (C) 2011 by Nelson Elhage
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <signal.h>
+#include <termios.h>
+#include <sys/uio.h>
+
+#include "reptyr.h"
+#include "proxy.h"
+
+void resize_pty(int pty) {
+    struct winsize sz;
+    if (ioctl(0, TIOCGWINSZ, &sz) < 0) {
+        // provide fake size to workaround some problems
+        struct winsize defaultsize = {30, 80, 640, 480};
+        if (ioctl(pty, TIOCSWINSZ, &defaultsize) < 0) {
+            fprintf(stderr, "Cannot set terminal size\n");
+        }
+        return;
+    }
+    ioctl(pty, TIOCSWINSZ, &sz);
+}
+
+int writeall(int fd, const void *buf, ssize_t count) {
+    ssize_t rv;
+    while (count > 0) {
+        rv = write(fd, buf, count);
+        if (rv < 0) {
+            if (errno == EINTR)
+                continue;
+            return rv;
+        }
+        count -= rv;
+        buf += rv;
+    }
+    return 0;
+}
+
+static size_t relay_pending(struct relay *r) {
+    return r->in_pipe + ringbuf_used(&r->buf);
+}
+
+static size_t relay_space(struct relay *r) {
+    if (r->mode == RELAY_SPLICE)
+        return r->pipe_full ? 0 : r->pipe_size - r->in_pipe;
+    return ringbuf_space(&r->buf);
+}
+
+/* Account for bytes that just arrived from r->from. */
+static void relay_filled(struct relay *r) {
+    size_t pending = relay_pending(r);
+
+    if (pending > r->peak)
+        r->peak = pending;
+    if (relay_space(r) == 0)
+        r->full++;
+}
+
+#ifdef __linux__
+static int splice_refused(int err) {
+    return err == EINVAL || err == ENOSYS || err == EOPNOTSUPP;
+}
+
+/* Move anything in the splice pipe into the ring, which is sized so that it always fits. */
+static void relay_unpipe(struct relay *r) {
+    char buf[4096];
+    ssize_t n;
+
+    r->pipe_full = 0;
+    while (r->in_pipe > 0) {
+        n = read(r->pipe[0], buf, r->in_pipe < sizeof buf ? r->in_pipe : sizeof buf);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            break;
+        ringbuf_put(&r->buf, buf, n);
+        r->in_pipe -= n;
+    }
+}
+
+/* Give up on splice() for this relay. */
+static void relay_stop_splice(struct relay *r, const char *why) {
+    debug("%s: splice() refused on %s (%s), falling back to read/write.",
+          r->name, why, strerror(errno));
+    r->mode = RELAY_COPY;
+    relay_unpipe(r);
+}
+#endif
+
+/*
+ * In packet mode (TIOCPKT), every read from the pty master starts with
+ * a status byte: TIOCPKT_DATA ahead of ordinary output, or on its own,
+ * flags saying the slave flushed its output or had it stopped (^S) or
+ * started (^Q) again.
+ */
+static void relay_packet(struct relay *r, unsigned char status) {
+    if (status & TIOCPKT_FLUSHWRITE) {
+        /* Whatever we still hold was thrown away along with it. */
+        r->dropped += ringbuf_used(&r->buf);
+        ringbuf_consume(&r->buf, ringbuf_used(&r->buf));
+    }
+    if (status & TIOCPKT_STOP)
+        r->stopped = 1;
+    if (status & TIOCPKT_START)
+        r->stopped = 0;
+}
+
+/*
+ * With the buffer full we stop reading, but a packet mode pty still
+ * flags status changes as priority data. Read just the status byte, so
+ * that a ^Q can get through while we're holding output because of ^S.
+ */
+static void relay_read_status(struct relay *r) {
+    struct pollfd pfd = { .fd = r->from, .events = POLLPRI };
+    unsigned char status;
+
+    if (poll(&pfd, 1, 0) <= 0 || !(pfd.revents & POLLPRI))
+        return;
+    if (read(r->from, &status, 1) == 1 && status != TIOCPKT_DATA)
+        relay_packet(r, status);
+}
+
+/*
+ * Stopped with a full buffer, only a status change can get things going
+ * again, and the pty signals ^Q as plain input, which we aren't waiting
+ * for. Look for it on a timer instead.
+ */
+static int relay_stuck(struct relay *r) {
+    return r->packet && r->stopped && !r->eof && relay_space(r) == 0;
+}
+
+/* Pass output (after the filters) on to everything but our own terminal. */
+static void relay_sink(struct relay *r, const void *buf, size_t len) {
+    if (r->screen)
+        term_write(r->screen, buf, len);
+    if (r->share)
+        share_output(r->share, buf, len);
+    if (r->history)
+        history_write(r->history, buf, len);
+    if (r->record)
+        record_write(r->record, r->record_as, buf, len);
+    if (r->ring)
+        shmring_write(r->ring, buf, len);
+    if (r->triggers)
+        triggers_scan(r->triggers, buf, len);
+}
+
+/*
+ * Let r->screen, viewers, the history, the recording, the ring and the
+ * triggers see the n bytes that just went into the buffer through iov,
+ * as r->filters leave them.
+ */
+void relay_tap(struct relay *r, const struct iovec *iov, size_t n) {
+    struct iovec in[2];
+    const struct iovec *out = in;
+    ssize_t count = 0;
+
+    if (r->screen == NULL && r->history == NULL && r->record == NULL && r->ring == NULL &&
+        r->triggers == NULL)
+        return;
+    /* iov is where the bytes went: a ring's free space, which wraps at most once. */
+    for (; n > 0 && count < 2; iov++, count++) {
+        in[count].iov_base = iov->iov_base;
+        in[count].iov_len = iov->iov_len < n ? iov->iov_len : n;
+        n -= in[count].iov_len;
+    }
+    if (r->filters)
+        count = filter_run(r->filters, in, count, &out);
+    for (; count > 0; out++, count--)
+        relay_sink(r, out->iov_base, out->iov_len);
+}
+
+/* The output is over: pass on anything the filters held back. */
+void relay_tap_finish(struct relay *r) {
+    const struct iovec *out;
+    ssize_t count = 0;
+
+    if (r->filters)
+        count = filter_finish(r->filters, &out);
+    for (; count > 0; out++, count--)
+        relay_sink(r, out->iov_base, out->iov_len);
+}
+
+/*
+ * Read as much from r->from as the buffer has room for. Returns the
+ * number of bytes read, 0 on EOF, or -1 with errno set.
+ */
+static ssize_t relay_fill(struct relay *r) {
+    struct iovec iov[3];
+    unsigned char status;
+    ssize_t n;
+    int niov;
+
+    if (relay_space(r) == 0) {
+        errno = EAGAIN;
+        return -1;
+    }
+#ifdef __linux__
+    if (r->mode == RELAY_SPLICE) {
+        n = splice(r->from, NULL, r->pipe[1], NULL, relay_space(r),
+                   SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (n < 0 && splice_refused(errno)) {
+            relay_stop_splice(r, "input");
+        } else {
+            /*
+             * Partly filled pages take up a whole pipe slot, so the pipe
+             * can fill up well short of pipe_size.
+             */
+            if (n < 0 && errno == EAGAIN && r->in_pipe > 0) {
+                r->pipe_full = 1;
+                r->full++;
+            }
+            if (n > 0) {
+                r->in_pipe += n;
+                r->reads++;
+                relay_filled(r);
+            }
+            return n;
+        }
+    }
+#endif
+    niov = ringbuf_free_iov(&r->buf, iov + 1);
+    if (!r->packet) {
+        n = readv(r->from, iov + 1, niov);
+        if (n > 0) {
+            relay_tap(r, iov + 1, n);
+            ringbuf_commit(&r->buf, n);
+            r->reads++;
+            relay_filled(r);
+        }
+        return n;
+    }
+
+    iov[0].iov_base = &status;
+    iov[0].iov_len = 1;
+    n = readv(r->from, iov, niov + 1);
+    if (n > 0) {
+        r->reads++;
+        if (status == TIOCPKT_DATA) {
+            relay_tap(r, iov + 1, n - 1);
+            ringbuf_commit(&r->buf, n - 1);
+            relay_filled(r);
+        } else {
+            relay_packet(r, status);
+        }
+    }
+    return n;
+}
+
+/* Has this call used up r->slice (if set) since `start'? */
+static int relay_slice_over(struct relay *r, long long start) {
+    return r->slice && ev_now() - start >= r->slice;
+}
+
+/*
+ * Write out as much of the buffer as r->to will take. Returns 0 if
+ * that was everything, r->to would block, or r->slice ran out; -1 on
+ * error.
+ */
+static int relay_flush(struct relay *r) {
+    struct iovec iov[2];
+    long long start = r->slice ? ev_now() : 0;
+    ssize_t n;
+    int niov;
+
+    if (r->stopped)
+        return 0;
+#ifdef __linux__
+    while (r->in_pipe > 0) {
+        n = splice(r->pipe[0], NULL, r->to, NULL, r->in_pipe,
+                   SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (n < 0 && splice_refused(errno)) {
+            relay_stop_splice(r, "output");
+            break;
+        }
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0)
+            return errno == EAGAIN ? 0 : -1;
+        r->in_pipe -= n;
+        r->spliced += n;
+        r->writes++;
+        r->pipe_full = 0;
+        if (relay_slice_over(r, start))
+            return 0;
+    }
+#endif
+    while ((niov = ringbuf_used_iov(&r->buf, iov)) > 0) {
+        n = writev(r->to, iov, niov);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0)
+            return errno == EAGAIN ? 0 : -1;
+        ringbuf_consume(&r->buf, n);
+        r->copied += n;
+        r->writes++;
+        if (relay_slice_over(r, start))
+            return 0;
+    }
+    return 0;
+}
+
+/*
+ * Read until r->from runs dry or the buffer fills, so a burst of output
+ * turns into one write rather than one per read. FIONREAD tells us when
+ * a read got everything, saving the read that would only say EAGAIN.
+ */
+static ssize_t relay_fill_all(struct relay *r) {
+    long long start = r->slice ? ev_now() : 0;
+    ssize_t n, total = 0;
+    int avail;
+
+    while (relay_space(r)) {
+        n = relay_fill(r);
+        if (n <= 0)
+            return total ? total : n;
+        total += n;
+        if (ioctl(r->from, FIONREAD, &avail) == 0 && avail == 0)
+            break;
+        if (relay_slice_over(r, start))
+            break;
+    }
+    return total;
+}
+
+static void relay_init(struct relay *r, const char *name, int from, int to,
+                       size_t limit, int splice) {
+    size_t size = limit;
+
+    memset(r, 0, sizeof *r);
+    r->name = name;
+    r->from = from;
+    r->to = to;
+    r->mode = RELAY_COPY;
+    r->limit = limit;
+    r->pipe[0] = r->pipe[1] = -1;
+#ifdef __linux__
+    if (splice) {
+        if (pipe2(r->pipe, O_CLOEXEC) < 0) {
+            debug("%s: unable to create splice pipe: %s", name, strerror(errno));
+        } else {
+            int sz;
+            /*
+             * The kernel rounds this up to a power-of-two number of
+             * pages, and unprivileged users can't go past pipe-max-size.
+             */
+            fcntl(r->pipe[1], F_SETPIPE_SZ, (int)limit);
+            sz = fcntl(r->pipe[1], F_GETPIPE_SZ);
+            r->pipe_size = sz > 0 ? sz : limit;
+            r->mode = RELAY_SPLICE;
+            /* Big enough to take over the pipe if splice() lets us down. */
+            if (r->pipe_size > size)
+                size = r->pipe_size;
+        }
+    }
+#endif
+    if (ringbuf_init(&r->buf, size) < 0)
+        die("Unable to allocate %zu bytes of %s buffer.", size, name);
+}
+
+static void relay_set_packet(struct relay *r) {
+    int one = 1;
+
+    if (ioctl(r->from, TIOCPKT, &one) < 0) {
+        debug("%s: unable to enable packet mode: %s", r->name, strerror(errno));
+        return;
+    }
+    r->packet = 1;
+}
+
+static void relay_free(struct relay *r) {
+    int zero = 0;
+
+    if (r->packet)
+        ioctl(r->from, TIOCPKT, &zero);
+    if (r->pipe[0] >= 0)
+        close(r->pipe[0]);
+    if (r->pipe[1] >= 0)
+        close(r->pipe[1]);
+    r->pipe[0] = r->pipe[1] = -1;
+    ringbuf_free(&r->buf);
+}
+
+static const char *relay_mode_name(enum relay_mode mode) {
+    switch (mode) {
+    case RELAY_SPLICE:
+        return "splice";
+    case RELAY_URING:
+        return "io_uring";
+    default:
+        return "read/write";
+    }
+}
+
+static void relay_report(struct relay *r) {
+    debug("%s: %llu bytes spliced, %llu bytes copied (%s), %llu reads, %llu writes",
+          r->name, r->spliced, r->copied, relay_mode_name(r->mode), r->reads, r->writes);
+    debug("%s: %zu byte buffer, peak %zu queued, full %llu times, %llu bytes flushed",
+          r->name, r->limit, r->peak, r->full, r->dropped);
+}
+
+void relay_drain(struct relay *r) {
+    struct pollfd pfd = { .fd = r->from, .events = POLLIN };
+
+    do {
+        if (relay_flush(r) < 0)
+            return;
+    } while (poll(&pfd, 1, 0) > 0 && (pfd.revents & POLLIN) && relay_fill(r) > 0);
+}
+
+static int latency_bucket(long long us) {
+    int b = 0;
+
+    while (b < LATENCY_BUCKETS - 1 && (1LL << b) < us)
+        b++;
+    return b;
+}
+
+static void latency_record(struct latency_hist *h, long long us) {
+    h->count[latency_bucket(us)]++;
+    h->samples++;
+    if (us > h->max)
+        h->max = us;
+}
+
+/* Upper bound (in microseconds) on the given fraction of samples. */
+static long long latency_quantile(struct latency_hist *h, double q) {
+    unsigned long long seen = 0;
+    int b;
+
+    for (b = 0; b < LATENCY_BUCKETS; b++) {
+        seen += h->count[b];
+        if (seen >= q * h->samples)
+            break;
+    }
+    return b < LATENCY_BUCKETS - 1 && (1LL << b) < h->max ? 1LL << b : h->max;
+}
+
+static void latency_report(struct latency_hist *h, const char *name) {
+    int b;
+
+    if (!h->samples)
+        return;
+    debug("%s latency: %llu samples, p50 <= %lldus, p99 <= %lldus, max %lldus",
+          name, h->samples, latency_quantile(h, 0.5), latency_quantile(h, 0.99), h->max);
+    for (b = 0; b < LATENCY_BUCKETS; b++)
+        if (h->count[b])
+            debug("  <= %8lldus: %llu", 1LL << b, h->count[b]);
+}
+
+void proxy_waiting(struct proxy *p) {
+    p->prev_wait_at = p->wait_at;
+    p->wait_at = ev_now();
+}
+
+/*
+ * We can't know when input actually arrived, only when we saw it. If
+ * the loop slept until it came in, that's now. If it didn't sleep at
+ * all, the input may have come in at any point while we were busy
+ * with the previous round, so count from the start of that.
+ */
+void proxy_input_read(struct proxy *p) {
+    long long now = ev_now();
+
+    if (p->in_since)
+        return;
+    if (now - p->wait_at < PROXY_NOSLEEP_US && p->prev_wait_at)
+        p->in_since = p->prev_wait_at;
+    else
+        p->in_since = now;
+}
+
+void proxy_input_written(struct proxy *p) {
+    if (!p->in_since)
+        return;
+    latency_record(&p->in_latency, ev_now() - p->in_since);
+    p->in_since = 0;
+}
+
+static int relay_again(void) {
+    return errno == EINTR || errno == EAGAIN;
+}
+
+/*
+ * --feed: type a file or FIFO into the program as fast as the pty takes
+ * it. The feed has a relay (spliced, where it can be) of its own, to a
+ * dup of the pty so it can have a watch of its own too. A full pty
+ * just stops taking writes until the program reads, so nothing is lost.
+ */
+static void feed_done(struct proxy *p) {
+    ev_del(&p->loop, &p->feed_in_watch);
+    ev_del(&p->loop, &p->feed_out_watch);
+    debug("Done feeding the program.");
+    relay_report(&p->feed);
+    relay_free(&p->feed);
+    close(p->feed.from);
+    close(p->feed.to);
+    p->feeding = 0;
+}
+
+/* Give up on what's left to feed. */
+static void feed_drop(struct proxy *p) {
+    p->feed.eof = 1;
+    ringbuf_consume(&p->feed.buf, ringbuf_used(&p->feed.buf));
+    p->feed.in_pipe = 0;
+}
+
+static void feed_fill(struct proxy *p) {
+    ssize_t n = relay_fill_all(&p->feed);
+
+    if (n < 0 && !relay_again())
+        error("Unable to read what to feed the program: %s", strerror(errno));
+    if (n == 0 || (n < 0 && !relay_again()))
+        p->feed.eof = 1;
+}
+
+static void feed_update(struct proxy *p) {
+    int events;
+
+    if (p->feed.eof && !relay_pending(&p->feed)) {
+        feed_done(p);
+        return;
+    }
+    events = p->feed_pollable && !p->feed.eof && relay_space(&p->feed) ? EV_READ : 0;
+    if (p->feed_pollable && ev_set(&p->loop, &p->feed_in_watch, events) < 0) {
+        error("Unable to watch what to feed the program: %s", strerror(errno));
+        p->feed.eof = 1;
+    }
+    /* A file is always ready to read, so it's read whenever the pty has room. */
+    events = relay_pending(&p->feed) || (!p->feed_pollable && !p->feed.eof) ? EV_WRITE : 0;
+    if (ev_set(&p->loop, &p->feed_out_watch, events) < 0) {
+        error("Unable to watch the pty: %s", strerror(errno));
+        feed_drop(p);
+        feed_done(p);
+    }
+}
+
+static void feed_in_ready(struct event_loop *loop, struct watch *w, int revents) {
+    struct proxy *p = w->data;
+
+    feed_fill(p);
+    feed_update(p);
+}
+
+static void feed_out_ready(struct event_loop *loop, struct watch *w, int revents) {
+    struct proxy *p = w->data;
+
+    if (!p->feed_pollable && !p->feed.eof && relay_space(&p->feed))
+        feed_fill(p);
+    if (relay_flush(&p->feed) < 0) {
+        error("Unable to feed the program: %s", strerror(errno));
+        feed_drop(p);
+    }
+    feed_update(p);
+}
+
+/* Open `path' (waiting for a writer, if it's a FIFO) to feed to the program. */
+static int feed_open(struct proxy *p, const char *path) {
+    struct termios tio;
+    struct stat st;
+    int fd, pty;
+
+    if ((fd = open(path, O_RDONLY | O_CLOEXEC)) < 0)
+        return -1;
+    if (fstat(fd, &st) < 0 || (pty = fcntl(p->pty, F_DUPFD_CLOEXEC, 0)) < 0) {
+        close(fd);
+        return -1;
+    }
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    relay_init(&p->feed, "feed", fd, pty,
+               p->opts->in_buffer ? p->opts->in_buffer : PROXY_DEFAULT_BUFFER,
+               !p->opts->record);
+    if (p->out.record) {
+        p->feed.record = p->out.record;
+        p->feed.record_as = RECORD_INPUT;
+    }
+    /* Don't let a big file hold up keystrokes or output for long. */
+    p->feed.slice = PROXY_SLICE_US;
+    p->feed_pollable = !S_ISREG(st.st_mode);
+    p->feeding = 1;
+    ev_watch_init(&p->feed_in_watch, fd, feed_in_ready, p);
+    ev_watch_init(&p->feed_out_watch, pty, feed_out_ready, p);
+    if (tcgetattr(p->pty, &tio) == 0 && (tio.c_lflag & ICANON))
+        debug("The program reads a line at a time; any line of over %d bytes "
+              "will be cut short.", PROXY_MAX_CANON);
+    return 0;
+}
+
+/*
+ * Recompute what each fd is waiting for. A direction whose buffer is
+ * full stops reading its source until the sink catches up, so a stalled
+ * terminal only holds up its own side of the proxy.
+ */
+static void proxy_update(struct proxy *p) {
+    int events = 0;
+
+    /* The screen model takes output as fast as it comes. */
+    if (!p->out.eof && (p->opts->fps || relay_space(&p->out)))
+        events |= EV_READ;
+    else if (!p->out.eof && p->out.packet)
+        events |= EV_PRI;
+    if (relay_pending(&p->in))
+        events |= EV_WRITE;
+    if (ev_set(&p->loop, &p->pty_watch, events) < 0) {
+        error("Unable to watch the pty: %s", strerror(errno));
+        p->done = 1;
+    }
+
+    events = !p->in.eof && relay_space(&p->in) ? EV_READ : 0;
+    if (ev_set(&p->loop, &p->stdin_watch, events) < 0) {
+        debug("Not watching stdin: %s", strerror(errno));
+        p->in.eof = 1;
+    }
+
+    events = relay_pending(&p->out) && !p->flush_at && !p->out.stopped ? EV_WRITE : 0;
+    if (ev_set(&p->loop, &p->stdout_watch, events) < 0) {
+        error("Unable to watch stdout: %s", strerror(errno));
+        p->done = 1;
+    }
+    if (p->feeding)
+        feed_update(p);
+}
+
+static void proxy_flush_out(struct proxy *p) {
+    p->flush_at = 0;
+    if (relay_flush(&p->out) < 0)
+        p->done = 1;
+}
+
+/*
+ * Called after reading output while stdout isn't backed up: write it
+ * now, or give more output up to --flush-delay to arrive and share the
+ * write. Past half a buffer there's no point waiting any longer.
+ */
+static void proxy_queue_out(struct proxy *p) {
+    if (!p->opts->flush_delay || relay_space(&p->out) < relay_pending(&p->out))
+        proxy_flush_out(p);
+    else if (!p->flush_at)
+        p->flush_at = ev_now() + p->opts->flush_delay * 1000LL;
+}
+
+/*
+ * Feed output from the pty to the screen model rather than the buffer,
+ * the same way relay_fill_all() would have. Returns what the last read
+ * did.
+ */
+static ssize_t frame_fill(struct proxy *p) {
+    long long start = ev_now();
+    char buf[16384];
+    struct iovec iov[2];
+    unsigned char status;
+    ssize_t n;
+    int niov = 0, avail;
+
+    if (p->out.packet) {
+        iov[niov].iov_base = &status;
+        iov[niov++].iov_len = 1;
+    }
+    iov[niov].iov_base = buf;
+    iov[niov++].iov_len = sizeof buf;
+    for (;;) {
+        n = readv(p->pty, iov, niov);
+        if (n <= 0)
+            break;
+        p->out.reads++;
+        if (p->out.packet && status != TIOCPKT_DATA) {
+            /* There's nothing to flush; the screen is what it is. */
+            relay_packet(&p->out, status & ~TIOCPKT_FLUSHWRITE);
+            continue;
+        }
+        if (p->out.packet)
+            n--;
+        relay_tap(&p->out, &iov[niov - 1], n);
+        p->modeled += n;
+        p->frame_dirty = 1;
+        if (ioctl(p->pty, FIONREAD, &avail) == 0 && avail == 0)
+            break;
+        if (ev_now() - start >= PROXY_SLICE_US)
+            break;
+    }
+    /* Answer status queries, which the real terminal never sees. */
+    if (p->screen.reply.len) {
+        ringbuf_put(&p->in.buf, p->screen.reply.buf, p->screen.reply.len);
+        p->screen.reply.len = 0;
+    }
+    return n;
+}
+
+/* Move as much of the current frame into the output buffer as fits. */
+static void frame_put(struct proxy *p) {
+    p->frame_off += ringbuf_put(&p->out.buf, p->frame.buf + p->frame_off,
+                                p->frame.len - p->frame_off);
+    relay_filled(&p->out);
+}
+
+static void frame_schedule(struct proxy *p) {
+    long long now = ev_now();
+    long long at = p->frame_last + 1000000 / p->opts->fps;
+
+    if (p->frame_dirty && !p->frame_at)
+        p->frame_at = at > now ? at : now;
+}
+
+/*
+ * Draw the changes since the last frame, unless that one is still on
+ * its way out: a slow terminal just gets fewer frames.
+ */
+static void frame_draw(struct proxy *p) {
+    p->frame_at = 0;
+    if (relay_pending(&p->out) || p->frame_off < p->frame.len)
+        return;
+    p->frame.len = p->frame_off = 0;
+    if (term_render(&p->screen, &p->view, &p->frame) < 0) {
+        error("Out of memory drawing the screen.");
+        p->done = 1;
+        return;
+    }
+    p->frame_dirty = 0;
+    p->frame_last = ev_now();
+    p->frames++;
+    frame_put(p);
+    proxy_flush_out(p);
+}
+
+static void screen_resize(struct proxy *p) {
+    struct winsize sz;
+
+    if (ioctl(p->pty, TIOCGWINSZ, &sz) < 0 || !sz.ws_row || !sz.ws_col)
+        return;
+    if (term_resize(&p->screen, sz.ws_row, sz.ws_col) < 0) {
+        error("Out of memory resizing the screen.");
+        return;
+    }
+    if (p->out.share)
+        share_resync(p->out.share);
+    if (!p->opts->fps)
+        return;
+    /* Who knows what the terminal did with what was on it. */
+    p->view.invalid = 1;
+    p->frame_dirty = 1;
+    frame_schedule(p);
+}
+
+static void frame_finish(struct proxy *p) {
+    struct pollfd pfd = { .fd = p->pty, .events = POLLIN };
+
+    if (p->target_exited)
+        while (poll(&pfd, 1, 0) > 0 && (pfd.revents & POLLIN) && frame_fill(p) > 0)
+            ;
+    relay_flush(&p->out);
+    if (p->frame_off == p->frame.len) {
+        p->frame.len = p->frame_off = 0;
+        if (term_render(&p->screen, &p->view, &p->frame) == 0)
+            p->frames++;
+    }
+    term_render_exit(&p->screen, &p->view, &p->frame);
+    if (writeall(1, p->frame.buf + p->frame_off, p->frame.len - p->frame_off) == 0)
+        p->out.copied += p->frame.len - p->frame_off;
+    p->frame_off = p->frame.len;
+}
+
+static void pty_ready(struct event_loop *loop, struct watch *w, int revents) {
+    struct proxy *p = w->data;
+    int idle = !relay_pending(&p->out) || p->flush_at;
+    ssize_t count;
+
+    if (revents & (EV_WRITE | EV_ERROR) && relay_pending(&p->in)) {
+        if (relay_flush(&p->in) < 0)
+            p->done = 1;
+        else if (!relay_pending(&p->in))
+            proxy_input_written(p);
+    }
+    if (revents & EV_PRI && !relay_space(&p->out))
+        relay_read_status(&p->out);
+    if (revents & (EV_READ | EV_ERROR) && p->opts->fps) {
+        count = frame_fill(p);
+        if (count == 0 || (count < 0 && !relay_again())) {
+            p->out.eof = 1;
+            p->done = 1;
+        }
+        frame_schedule(p);
+    } else if (revents & (EV_READ | EV_ERROR) && relay_space(&p->out)) {
+        count = relay_fill_all(&p->out);
+        if (count == 0 || (count < 0 && !relay_again())) {
+            p->out.eof = 1;
+            p->done = 1;
+        }
+        if (idle)
+            proxy_queue_out(p);
+    }
+    proxy_update(p);
+}
+
+/* Keystrokes from the viewer holding the write lock. */
+static void share_input(void *data, const char *buf, size_t len) {
+    struct proxy *p = data;
+
+    if (p->in.record)
+        record_write(p->in.record, RECORD_INPUT, buf, len);
+    if (ringbuf_put(&p->in.buf, buf, len) < len)
+        debug("Dropped input from a viewer: the input buffer is full.");
+    relay_filled(&p->in);
+    if (relay_flush(&p->in) < 0)
+        p->done = 1;
+    proxy_update(p);
+}
+
+/* A trigger types into the program; it goes out once the pty is writable. */
+static void trigger_send(void *data, const char *buf, size_t len) {
+    struct proxy *p = data;
+
+    if (p->in.record)
+        record_write(p->in.record, RECORD_INPUT, buf, len);
+    if (ringbuf_put(&p->in.buf, buf, len) < len)
+        debug("Dropped a trigger's input: the input buffer is full.");
+    relay_filled(&p->in);
+}
+
+/* Detached, the pty is as big as the writer's terminal. */
+static void share_resize(void *data, int rows, int cols) {
+    struct proxy *p = data;
+    struct winsize sz = { .ws_row = rows, .ws_col = cols };
+
+    if (ioctl(p->pty, TIOCSWINSZ, &sz) < 0) {
+        debug("Unable to resize the pty: %s", strerror(errno));
+        return;
+    }
+    record_resize(&p->record, rows, cols);
+    screen_resize(p);
+    proxy_update(p);
+}
+
+/* While a viewer holds the write lock, our own terminal is read-only. */
+static ssize_t stdin_discard(struct proxy *p) {
+    char buf[4096];
+
+    return read(0, buf, sizeof buf);
+}
+
+static void stdin_ready(struct event_loop *loop, struct watch *w, int revents) {
+    struct proxy *p = w->data;
+    ssize_t count;
+
+    if (p->share.writer) {
+        count = stdin_discard(p);
+        if (count == 0 || (count < 0 && !relay_again())) {
+            debug("EOF on stdin.");
+            p->in.eof = 1;
+        }
+        proxy_update(p);
+        return;
+    }
+    proxy_input_read(p);
+    count = relay_fill(&p->in);
+    if (count == 0 || (count < 0 && !relay_again())) {
+        /* Keep relaying output, but stop spinning on EOF. */
+        debug("EOF on stdin.");
+        p->in.eof = 1;
+    }
+    if (relay_flush(&p->in) < 0)
+        p->done = 1;
+    else if (!relay_pending(&p->in))
+        proxy_input_written(p);
+    proxy_update(p);
+}
+
+static void stdout_ready(struct event_loop *loop, struct watch *w, int revents) {
+    struct proxy *p = w->data;
+
+    proxy_flush_out(p);
+    if (p->opts->fps) {
+        frame_put(p);
+        if (!relay_pending(&p->out))
+            frame_schedule(p);
+    }
+    proxy_update(p);
+}
+
+static void winch_ready(struct event_loop *loop, struct watch *w, int revents) {
+    struct proxy *p = w->data;
+    struct winsize sz;
+
+    resize_pty(p->pty);
+    if (ioctl(p->pty, TIOCGWINSZ, &sz) == 0)
+        record_resize(&p->record, sz.ws_row, sz.ws_col);
+    if (p->screen.rows) {
+        screen_resize(p);
+        proxy_update(p);
+    }
+}
+
+/*
+ * Write the history to fd from a grandchild, which gets a snapshot of it
+ * for free and can take as long as it likes without holding us up.
+ */
+static void dump_history(void *data, int fd) {
+    struct proxy *p = data;
+
+    if (history_dump_background(&p->history, fd) < 0)
+        error("Unable to fork to dump the history: %s", strerror(errno));
+}
+
+/* Someone asked for the session: stop, and hand it over once out of the loop. */
+static void share_handoff(void *data, int fd) {
+    struct proxy *p = data;
+
+    if (p->handoff)
+        return;
+    if ((p->handoff = fcntl(fd, F_DUPFD_CLOEXEC, 3)) < 0) {
+        error("Unable to hand the session over: %s", strerror(errno));
+        p->handoff = 0;
+        return;
+    }
+    debug("Handing the session over.");
+    p->done = 1;
+}
+
+/*
+ * Give the session to whoever asked for it. The screen model has seen
+ * every byte we read, so it gets the screen rather than what we hadn't
+ * written to our own terminal yet; what we haven't read stays in the
+ * pty for it to read.
+ */
+static void proxy_handoff(struct proxy *p) {
+    struct share_handoff h = { .pty = p->pty, .target = p->target };
+    struct term_out keyframe = {};
+    struct iovec iov[2];
+    int niov, i;
+
+    /* Let it listen where we did, as soon as it likes. */
+    share_close(&p->share);
+    fcntl(p->handoff, F_SETFL, fcntl(p->handoff, F_GETFL) & ~O_NONBLOCK);
+    /* It takes packet mode over, so don't turn it off behind its back. */
+    if (p->out.packet) {
+        h.flags |= SHARE_HANDOFF_PACKET;
+        p->out.packet = 0;
+    }
+    if (term_keyframe(&p->screen, &keyframe) < 0)
+        error("Out of memory drawing the screen to hand over.");
+    h.output = keyframe.buf;
+    h.output_len = keyframe.len;
+#ifdef __linux__
+    relay_unpipe(&p->in);
+#endif
+    if ((h.input = malloc(ringbuf_used(&p->in.buf))) != NULL) {
+        niov = ringbuf_used_iov(&p->in.buf, iov);
+        for (i = 0; i < niov; i++) {
+            memcpy(h.input + h.input_len, iov[i].iov_base, iov[i].iov_len);
+            h.input_len += iov[i].iov_len;
+        }
+    }
+    if (share_give(p->handoff, &h) < 0)
+        error("Unable to hand the session over: %s", strerror(errno));
+    else
+        debug("Handed the session over, with %zu bytes of screen and %zu of "
+              "keystrokes.", h.output_len, h.input_len);
+    close(p->handoff);
+    p->handoff = 0;
+    free(h.input);
+    term_out_free(&keyframe);
+}
+
+/* Pick up where the reptyr we took the session from left off. */
+static void proxy_resume(struct proxy *p, const struct share_handoff *h) {
+    struct iovec iov = { .iov_base = h->output, .iov_len = h->output_len };
+
+    if (h->output_len) {
+        relay_tap(&p->out, &iov, h->output_len);
+        if (p->opts->fps) {
+            p->frame_dirty = 1;
+            frame_schedule(p);
+        } else if (writeall(1, h->output, h->output_len) < 0) {
+            debug("Unable to draw the screen we took over: %s", strerror(errno));
+        }
+    }
+    if (ringbuf_put(&p->in.buf, h->input, h->input_len) < h->input_len)
+        error("Dropped keystrokes that didn't fit in the input buffer.");
+}
+
+/* SIGUSR1 dumps the history to a new file in the current directory. */
+static void dump_ready(struct event_loop *loop, struct watch *w, int revents) {
+    struct proxy *p = w->data;
+    char path[64];
+    int fd;
+
+    snprintf(path, sizeof path, "reptyr-%d-%u.history", (int)getpid(), ++p->dumps);
+    fd = open(path, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+    if (fd < 0) {
+        error("Unable to create %s: %s", path, strerror(errno));
+        return;
+    }
+    debug("Dumping the history to %s.", path);
+    dump_history(p, fd);
+    close(fd);
+}
+
+static void target_exited(struct event_loop *loop, struct watch *w, int revents) {
+    struct proxy *p = w->data;
+
+    debug("Target %d exited.", (int)p->target);
+    /* The backend flushes whatever it wrote on the way out, then stops. */
+    p->target_exited = 1;
+    ev_del(loop, w);
+}
+
+/*
+ * The event backend runs with every fd non-blocking. Our stdin and
+ * stdout usually share a file description with the shell we were
+ * started from, so the original flags have to go back afterwards.
+ */
+static void proxy_set_nonblock(const int *fds, int *flags, int n) {
+    int i;
+
+    /* Read them all first: fds 0 and 1 are often the same description. */
+    for (i = 0; i < n; i++)
+        flags[i] = fcntl(fds[i], F_GETFL);
+    for (i = 0; i < n; i++)
+        if (flags[i] >= 0)
+            fcntl(fds[i], F_SETFL, flags[i] | O_NONBLOCK);
+}
+
+static void proxy_restore_flags(const int *fds, const int *flags, int n) {
+    int i;
+
+    for (i = n - 1; i >= 0; i--)
+        if (flags[i] >= 0)
+            fcntl(fds[i], F_SETFL, flags[i]);
+}
+
+/* How long the loop may sleep (in ms, or -1) before something is due. */
+static int proxy_timeout(struct proxy *p) {
+    long long deadline = p->flush_at;
+
+    /* Don't sleep while there's history to compress or spill. */
+    if (history_pending(&p->history))
+        return 0;
+
+    if (p->frame_at && (!deadline || p->frame_at < deadline))
+        deadline = p->frame_at;
+    if (relay_stuck(&p->out)) {
+        long long poll_at = ev_now() + PROXY_STOPPED_POLL_US;
+
+        if (!deadline || poll_at < deadline)
+            deadline = poll_at;
+    }
+    return deadline ? ev_timeout_until(deadline) : -1;
+}
+
+static void proxy_event_run(struct proxy *p) {
+    int fds[3] = { 0, 1, p->pty };
+    int flags[3], ran;
+
+    debug("Using %s proxy backend.", ev_backend_name());
+
+    ev_watch_init(&p->pty_watch, p->pty, pty_ready, p);
+    ev_watch_init(&p->stdin_watch, 0, stdin_ready, p);
+    ev_watch_init(&p->stdout_watch, 1, stdout_ready, p);
+    /*
+     * Keystrokes go ahead of output, and output is moved in bounded
+     * slices, so a flood of output can't hold up a ^C for long.
+     */
+    p->stdin_watch.priority = 1;
+    p->out.slice = PROXY_SLICE_US;
+
+    proxy_set_nonblock(fds, flags, 3);
+    proxy_update(p);
+    while (!p->done) {
+        proxy_waiting(p);
+        if ((ran = ev_run_once(&p->loop, proxy_timeout(p))) < 0) {
+            error("Event loop failed: %s", strerror(errno));
+            break;
+        }
+        if (p->flush_at && ev_now() >= p->flush_at) {
+            proxy_flush_out(p);
+            proxy_update(p);
+        }
+        if (p->frame_at && ev_now() >= p->frame_at) {
+            frame_draw(p);
+            proxy_update(p);
+        }
+        if (relay_stuck(&p->out)) {
+            relay_read_status(&p->out);
+            proxy_update(p);
+        }
+        /*
+         * One block at a time, and only once the output has dried up,
+         * so it doesn't slow down a flood or keep keystrokes waiting.
+         */
+        if (ran == 0 || history_overdue(&p->history))
+            history_work(&p->history);
+        if (p->target_exited)
+            p->done = 1;
+    }
+    ev_del(&p->loop, &p->pty_watch);
+    ev_del(&p->loop, &p->stdin_watch);
+    ev_del(&p->loop, &p->stdout_watch);
+    proxy_restore_flags(fds, flags, 3);
+    p->out.slice = 0;
+    p->out.stopped = 0;
+
+    /* What we hadn't written is on the screen we hand over; our terminal may be gone. */
+    if (p->handoff)
+        return;
+    /* Back to blocking writes, so this can't leave anything behind. */
+    if (p->opts->fps)
+        frame_finish(p);
+    else if (p->target_exited)
+        relay_drain(&p->out);
+    else
+        relay_flush(&p->out);
+}
+
+static int proxy_uring_wanted(struct proxy *p) {
+    if (p->opts->backend == PROXY_BACKEND_EVENT)
+        return 0;
+    if (p->opts->fps) {
+        if (p->opts->backend == PROXY_BACKEND_URING)
+            error("--fps is not supported by the io_uring backend.");
+        return 0;
+    }
+    if (p->opts->share) {
+        if (p->opts->backend == PROXY_BACKEND_URING)
+            error("--share is not supported by the io_uring backend.");
+        return 0;
+    }
+    if (p->opts->splice) {
+        if (p->opts->backend == PROXY_BACKEND_URING)
+            error("--splice is not supported by the io_uring backend.");
+        return 0;
+    }
+    if (p->opts->feed) {
+        if (p->opts->backend == PROXY_BACKEND_URING)
+            error("--feed is not supported by the io_uring backend.");
+        return 0;
+    }
+    if (triggers_send(p->opts->triggers)) {
+        if (p->opts->backend == PROXY_BACKEND_URING)
+            error("--send is not supported by the io_uring backend.");
+        return 0;
+    }
+    return 1;
+}
+
+void do_proxy(int pty, pid_t target, const struct proxy_options *opts) {
+    struct proxy p;
+
+    memset(&p, 0, sizeof p);
+    p.pty = pty;
+    p.target = target;
+    p.opts = opts;
+
+    if (ev_init(&p.loop) < 0) {
+        error("Unable to create event loop: %s", strerror(errno));
+        return;
+    }
+
+    /* Output has to pass through us to keep track of the screen. */
+    relay_init(&p.out, "output", pty, 1,
+               opts->out_buffer ? opts->out_buffer : PROXY_DEFAULT_BUFFER,
+               opts->splice && !opts->fps && !opts->screen_socket && !opts->share &&
+               !opts->history && !opts->record && !opts->ring && !opts->triggers &&
+               !opts->filters);
+    relay_init(&p.in, "input", 0, pty,
+               opts->in_buffer ? opts->in_buffer : PROXY_DEFAULT_BUFFER,
+               opts->splice && !opts->record);
+    /* Splicing passes bytes through untouched, so it can't strip packet headers. */
+    if (opts->packet && p.out.mode != RELAY_SPLICE)
+        relay_set_packet(&p.out);
+    ev_watch_init(&p.winch_watch, -1, winch_ready, &p);
+    if (ev_add_signal(&p.loop, &p.winch_watch, SIGWINCH) < 0)
+        error("Unable to watch for SIGWINCH: %s", strerror(errno));
+    /*
+     * Only size the pty once SIGWINCH is routed through the loop, so a
+     * resize can't slip in between the two.
+     */
+    resize_pty(pty);
+    if (opts->fps || opts->screen_socket || opts->share || opts->record) {
+        struct winsize sz;
+
+        if (ioctl(pty, TIOCGWINSZ, &sz) < 0 || !sz.ws_row || !sz.ws_col)
+            sz.ws_row = 24, sz.ws_col = 80;
+        if (term_init(&p.screen, sz.ws_row, sz.ws_col) < 0 ||
+            (opts->fps && term_view_init(&p.view, sz.ws_row, sz.ws_col) < 0))
+            die("Unable to allocate the screen model.");
+        /* With frames, the real terminal never sees status queries; see frame_fill(). */
+        p.screen.answer = opts->fps;
+        p.out.screen = &p.screen;
+    }
+    if (opts->record) {
+        struct winsize sz;
+
+        if (ioctl(pty, TIOCGWINSZ, &sz) < 0)
+            sz.ws_row = sz.ws_col = 0;
+        if (record_open(&p.record, opts->record, sz.ws_row, sz.ws_col) < 0) {
+            error("Unable to record to %s: %s", opts->record, strerror(errno));
+        } else {
+            /* Keyframes come from the screen. */
+            p.record.screen = &p.screen;
+            p.out.record = p.in.record = &p.record;
+            p.out.record_as = RECORD_OUTPUT;
+            p.in.record_as = RECORD_INPUT;
+        }
+    }
+    if (opts->screen_socket &&
+        snapshot_listen(&p.snapshot, &p.loop, &p.screen, opts->screen_socket) < 0)
+        error("Unable to listen on %s: %s", opts->screen_socket, strerror(errno));
+    if (opts->ring) {
+        if (shmring_listen(&p.ring, &p.loop, opts->ring,
+                           opts->ring_size ? opts->ring_size : SHMRING_DEFAULT_SIZE) < 0)
+            error("Unable to publish output at %s: %s", opts->ring, strerror(errno));
+        else
+            p.out.ring = &p.ring;
+    }
+    if (opts->feed && feed_open(&p, opts->feed) < 0)
+        error("Unable to feed %s to the program: %s", opts->feed, strerror(errno));
+    p.out.filters = opts->filters;
+    if (opts->triggers) {
+        opts->triggers->target = target;
+        opts->triggers->send = trigger_send;
+        opts->triggers->data = &p;
+        p.out.triggers = opts->triggers;
+    }
+    if (opts->history) {
+        if (history_init(&p.history, opts->history, opts->history_file) < 0) {
+            error("Unable to keep a history: %s", strerror(errno));
+        } else {
+            p.out.history = &p.history;
+            ev_watch_init(&p.dump_watch, -1, dump_ready, &p);
+            if (ev_add_signal(&p.loop, &p.dump_watch, SIGUSR1) < 0)
+                error("Unable to watch for SIGUSR1: %s", strerror(errno));
+        }
+    }
+    if (opts->share) {
+        if (term_set_history(&p.screen, opts->scrollback ? opts->scrollback
+                                                         : PROXY_DEFAULT_SCROLLBACK) < 0)
+            error("Unable to allocate the scrollback.");
+        if (share_listen(&p.share, &p.loop, &p.screen, opts->share) < 0) {
+            error("Unable to listen on %s: %s", opts->share, strerror(errno));
+        } else {
+            p.share.input = share_input;
+            if (opts->detached)
+                p.share.resize = share_resize;
+            if (p.out.history)
+                p.share.dump = dump_history;
+            p.share.handoff = share_handoff;
+            p.share.data = &p;
+            p.out.share = &p.share;
+        }
+    }
+    if (opts->taken)
+        proxy_resume(&p, opts->taken);
+    if (opts->ready_fd > 0) {
+        char ready = p.out.share != NULL;
+
+        if (write(opts->ready_fd, &ready, 1) < 0)
+            debug("Unable to say we're ready: %s", strerror(errno));
+        close(opts->ready_fd);
+    }
+
+    ev_watch_init(&p.exit_watch, -1, target_exited, &p);
+    if (target > 0 && ev_add_exit(&p.loop, &p.exit_watch, target) < 0)
+        debug("Unable to watch pid %d for exit: %s", (int)target, strerror(errno));
+
+    if (proxy_uring_wanted(&p)) {
+        if (proxy_uring_run(&p) == 0)
+            goto out;
+        if (opts->backend == PROXY_BACKEND_URING)
+            error("io_uring is unavailable (%s), falling back to %s.",
+                  strerror(errno), ev_backend_name());
+        else
+            debug("io_uring is unavailable: %s", strerror(errno));
+    }
+    proxy_event_run(&p);
+
+out:
+    relay_tap_finish(&p.out);
+    if (p.handoff)
+        proxy_handoff(&p);
+    if (p.feeding)
+        feed_done(&p);
+    if (p.snapshot.served)
+        debug("Served %llu screen snapshots.", p.snapshot.served);
+    snapshot_close(&p.snapshot);
+    if (p.share.joined)
+        debug("Shared with %llu viewers, who needed %llu resyncs.",
+              p.share.joined, p.share.resyncs);
+    share_close(&p.share);
+    if (p.ring.served)
+        debug("Handed out the output ring %llu times.", p.ring.served);
+    shmring_close(&p.ring);
+    ev_del(&p.loop, &p.exit_watch);
+    if (p.exit_watch.fd >= 0)
+        close(p.exit_watch.fd);
+    ev_free(&p.loop);
+    record_close(&p.record);
+    relay_report(&p.in);
+    relay_report(&p.out);
+    if (p.out.filters)
+        filter_report(p.out.filters);
+    if (p.out.triggers)
+        triggers_report(p.out.triggers);
+    latency_report(&p.in_latency, "input");
+    if (opts->fps)
+        debug("screen: %llu bytes of output drawn in %llu frames",
+              p.modeled, p.frames);
+    if (p.out.history) {
+        debug("history: %llu bytes, %llu compressed to %llu, %llu spilled, %llu dropped",
+              p.history.total, p.history.packed_in, p.history.packed_out,
+              p.history.spilled, p.history.dropped);
+        history_free(&p.history);
+    }
+    relay_free(&p.in);
+    relay_free(&p.out);
+    term_free(&p.screen);
+    term_view_free(&p.view);
+    term_out_free(&p.frame);
+}
@@ -0,0 +1,276 @@
+/*
+ * Copyright (C) 2011 by Nelson Elhage
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#ifndef PROXY_H
+#define PROXY_H
+
+#include <sys/types.h>
+
+#include "event.h"
+#include "filter.h"
+#include "history.h"
+#include "record.h"
+#include "ringbuf.h"
+#include "term.h"
+#include "share.h"
+#include "shmring.h"
+#include "snapshot.h"
+#include "trigger.h"
+
+/* Bytes we'll hold per direction before we stop reading its source. */
+#define PROXY_DEFAULT_BUFFER 65536
+/* Longest we spend moving output before looking for input again, in us. */
+#define PROXY_SLICE_US 2000
+/* A wait shorter than this (in us) means the loop was never idle. */
+#define PROXY_NOSLEEP_US 50
+/*
+ * How often (in us) to look for a ^Q while output is stopped and the
+ * buffer is full. The pty doesn't wake priority-only waiters for it.
+ */
+#define PROXY_STOPPED_POLL_US 20000
+/* The longest line a pty reading a line at a time takes (Linux's N_TTY_BUF_SIZE - 1) */
+#define PROXY_MAX_CANON 4095
+/* Lines of scrollback kept for viewers of a shared session */
+#define PROXY_DEFAULT_SCROLLBACK 10000
+/* Memory for --history, if only --history-file was given */
+#define PROXY_DEFAULT_HISTORY (16 * 1024 * 1024)
+
+enum proxy_backend {
+    PROXY_BACKEND_AUTO = 0,
+    PROXY_BACKEND_EVENT,
+    PROXY_BACKEND_URING,
+};
+
+struct proxy_options {
+    enum proxy_backend backend;
+    /* Move bytes with splice(2) through a pipe where the kernel allows. */
+    int splice;
+    /* Buffer limits for pty->stdout and stdin->pty; 0 means the default. */
+    size_t out_buffer;
+    size_t in_buffer;
+    /*
+     * How long (in milliseconds) output may sit in the buffer so that
+     * more can be coalesced into the same write. 0 writes immediately.
+     */
+    int flush_delay;
+    /*
+     * Put the pty in packet mode, so we hear when the slave's output is
+     * flushed (e.g. by ^C) or stopped, and can do the same to ours.
+     */
+    int packet;
+    /*
+     * If nonzero, keep a model of the screen and redraw what changed at
+     * most this many times a second, instead of relaying every byte.
+     */
+    int fps;
+    /* If set, serve snapshots of the screen on a Unix socket at this path. */
+    const char *screen_socket;
+    /* If set, let other terminals watch (and take turns typing) from here. */
+    const char *share;
+    /* Lines of scrollback to keep for viewers; 0 for the default. */
+    int scrollback;
+    /*
+     * We have no terminal of our own, and the screen takes the size of
+     * whichever viewer holds the write lock.
+     */
+    int detached;
+    /* If positive, write a byte here once viewers can connect: 1, or 0 if they can't. */
+    int ready_fd;
+    /*
+     * If nonzero, keep all output, compressed, in about this much memory,
+     * and older output in history_file if that's set.
+     */
+    size_t history;
+    const char *history_file;
+    /* If set, record everything that goes through us to this file */
+    const char *record;
+    /*
+     * If set, publish output in a shared memory ring of ring_size bytes
+     * (0 for the default), handed out on a Unix socket at this path.
+     */
+    const char *ring;
+    size_t ring_size;
+    /* If set, compiled triggers to fire on the program's output */
+    struct triggers *triggers;
+    /* If set, what everything but our own terminal sees of the output */
+    struct filter_chain *filters;
+    /* If set, a file or FIFO to type into the program, as fast as it goes */
+    const char *feed;
+    /* If set, a session taken over from another reptyr, to pick up where it left off */
+    const struct share_handoff *taken;
+};
+
+enum relay_mode {
+    RELAY_COPY = 0,
+    RELAY_SPLICE,
+    RELAY_URING,
+};
+
+/* One direction of the proxy: bytes flow from `from' to `to'. */
+struct relay {
+    const char *name;
+    int from;
+    int to;
+    enum relay_mode mode;
+    size_t limit;
+    struct ringbuf buf;
+    int pipe[2];
+    size_t pipe_size;
+    size_t in_pipe;
+    int pipe_full;
+    int eof;
+    /* r->from is a pty master in packet mode */
+    int packet;
+    /* Output has been stopped with ^S; hold on to it until ^Q. */
+    int stopped;
+    /* If nonzero, the most time (in us) one fill or flush may take. */
+    long long slice;
+    /* If set, everything read from `from' is also fed to this model. */
+    struct term *screen;
+    /* ... and then passed on to these viewers. */
+    struct share_server *share;
+    /* If set, everything read from `from' is kept here as well. */
+    struct history *history;
+    struct record *record;
+    enum record_type record_as;
+    /* ... and published here, and watched for triggers. */
+    struct shmring *ring;
+    struct triggers *triggers;
+    /* What all those see is first passed through these. */
+    struct filter_chain *filters;
+
+    unsigned long long spliced;
+    unsigned long long copied;
+    unsigned long long reads;
+    unsigned long long writes;
+    /* Times the buffer filled up and we stopped reading `from'. */
+    unsigned long long full;
+    size_t peak;
+    /* Bytes thrown away because the slave flushed its output. */
+    unsigned long long dropped;
+};
+
+/* Counts of samples <= 1us, <= 2us, ..., <= 2^(n-2)us, and the rest. */
+#define LATENCY_BUCKETS 24
+
+struct latency_hist {
+    unsigned long long count[LATENCY_BUCKETS];
+    unsigned long long samples;
+    long long max;
+};
+
+struct proxy {
+    int pty;
+    pid_t target;
+    int target_exited;
+    int done;
+    const struct proxy_options *opts;
+    /* When (per ev_now()) deferred output must be written, or 0. */
+    long long flush_at;
+
+    /* For measuring how long input waits in reptyr; see proxy_input_read(). */
+    long long wait_at;
+    long long prev_wait_at;
+    long long in_since;
+    struct latency_hist in_latency;
+
+    struct relay out;
+    struct relay in;
+    /* With opts->feed, until it's all in */
+    struct relay feed;
+    int feeding;
+    /* The feed isn't a regular file, so we can wait for it to be readable. */
+    int feed_pollable;
+    /* A client of the share socket to hand the session to, once out of the loop */
+    int handoff;
+
+    /*
+     * With opts->fps, opts->screen_socket or opts->share: the screen as
+     * the program drew it. With opts->fps, also the screen as we drew it.
+     */
+    struct term screen;
+    struct term_view view;
+    struct snapshot_server snapshot;
+    struct share_server share;
+    struct history history;
+    struct record record;
+    struct shmring ring;
+    struct watch dump_watch;
+    unsigned dumps;
+    /* A rendered frame, and how much of it is already in out.buf */
+    struct term_out frame;
+    size_t frame_off;
+    /* The screen changed since the last frame. */
+    int frame_dirty;
+    long long frame_at;
+    long long frame_last;
+    unsigned long long frames;
+    unsigned long long modeled;
+
+    struct event_loop loop;
+    struct watch pty_watch;
+    struct watch stdin_watch;
+    struct watch stdout_watch;
+    struct watch winch_watch;
+    struct watch exit_watch;
+    struct watch feed_in_watch;
+    struct watch feed_out_watch;
+};
+
+void resize_pty(int pty);
+int writeall(int fd, const void *buf, ssize_t count);
+
+/*
+ * Backends call these when they are about to wait for events, when
+ * they read input while nothing else was queued, and when the input
+ * queue empties, to fill in p->in_latency.
+ */
+void proxy_waiting(struct proxy *p);
+void proxy_input_read(struct proxy *p);
+void proxy_input_written(struct proxy *p);
+
+/*
+ * Backends call this with what they read into r's buffer, to pass it
+ * through r->filters to r->screen and the rest.
+ */
+void relay_tap(struct relay *r, const struct iovec *iov, size_t n);
+/* ... and this once there will be no more. */
+void relay_tap_finish(struct relay *r);
+
+/*
+ * Write out everything buffered in `r', then copy whatever is already
+ * waiting on r->from across. Only blocks if r->to does.
+ */
+void relay_drain(struct relay *r);
+
+/*
+ * Run the proxy on io_uring. Returns -1 without having touched any
+ * data if io_uring (or a feature we need from it) is unavailable.
+ */
+int proxy_uring_run(struct proxy *p);
+
+/*
+ * Relay between our stdio and the master side of `pty' until the
+ * slave side is closed or, if `target' is nonzero, that process exits.
+ */
+void do_proxy(int pty, pid_t target, const struct proxy_options *opts);
+
+#endif
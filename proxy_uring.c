@@ -0,0 +1,804 @@
+/*
+ * Copyright (C) 2011 by Nelson Elhage
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+/*
+ * An io_uring driven alternative to the readiness loop in proxy.c.
+ *
+ * Each direction keeps a multishot read outstanding on its source, with
+ * the kernel picking buffers out of a provided-buffer ring. Filled
+ * buffers are queued and written out with one writev per direction,
+ * covering as much of the queue as fits. Only one writev per direction
+ * is ever in flight, and the next is submitted when it completes,
+ * picking up after however much it wrote, so the writes stay ordered.
+ * Everything else the proxy watches (SIGWINCH, target exit, ...) still
+ * lives in the regular event loop, which we poll through the ring.
+ *
+ * A multishot read is only retried when its fd becomes readable, and a
+ * pty master whose slave has gone away only reports POLLHUP. So each
+ * source also gets a poll for hangup alone; when it fires we cancel
+ * the read and finish that direction off synchronously.
+ */
+
+#include <errno.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/types.h>
+
+#include "reptyr.h"
+#include "proxy.h"
+
+#ifdef __linux__
+
+#include <poll.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+/* Not in older uapi headers, but opcode numbers are ABI (Linux 6.7). */
+#define URING_OP_READ_MULTISHOT 49
+
+#define URING_ENTRIES  128
+#define URING_BUF_SIZE 4096
+/* Provided buffer rings hold a power of two of at most 32768 buffers. */
+#define URING_MAX_BUFS 32768
+/* Most buffers we hand to a single writev. */
+#define URING_IOV      32
+
+enum {
+    UD_READ = 1,
+    UD_WRITE,
+    UD_POLL,
+    UD_HUP,
+    UD_CANCEL,
+    UD_TIMER,
+    UD_STATUS,
+    UD_STOPPED,
+};
+
+#define UD(kind, dir, bid) ((__u64)(kind) | ((__u64)(dir) << 8) | ((__u64)(bid) << 16))
+#define UD_KIND(ud)        ((ud) & 0xff)
+#define UD_DIR(ud)         (((ud) >> 8) & 0xff)
+#define UD_BID(ud)         (((ud) >> 16) & 0xffff)
+
+enum {
+    DIR_OUT = 0,
+    DIR_IN,
+};
+
+struct uring_chunk {
+    unsigned short bid;
+    unsigned len;
+    unsigned off;
+};
+
+struct uring_dir {
+    struct relay *relay;
+    struct io_uring_buf_ring *br;
+    size_t br_len;
+    char *bufs;
+    unsigned nbufs;
+    unsigned short br_tail;
+    int registered;
+    int reading;
+    int stopped;
+    int finishing;
+
+    /* Filled buffers, oldest first, waiting to be written to relay->to */
+    struct uring_chunk *queue;
+    unsigned q_head;
+    unsigned q_count;
+    size_t queued;
+    unsigned inflight;
+    struct iovec iov[URING_IOV];
+    unsigned n_iov;
+    /* Drop the queue once the write in flight is done. */
+    int dropping;
+    int status_armed;
+    int stopped_armed;
+};
+
+struct uring {
+    int fd;
+    void *sq_ring;
+    size_t sq_len;
+    void *cq_ring;
+    size_t cq_len;
+    struct io_uring_sqe *sqes;
+    size_t sqes_len;
+
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    unsigned sq_entries;
+    unsigned sqe_tail;
+    unsigned to_submit;
+
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_cqe *cqes;
+
+    int poll_armed;
+    int timer_armed;
+    struct __kernel_timespec timer;
+    struct __kernel_timespec status_timer;
+    struct uring_dir dir[2];
+};
+
+static int uring_enter(struct uring *u, unsigned wait) {
+    int rv;
+
+    do {
+        rv = syscall(__NR_io_uring_enter, u->fd, u->to_submit, wait,
+                     wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+    } while (rv < 0 && errno == EINTR);
+    if (rv < 0)
+        return -1;
+    u->to_submit -= rv;
+    return 0;
+}
+
+static void uring_publish(struct uring *u) {
+    __atomic_store_n(u->sq_tail, u->sqe_tail, __ATOMIC_RELEASE);
+}
+
+static unsigned uring_sq_space(struct uring *u) {
+    return u->sq_entries - (u->sqe_tail - __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE));
+}
+
+static struct io_uring_sqe *uring_get_sqe(struct uring *u) {
+    struct io_uring_sqe *sqe;
+    unsigned idx;
+
+    if (uring_sq_space(u) == 0) {
+        uring_publish(u);
+        if (uring_enter(u, 0) < 0)
+            return NULL;
+    }
+    idx = u->sqe_tail & *u->sq_mask;
+    sqe = &u->sqes[idx];
+    memset(sqe, 0, sizeof *sqe);
+    u->sq_array[idx] = idx;
+    u->sqe_tail++;
+    u->to_submit++;
+    return sqe;
+}
+
+static int uring_opcode_supported(struct uring *u, int op) {
+    struct io_uring_probe *probe;
+    size_t len = sizeof *probe + 256 * sizeof(struct io_uring_probe_op);
+    int ok = 0;
+
+    probe = calloc(1, len);
+    if (probe == NULL)
+        return 0;
+    if (syscall(__NR_io_uring_register, u->fd, IORING_REGISTER_PROBE, probe, 256) == 0)
+        ok = op <= probe->last_op && (probe->ops[op].flags & IO_URING_OP_SUPPORTED);
+    free(probe);
+    return ok;
+}
+
+static void uring_add_buf(struct uring_dir *d, unsigned short bid) {
+    struct io_uring_buf *buf = &d->br->bufs[d->br_tail & (d->nbufs - 1)];
+
+    buf->addr = (unsigned long)(d->bufs + (size_t)bid * URING_BUF_SIZE);
+    buf->len = URING_BUF_SIZE;
+    buf->bid = bid;
+    d->br_tail++;
+    __atomic_store_n(&d->br->tail, d->br_tail, __ATOMIC_RELEASE);
+}
+
+static int uring_setup_bufs(struct uring *u, int dir, struct relay *r) {
+    struct uring_dir *d = &u->dir[dir];
+    struct io_uring_buf_reg reg;
+    int i;
+
+    /* Round the relay's buffer limit to a whole ring of buffers. */
+    d->relay = r;
+    d->nbufs = 2;
+    while (d->nbufs < URING_MAX_BUFS && (size_t)d->nbufs * URING_BUF_SIZE < r->limit)
+        d->nbufs *= 2;
+    d->queue = calloc(d->nbufs, sizeof *d->queue);
+    if (d->queue == NULL)
+        return -1;
+    d->br_len = d->nbufs * sizeof(struct io_uring_buf);
+    d->br = mmap(NULL, d->br_len, PROT_READ | PROT_WRITE,
+                 MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+    if (d->br == MAP_FAILED) {
+        d->br = NULL;
+        return -1;
+    }
+    d->bufs = malloc((size_t)d->nbufs * URING_BUF_SIZE);
+    if (d->bufs == NULL)
+        return -1;
+
+    memset(&reg, 0, sizeof reg);
+    reg.ring_addr = (unsigned long)d->br;
+    reg.ring_entries = d->nbufs;
+    reg.bgid = dir;
+    if (syscall(__NR_io_uring_register, u->fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0)
+        return -1;
+    d->registered = 1;
+
+    for (i = 0; i < d->nbufs; i++)
+        uring_add_buf(d, i);
+    return 0;
+}
+
+static void uring_free(struct uring *u) {
+    int i;
+
+    if (u->fd >= 0)
+        close(u->fd);
+    if (u->sqes)
+        munmap(u->sqes, u->sqes_len);
+    if (u->cq_ring && u->cq_ring != u->sq_ring)
+        munmap(u->cq_ring, u->cq_len);
+    if (u->sq_ring)
+        munmap(u->sq_ring, u->sq_len);
+    for (i = 0; i < 2; i++) {
+        if (u->dir[i].br)
+            munmap(u->dir[i].br, u->dir[i].br_len);
+        free(u->dir[i].bufs);
+        free(u->dir[i].queue);
+    }
+}
+
+static int uring_init(struct uring *u, struct proxy *p) {
+    struct io_uring_params params;
+
+    memset(u, 0, sizeof *u);
+    memset(&params, 0, sizeof params);
+    u->fd = -1;
+    /* The rest of the proxy's watches are reached through the epoll fd. */
+    if (p->loop.fd < 0) {
+        errno = EOPNOTSUPP;
+        return -1;
+    }
+    u->fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &params);
+    if (u->fd < 0)
+        return -1;
+
+    u->sq_len = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    u->cq_len = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        if (u->cq_len > u->sq_len)
+            u->sq_len = u->cq_len;
+        u->cq_len = u->sq_len;
+    }
+    u->sq_ring = mmap(NULL, u->sq_len, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQ_RING);
+    if (u->sq_ring == MAP_FAILED) {
+        u->sq_ring = NULL;
+        goto fail;
+    }
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        u->cq_ring = u->sq_ring;
+    } else {
+        u->cq_ring = mmap(NULL, u->cq_len, PROT_READ | PROT_WRITE,
+                          MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_CQ_RING);
+        if (u->cq_ring == MAP_FAILED) {
+            u->cq_ring = NULL;
+            goto fail;
+        }
+    }
+    u->sqes_len = params.sq_entries * sizeof(struct io_uring_sqe);
+    u->sqes = mmap(NULL, u->sqes_len, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQES);
+    if (u->sqes == MAP_FAILED) {
+        u->sqes = NULL;
+        goto fail;
+    }
+
+#define ring_ptr(ring, off) ((unsigned *)((char *)(ring) + (off)))
+    u->sq_head  = ring_ptr(u->sq_ring, params.sq_off.head);
+    u->sq_tail  = ring_ptr(u->sq_ring, params.sq_off.tail);
+    u->sq_mask  = ring_ptr(u->sq_ring, params.sq_off.ring_mask);
+    u->sq_array = ring_ptr(u->sq_ring, params.sq_off.array);
+    u->cq_head  = ring_ptr(u->cq_ring, params.cq_off.head);
+    u->cq_tail  = ring_ptr(u->cq_ring, params.cq_off.tail);
+    u->cq_mask  = ring_ptr(u->cq_ring, params.cq_off.ring_mask);
+    u->cqes     = (struct io_uring_cqe *)((char *)u->cq_ring + params.cq_off.cqes);
+#undef ring_ptr
+    u->sq_entries = params.sq_entries;
+    u->sqe_tail = *u->sq_tail;
+
+    if (!uring_opcode_supported(u, URING_OP_READ_MULTISHOT)) {
+        errno = EOPNOTSUPP;
+        goto fail;
+    }
+    if (uring_setup_bufs(u, DIR_OUT, &p->out) < 0 ||
+        uring_setup_bufs(u, DIR_IN, &p->in) < 0)
+        goto fail;
+    return 0;
+
+fail:
+    {
+        int saved = errno;
+        uring_free(u);
+        errno = saved;
+    }
+    return -1;
+}
+
+static void uring_arm_read(struct uring *u, int dir) {
+    struct uring_dir *d = &u->dir[dir];
+    struct io_uring_sqe *sqe;
+
+    if (d->reading || d->stopped)
+        return;
+    /*
+     * Backpressure: wait for writes to hand some buffers back. A packet
+     * mode pty can still tell us about ^Q meanwhile; see relay_read_status().
+     */
+    if (d->q_count == d->nbufs) {
+        if (d->relay->packet && !d->status_armed && (sqe = uring_get_sqe(u)) != NULL) {
+            sqe->opcode = IORING_OP_POLL_ADD;
+            sqe->fd = d->relay->from;
+            sqe->poll32_events = POLLPRI;
+            sqe->user_data = UD(UD_STATUS, dir, 0);
+            d->status_armed = 1;
+        }
+        /* A ^Q doesn't wake priority pollers; see relay_stuck(). */
+        if (d->relay->packet && d->relay->stopped && !d->stopped_armed &&
+            (sqe = uring_get_sqe(u)) != NULL) {
+            u->status_timer.tv_sec = 0;
+            u->status_timer.tv_nsec = PROXY_STOPPED_POLL_US * 1000;
+            sqe->opcode = IORING_OP_TIMEOUT;
+            sqe->addr = (unsigned long)&u->status_timer;
+            sqe->len = 1;
+            sqe->user_data = UD(UD_STOPPED, dir, 0);
+            d->stopped_armed = 1;
+        }
+        return;
+    }
+    if ((sqe = uring_get_sqe(u)) == NULL)
+        return;
+    sqe->opcode = URING_OP_READ_MULTISHOT;
+    sqe->fd = d->relay->from;
+    sqe->off = -1;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = dir;
+    sqe->user_data = UD(UD_READ, dir, 0);
+    d->reading = 1;
+}
+
+static void uring_arm_hup(struct uring *u, int dir) {
+    struct io_uring_sqe *sqe;
+
+    if ((sqe = uring_get_sqe(u)) == NULL)
+        return;
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = u->dir[dir].relay->from;
+    /* POLLERR and POLLHUP are always reported */
+    sqe->poll32_events = 0;
+    sqe->user_data = UD(UD_HUP, dir, 0);
+}
+
+static void uring_arm_poll(struct uring *u, struct proxy *p) {
+    struct io_uring_sqe *sqe;
+
+    if (u->poll_armed)
+        return;
+    if ((sqe = uring_get_sqe(u)) == NULL)
+        return;
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = p->loop.fd;
+    sqe->poll32_events = POLLIN;
+    sqe->user_data = UD(UD_POLL, 0, 0);
+    u->poll_armed = 1;
+}
+
+static void uring_cancel_read(struct uring *u, int dir) {
+    struct io_uring_sqe *sqe;
+
+    u->dir[dir].stopped = 1;
+    if (!u->dir[dir].reading)
+        return;
+    if ((sqe = uring_get_sqe(u)) == NULL)
+        return;
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->addr = UD(UD_READ, dir, 0);
+    sqe->user_data = UD(UD_CANCEL, dir, 0);
+}
+
+/* Submit (the head of) everything queued in one direction as one writev. */
+static void uring_flush(struct uring *u, int dir) {
+    struct uring_dir *d = &u->dir[dir];
+    struct io_uring_sqe *sqe;
+    struct uring_chunk *c;
+    unsigned i, n;
+
+    if (d->inflight || !d->q_count || d->relay->stopped)
+        return;
+    n = d->q_count < URING_IOV ? d->q_count : URING_IOV;
+    for (i = 0; i < n; i++) {
+        c = &d->queue[(d->q_head + i) % d->nbufs];
+        d->iov[i].iov_base = d->bufs + (size_t)c->bid * URING_BUF_SIZE + c->off;
+        d->iov[i].iov_len = c->len - c->off;
+    }
+    if ((sqe = uring_get_sqe(u)) == NULL)
+        return;
+    sqe->opcode = IORING_OP_WRITEV;
+    sqe->fd = d->relay->to;
+    sqe->addr = (unsigned long)d->iov;
+    sqe->len = n;
+    sqe->off = -1;
+    d->n_iov = n;
+    sqe->user_data = UD(UD_WRITE, dir, 0);
+    /*
+     * A write to a terminal that would block gets parked on a poll that
+     * may not be woken for a long time, since ttys only wake writers
+     * when they were throttled. Send writes straight to a worker thread
+     * instead, where they can simply block.
+     */
+    sqe->flags |= IOSQE_ASYNC;
+    d->inflight++;
+    d->relay->writes++;
+}
+
+/*
+ * Output waits up to --flush-delay for more to coalesce with, unless a
+ * good part of the buffers are already full. Input always goes at once.
+ */
+static int uring_flush_due(struct uring *u, struct proxy *p, int dir) {
+    struct uring_dir *d = &u->dir[dir];
+    long long now;
+
+    if (dir != DIR_OUT || !p->opts->flush_delay || d->finishing || !d->q_count)
+        return 1;
+    if (d->q_count >= d->nbufs / 2)
+        return 1;
+    now = ev_now();
+    if (!p->flush_at)
+        p->flush_at = now + p->opts->flush_delay * 1000LL;
+    if (now >= p->flush_at)
+        return 1;
+    if (!u->timer_armed) {
+        struct io_uring_sqe *sqe = uring_get_sqe(u);
+        if (sqe == NULL)
+            return 1;
+        u->timer.tv_sec = (p->flush_at - now) / 1000000;
+        u->timer.tv_nsec = (p->flush_at - now) % 1000000 * 1000;
+        sqe->opcode = IORING_OP_TIMEOUT;
+        sqe->addr = (unsigned long)&u->timer;
+        sqe->len = 1;
+        sqe->user_data = UD(UD_TIMER, 0, 0);
+        u->timer_armed = 1;
+    }
+    return 0;
+}
+
+/* Throw away queued data that isn't part of a write in flight. */
+static void uring_drop(struct uring_dir *d) {
+    struct uring_chunk *c;
+    unsigned keep = d->inflight ? d->n_iov : 0;
+
+    while (d->q_count > keep) {
+        c = &d->queue[(d->q_head + --d->q_count) % d->nbufs];
+        d->queued -= c->len - c->off;
+        d->relay->dropped += c->len - c->off;
+        uring_add_buf(d, c->bid);
+    }
+}
+
+/* See relay_packet() */
+static void uring_packet(struct uring *u, int dir, unsigned char status) {
+    struct uring_dir *d = &u->dir[dir];
+    struct io_uring_sqe *sqe;
+
+    if (status & TIOCPKT_FLUSHWRITE) {
+        uring_drop(d);
+        /*
+         * A write blocked on a slow terminal can hold a lot of output;
+         * interrupt it and drop whatever it didn't get to.
+         */
+        if (d->inflight && !d->dropping && (sqe = uring_get_sqe(u)) != NULL) {
+            sqe->opcode = IORING_OP_ASYNC_CANCEL;
+            sqe->addr = UD(UD_WRITE, dir, 0);
+            sqe->user_data = UD(UD_CANCEL, dir, 0);
+            d->dropping = 1;
+        }
+    }
+    if (status & TIOCPKT_STOP)
+        d->relay->stopped = 1;
+    if (status & TIOCPKT_START)
+        d->relay->stopped = 0;
+}
+
+static void uring_handle_read(struct uring *u, struct proxy *p, struct io_uring_cqe *cqe) {
+    int dir = UD_DIR(cqe->user_data);
+    struct uring_dir *d = &u->dir[dir];
+    struct uring_chunk *c;
+    struct iovec iov;
+
+    if (!(cqe->flags & IORING_CQE_F_MORE))
+        d->reading = 0;
+
+    if (cqe->res > 0) {
+        unsigned short bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+        unsigned char status = d->bufs[(size_t)bid * URING_BUF_SIZE];
+
+        d->relay->reads++;
+        if (d->relay->packet && status != TIOCPKT_DATA) {
+            uring_packet(u, dir, status);
+            uring_add_buf(d, bid);
+            return;
+        }
+        if (dir == DIR_IN)
+            proxy_input_read(p);
+        c = &d->queue[(d->q_head + d->q_count++) % d->nbufs];
+        c->bid = bid;
+        c->len = cqe->res;
+        /* Skip the packet mode header. */
+        c->off = d->relay->packet ? 1 : 0;
+        iov.iov_base = d->bufs + (size_t)bid * URING_BUF_SIZE + c->off;
+        iov.iov_len = c->len - c->off;
+        relay_tap(d->relay, &iov, iov.iov_len);
+        d->queued += c->len - c->off;
+        if (d->queued > d->relay->peak)
+            d->relay->peak = d->queued;
+        return;
+    }
+
+    switch (cqe->res) {
+    case -ENOBUFS:
+        /* Every buffer is queued for writing; re-armed as they drain. */
+        d->relay->full++;
+        return;
+    case -ECANCELED:
+        return;
+    case 0:
+        d->stopped = 1;
+        if (dir == DIR_IN) {
+            debug("EOF on stdin.");
+            return;
+        }
+        break;
+    case -EBADFD:
+        if (dir == DIR_IN) {
+            debug("Not watching stdin: %s", strerror(-cqe->res));
+            d->stopped = 1;
+            return;
+        }
+        /* fall through */
+    default:
+        d->stopped = 1;
+        errno = -cqe->res;
+        break;
+    }
+    p->done = 1;
+}
+
+static void uring_handle_write(struct uring *u, struct proxy *p, struct io_uring_cqe *cqe) {
+    int dir = UD_DIR(cqe->user_data);
+    struct uring_dir *d = &u->dir[dir];
+    struct uring_chunk *c;
+    unsigned left, take, done = 0;
+
+    d->inflight--;
+    if (cqe->res < 0 && cqe->res != -ECANCELED && cqe->res != -EAGAIN && cqe->res != -EINTR) {
+        errno = -cqe->res;
+        p->done = 1;
+    }
+
+    if (cqe->res > 0) {
+        d->relay->copied += cqe->res;
+        d->queued -= cqe->res;
+    }
+    /* A short write can stop anywhere, even in the middle of a buffer. */
+    for (left = cqe->res > 0 ? cqe->res : 0; left && d->q_count; left -= take) {
+        c = &d->queue[d->q_head];
+        take = c->len - c->off < left ? c->len - c->off : left;
+        c->off += take;
+        if (c->off < c->len)
+            break;
+        uring_add_buf(d, c->bid);
+        d->q_head = (d->q_head + 1) % d->nbufs;
+        d->q_count--;
+        done++;
+    }
+    if (d->dropping) {
+        /* The rest of this write predates the flush; anything after it doesn't. */
+        d->dropping = 0;
+        for (; done < d->n_iov && d->q_count; done++) {
+            c = &d->queue[d->q_head];
+            d->queued -= c->len - c->off;
+            d->relay->dropped += c->len - c->off;
+            uring_add_buf(d, c->bid);
+            d->q_head = (d->q_head + 1) % d->nbufs;
+            d->q_count--;
+        }
+    }
+    if (dir == DIR_IN && !d->q_count)
+        proxy_input_written(p);
+}
+
+/*
+ * The hangup poll can complete for other reasons too: a pty master in
+ * packet mode fails it with EINVAL when the slave flushes its output.
+ * Only a real hangup finishes the direction.
+ */
+static void uring_handle_hup(struct uring *u, struct io_uring_cqe *cqe) {
+    int dir = UD_DIR(cqe->user_data);
+    struct pollfd pfd = { .fd = u->dir[dir].relay->from, .events = 0 };
+
+    if (poll(&pfd, 1, 0) > 0 && (pfd.revents & (POLLHUP | POLLERR | POLLNVAL)))
+        u->dir[dir].finishing = 1;
+    else
+        uring_arm_hup(u, dir);
+}
+
+static void uring_handle_status(struct uring *u, struct io_uring_cqe *cqe) {
+    int dir = UD_DIR(cqe->user_data);
+    struct uring_dir *d = &u->dir[dir];
+    struct pollfd pfd = { .fd = d->relay->from, .events = POLLPRI };
+    unsigned char status;
+
+    if (UD_KIND(cqe->user_data) == UD_STOPPED)
+        d->stopped_armed = 0;
+    else
+        d->status_armed = 0;
+    /* Don't block if the multishot read got to it first. */
+    if (poll(&pfd, 1, 0) > 0 && (pfd.revents & POLLPRI) &&
+        read(d->relay->from, &status, 1) == 1 && status != TIOCPKT_DATA)
+        uring_packet(u, dir, status);
+}
+
+/* Returns how many completions there were. */
+static unsigned uring_reap(struct uring *u, struct proxy *p) {
+    unsigned head = *u->cq_head, start = head;
+    unsigned tail = __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE);
+    struct io_uring_cqe *cqe;
+
+    while (head != tail) {
+        cqe = &u->cqes[head & *u->cq_mask];
+        switch (UD_KIND(cqe->user_data)) {
+        case UD_READ:
+            uring_handle_read(u, p, cqe);
+            break;
+        case UD_WRITE:
+            uring_handle_write(u, p, cqe);
+            break;
+        case UD_HUP:
+            uring_handle_hup(u, cqe);
+            break;
+        case UD_TIMER:
+            u->timer_armed = 0;
+            break;
+        case UD_STATUS:
+        case UD_STOPPED:
+            uring_handle_status(u, cqe);
+            break;
+        case UD_POLL:
+            u->poll_armed = 0;
+            if (ev_run_once(&p->loop, 0) < 0) {
+                error("Event loop failed: %s", strerror(errno));
+                p->done = 1;
+            }
+            break;
+        }
+        head++;
+    }
+    __atomic_store_n(u->cq_head, head, __ATOMIC_RELEASE);
+    return head - start;
+}
+
+/*
+ * Stop reading from a direction's source, let its queue run dry, and
+ * then pick up whatever is still buffered there by hand.
+ */
+static void uring_finish(struct uring *u, struct proxy *p, int dir) {
+    struct uring_dir *d = &u->dir[dir];
+
+    /* No one is left to send ^Q. */
+    d->relay->stopped = 0;
+    if (!d->stopped)
+        uring_cancel_read(u, dir);
+    if (d->reading || d->inflight || d->q_count)
+        return;
+    relay_drain(d->relay);
+    d->finishing = 0;
+    if (dir == DIR_OUT)
+        p->done = 1;
+    else
+        debug("Hangup on stdin.");
+}
+
+int proxy_uring_run(struct proxy *p) {
+    struct uring u;
+    struct uring_dir *out = &u.dir[DIR_OUT];
+    struct uring_chunk *c;
+    int i;
+
+    if (uring_init(&u, p) < 0)
+        return -1;
+    debug("Using io_uring proxy backend.");
+
+    p->out.mode = p->in.mode = RELAY_URING;
+    for (i = 0; i < 2; i++) {
+        uring_arm_read(&u, i);
+        uring_arm_hup(&u, i);
+    }
+    uring_arm_poll(&u, p);
+
+    while (!p->done) {
+        uring_publish(&u);
+        proxy_waiting(p);
+        /* Don't sleep while there's history to compress or spill. */
+        if (uring_enter(&u, !history_pending(&p->history)) < 0) {
+            error("io_uring_enter: %s", strerror(errno));
+            break;
+        }
+        /* Only once the output has dried up, as in proxy_event_run(). */
+        if (uring_reap(&u, p) == 0 || history_overdue(&p->history))
+            history_work(&p->history);
+        if (p->target_exited)
+            u.dir[DIR_OUT].finishing = 1;
+        /* Input first, so keystrokes aren't queued behind output. */
+        for (i = DIR_IN; i >= DIR_OUT; i--) {
+            if (u.dir[i].finishing)
+                uring_finish(&u, p, i);
+            if (uring_flush_due(&u, p, i)) {
+                if (i == DIR_OUT)
+                    p->flush_at = 0;
+                uring_flush(&u, i);
+            }
+            uring_arm_read(&u, i);
+        }
+        uring_arm_poll(&u, p);
+    }
+
+    /* Don't lose output that was read but not yet written. */
+    uring_cancel_read(&u, DIR_OUT);
+    uring_cancel_read(&u, DIR_IN);
+    while (out->inflight || u.dir[DIR_IN].inflight || out->reading) {
+        uring_publish(&u);
+        if (uring_enter(&u, 1) < 0)
+            break;
+        uring_reap(&u, p);
+    }
+    while (out->q_count) {
+        c = &out->queue[out->q_head];
+        if (writeall(out->relay->to, out->bufs + (size_t)c->bid * URING_BUF_SIZE + c->off,
+                     c->len - c->off) == 0)
+            out->relay->copied += c->len - c->off;
+        out->q_head = (out->q_head + 1) % out->nbufs;
+        out->q_count--;
+    }
+
+    uring_free(&u);
+    return 0;
+}
+
+#else
+
+int proxy_uring_run(struct proxy *p) {
+    errno = ENOSYS;
+    return -1;
+}
+
+#endif
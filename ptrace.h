@@ -63,6 +63,8 @@ struct ptrace_child {
     unsigned long saved_syscall;
 #ifdef __linux__
 	struct user user;
+	/* How memory was last copied to or from the child, for debug output */
+	int memcpy_method;
 #endif
 #ifdef __FreeBSD__
 	struct reg regs;
@@ -73,6 +75,7 @@ struct syscall_numbers {
     long nr_mmap;
     long nr_mmap2;
     long nr_munmap;
+    long nr_mprotect;
     long nr_getsid;
     long nr_setsid;
     long nr_setpgid;
@@ -92,6 +95,20 @@ struct syscall_numbers {
 
 typedef unsigned long child_addr_t;
 
+/*
+ * One syscall of a program for ptrace_remote_program(). The program
+ * runs the calls in order, and stops early after a call flagged
+ * stop_on_error fails. Each call that ran gets ran set, and its return
+ * value in rv.
+ */
+struct remote_syscall {
+    unsigned long sysno;
+    unsigned long args[6];
+    int stop_on_error;
+    int ran;
+    unsigned long rv;
+};
+
 int ptrace_wait(struct ptrace_child *child);
 int ptrace_attach_child(struct ptrace_child *child, pid_t pid);
 int ptrace_finish_attach(struct ptrace_child *child, pid_t pid);
@@ -107,6 +124,10 @@ unsigned long ptrace_remote_syscall(struct ptrace_child *child,
                                     unsigned long p2, unsigned long p3,
                                     unsigned long p4, unsigned long p5);
 
+int ptrace_remote_program(struct ptrace_child *child,
+                          child_addr_t addr, size_t len,
+                          struct remote_syscall *calls, int n);
+
 int ptrace_memcpy_to_child(struct ptrace_child *, child_addr_t, const void*, size_t);
 int ptrace_memcpy_from_child(struct ptrace_child *, void*, child_addr_t, size_t);
 struct syscall_numbers *ptrace_syscall_numbers(struct ptrace_child *child);
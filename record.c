@@ -0,0 +1,313 @@
+/*
+ * Copyright (C) 2011 by Nelson Elhage
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <time.h>
+
+#include "reptyr.h"
+#include "event.h"
+#include "proxy.h"
+#include "reallocarray.h"
+#include "record.h"
+
+size_t record_put_varint(unsigned char *buf, uint64_t v) {
+    size_t n = 0;
+
+    while (v >= 0x80) {
+        buf[n++] = v | 0x80;
+        v >>= 7;
+    }
+    buf[n++] = v;
+    return n;
+}
+
+size_t record_get_varint(const unsigned char *buf, size_t len, uint64_t *v) {
+    size_t n;
+
+    *v = 0;
+    for (n = 0; n < len && n < 10; n++) {
+        *v |= (uint64_t)(buf[n] & 0x7f) << (7 * n);
+        if (!(buf[n] & 0x80))
+            return n + 1;
+    }
+    return 0;
+}
+
+/*
+ * The writer thread. Only it moves `tail', and it never blocks the
+ * relay: at worst, the ring fills up and chunks are dropped.
+ */
+static void *record_thread(void *data) {
+    struct record *r = data;
+    size_t head, tail = r->tail, off, n;
+    char buf[64];
+    ssize_t w;
+
+    for (;;) {
+        head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+        if (head == tail) {
+            if (__atomic_load_n(&r->stop, __ATOMIC_ACQUIRE))
+                break;
+            /* Check again once we've said we're going to sleep; see record_wake(). */
+            __atomic_store_n(&r->sleeping, 1, __ATOMIC_SEQ_CST);
+            if (__atomic_load_n(&r->head, __ATOMIC_SEQ_CST) == tail &&
+                !__atomic_load_n(&r->stop, __ATOMIC_SEQ_CST) &&
+                read(r->wake[0], buf, sizeof buf) < 0 && errno != EINTR)
+                break;
+            __atomic_store_n(&r->sleeping, 0, __ATOMIC_RELAXED);
+            continue;
+        }
+        off = tail & (RECORD_RING_SIZE - 1);
+        n = head - tail;
+        if (n > RECORD_RING_SIZE - off)
+            n = RECORD_RING_SIZE - off;
+        if (r->error) {
+            /* The file is no good any more, but keep the ring moving. */
+            w = n;
+        } else if ((w = write(r->fd, r->ring + off, n)) < 0) {
+            if (errno == EINTR)
+                continue;
+            r->error = errno;
+            w = n;
+        }
+        tail += w;
+        __atomic_store_n(&r->tail, tail, __ATOMIC_RELEASE);
+    }
+    return NULL;
+}
+
+static void record_wake(struct record *r) {
+    char c = 0;
+
+    /* Pairs with the thread setting `sleeping', then looking at `head'. */
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&r->sleeping, __ATOMIC_RELAXED) && write(r->wake[1], &c, 1) < 0) {
+        /* The pipe is full, so the thread will be up soon anyway. */
+    }
+}
+
+static void ring_copy(struct record *r, size_t at, const void *buf, size_t len) {
+    size_t off = at & (RECORD_RING_SIZE - 1);
+    size_t n = len < RECORD_RING_SIZE - off ? len : RECORD_RING_SIZE - off;
+
+    memcpy(r->ring + off, buf, n);
+    memcpy(r->ring, (const char *)buf + n, len - n);
+}
+
+/* Copy a chunk, with its payload in two pieces, into the ring if there's room. */
+static int record_put(struct record *r, enum record_type type, long long now,
+                      const void *head, size_t head_len, const void *buf, size_t len) {
+    unsigned char hdr[RECORD_MAX_HEADER];
+    size_t tail = __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+    size_t n = 0;
+
+    hdr[n++] = type;
+    n += record_put_varint(hdr + n, now - r->last);
+    n += record_put_varint(hdr + n, head_len + len);
+    if (RECORD_RING_SIZE - (r->head - tail) < n + head_len + len)
+        return -1;
+    ring_copy(r, r->head, hdr, n);
+    ring_copy(r, r->head + n, head, head_len);
+    ring_copy(r, r->head + n + head_len, buf, len);
+    __atomic_store_n(&r->head, r->head + n + head_len + len, __ATOMIC_RELEASE);
+    r->last = now;
+    return 0;
+}
+
+static void record_keyframe(struct record *r, long long now) {
+    unsigned char hdr[30];
+    struct record_key key = { now - r->start, r->header_len + r->head };
+    size_t n;
+
+    r->key_at = now;
+    r->since_key = 0;
+    r->key.len = 0;
+    if (term_keyframe(r->screen, &r->key) < 0)
+        return;
+    n = record_put_varint(hdr, key.time);
+    n += record_put_varint(hdr + n, r->screen->rows);
+    n += record_put_varint(hdr + n, r->screen->cols);
+    if (record_put(r, RECORD_KEYFRAME, now, hdr, n, r->key.buf, r->key.len) < 0)
+        return;
+    if (r->n_keys == r->allocated_keys) {
+        size_t alloc = r->allocated_keys ? 2 * r->allocated_keys : 64;
+        struct record_key *keys = xreallocarray(r->keys, alloc, sizeof *keys);
+
+        if (keys == NULL)
+            return;
+        r->keys = keys;
+        r->allocated_keys = alloc;
+    }
+    r->keys[r->n_keys++] = key;
+}
+
+void record_write(struct record *r, enum record_type type, const void *buf, size_t len) {
+    unsigned char lost[10];
+    long long now;
+
+    if (r->ring == NULL)
+        return;
+    now = ev_now();
+    if (r->lost &&
+        record_put(r, RECORD_LOST, now, lost, record_put_varint(lost, r->lost), NULL, 0) == 0)
+        r->lost = 0;
+    if (r->lost || record_put(r, type, now, NULL, 0, buf, len) < 0) {
+        r->lost += len;
+        r->dropped += len;
+        return;
+    }
+    r->chunks++;
+    r->bytes += len;
+    if (type == RECORD_OUTPUT && r->screen) {
+        r->since_key += len;
+        if (r->since_key >= RECORD_KEYFRAME_BYTES || now - r->key_at >= RECORD_KEYFRAME_US)
+            record_keyframe(r, now);
+    }
+    record_wake(r);
+}
+
+void record_resize(struct record *r, int rows, int cols) {
+    unsigned char buf[20];
+    size_t n;
+
+    n = record_put_varint(buf, rows);
+    n += record_put_varint(buf + n, cols);
+    record_write(r, RECORD_RESIZE, buf, n);
+}
+
+int record_open(struct record *r, const char *path, int rows, int cols) {
+    unsigned char hdr[RECORD_MAGIC_LEN + 30];
+    struct timeval tv;
+    sigset_t all, old;
+    size_t n = RECORD_MAGIC_LEN;
+    int err;
+
+    memset(r, 0, sizeof *r);
+    r->wake[0] = r->wake[1] = -1;
+    /* A transcript of a session is as private as the session. */
+    if ((r->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600)) < 0)
+        return -1;
+    gettimeofday(&tv, NULL);
+    memcpy(hdr, RECORD_MAGIC, RECORD_MAGIC_LEN);
+    n += record_put_varint(hdr + n, tv.tv_sec * 1000000ULL + tv.tv_usec);
+    n += record_put_varint(hdr + n, rows);
+    n += record_put_varint(hdr + n, cols);
+    r->header_len = n;
+    if (writeall(r->fd, hdr, n) < 0 ||
+        pipe2(r->wake, O_CLOEXEC) < 0 ||
+        fcntl(r->wake[1], F_SETFL, O_NONBLOCK) < 0 ||
+        (r->ring = malloc(RECORD_RING_SIZE)) == NULL)
+        goto fail;
+    r->start = r->last = r->key_at = ev_now();
+    /* Signals are for the event loop; don't let the thread take any. */
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+    err = pthread_create(&r->thread, NULL, record_thread, r);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    if (err) {
+        errno = err;
+        goto fail;
+    }
+    r->started = 1;
+    return 0;
+
+fail:
+    err = errno;
+    close(r->fd);
+    if (r->wake[0] >= 0) {
+        close(r->wake[0]);
+        close(r->wake[1]);
+    }
+    free(r->ring);
+    memset(r, 0, sizeof *r);
+    errno = err;
+    return -1;
+}
+
+/*
+ * With the thread done and everything in the ring written, add the
+ * index straight to the file.
+ */
+static int record_write_index(struct record *r) {
+    uint64_t at = r->header_len + r->head, prev_time = 0, prev_offset = 0;
+    unsigned char hdr[RECORD_MAX_HEADER], *buf;
+    size_t i, n = 0, len = 0;
+    int err;
+
+    if ((buf = malloc(10 + 20 * r->n_keys + 16)) == NULL)
+        return -1;
+    len += record_put_varint(buf + len, r->n_keys);
+    for (i = 0; i < r->n_keys; i++) {
+        len += record_put_varint(buf + len, r->keys[i].time - prev_time);
+        len += record_put_varint(buf + len, r->keys[i].offset - prev_offset);
+        prev_time = r->keys[i].time;
+        prev_offset = r->keys[i].offset;
+    }
+    for (i = 0; i < 8; i++)
+        buf[len++] = at >> (8 * i);
+    memcpy(buf + len, RECORD_INDEX_MAGIC, 8);
+    len += 8;
+    hdr[n++] = RECORD_INDEX;
+    n += record_put_varint(hdr + n, ev_now() - r->last);
+    n += record_put_varint(hdr + n, len);
+    err = writeall(r->fd, hdr, n) < 0 || writeall(r->fd, buf, len) < 0 ? -1 : 0;
+    free(buf);
+    return err;
+}
+
+void record_close(struct record *r) {
+    struct timespec deadline;
+    char c = 0;
+
+    if (!r->started)
+        return;
+    __atomic_store_n(&r->stop, 1, __ATOMIC_RELEASE);
+    if (write(r->wake[1], &c, 1) < 0) {
+        /* Full, so it's awake already. */
+    }
+    /* Give a stuck disk a while, but don't hang on our way out. */
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += RECORD_CLOSE_TIMEOUT;
+    if (pthread_timedjoin_np(r->thread, NULL, &deadline) != 0) {
+        error("Gave up waiting to finish writing the recording.");
+        pthread_cancel(r->thread);
+        pthread_join(r->thread, NULL);
+    } else if (!r->error && record_write_index(r) < 0) {
+        r->error = errno;
+    }
+    if (r->error)
+        error("Unable to write the recording: %s", strerror(r->error));
+    debug("record: %llu chunks, %llu bytes, %llu bytes dropped",
+          r->chunks, r->bytes, r->dropped);
+    close(r->fd);
+    close(r->wake[0]);
+    close(r->wake[1]);
+    free(r->ring);
+    free(r->keys);
+    term_out_free(&r->key);
+    memset(r, 0, sizeof *r);
+}
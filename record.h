@@ -0,0 +1,160 @@
+/*
+ * Copyright (C) 2011 by Nelson Elhage
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#ifndef RECORD_H
+#define RECORD_H
+
+#include <pthread.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "term.h"
+
+/*
+ * Recording a session to a file, for the record.
+ *
+ * The file starts with RECORD_MAGIC, then (as varints: 7 bits at a
+ * time, least significant first, the top bit set on all but the last
+ * byte) the wall clock time in microseconds since the epoch, and the
+ * rows and columns of the terminal.
+ *
+ * Then come chunks: a byte of enum record_type, the microseconds since
+ * the previous chunk (or the start) and the length of the payload, both
+ * as varints, then the payload itself.
+ *
+ * The relay only copies chunks into a ring; a thread of our own writes
+ * them out, so a slow disk never holds up the terminal. If the ring is
+ * full, chunks are dropped, and a RECORD_LOST chunk says how much was.
+ *
+ * Every so often there's a RECORD_KEYFRAME, from which the screen can
+ * be rebuilt without going through all the output before it. On a clean
+ * exit, the last chunk is a RECORD_INDEX of where the keyframes are, so
+ * a replay can find the one before any time straight away.
+ */
+
+#define RECORD_MAGIC "reptyr\x00\x01"
+#define RECORD_MAGIC_LEN 8
+/* Must be a power of two. */
+#define RECORD_RING_SIZE (1024 * 1024)
+/* How many seconds record_close() waits for the rest to be written */
+#define RECORD_CLOSE_TIMEOUT 5
+/* The most a chunk's header can take: a type and two 64-bit varints */
+#define RECORD_MAX_HEADER (1 + 2 * 10)
+
+enum record_type {
+    /* What the program wrote */
+    RECORD_OUTPUT = 1,
+    /* What was typed into it */
+    RECORD_INPUT,
+    /* The terminal changed size: rows, then columns, as varints */
+    RECORD_RESIZE,
+    /* The ring was full, and this many bytes of payload (a varint) were lost */
+    RECORD_LOST,
+    /*
+     * The microseconds since the start, rows and columns (varints), then
+     * what it takes to draw the screen as it is on a terminal that size:
+     * see term_keyframe().
+     */
+    RECORD_KEYFRAME,
+    /*
+     * The number of keyframes, then for each its time and its offset in
+     * the file, as varints relative to the one before. Then the offset of
+     * this chunk, as 8 bytes little-endian, and RECORD_INDEX_MAGIC, which
+     * end the file.
+     */
+    RECORD_INDEX,
+};
+
+#define RECORD_INDEX_MAGIC "reptyidx"
+/* A keyframe after this much output, or this long, whichever is first */
+#define RECORD_KEYFRAME_BYTES (1024 * 1024)
+#define RECORD_KEYFRAME_US (10 * 1000000LL)
+
+struct record_key {
+    uint64_t time;
+    uint64_t offset;
+};
+
+struct record {
+    int fd;
+    /* Written by whoever calls record_write(), read by the thread */
+    char *ring;
+    size_t head;
+    /* ... and the other way around */
+    size_t tail;
+    /* Set while the thread waits on `wake' for more to write */
+    int sleeping;
+    int stop;
+    int wake[2];
+    pthread_t thread;
+    int started;
+    /* The first error the thread ran into, or 0 */
+    int error;
+
+    /* Where the ring starts in the file */
+    size_t header_len;
+    long long start;
+    long long last;
+    unsigned long long lost;
+
+    /* If set, the screen the output goes to, for keyframes */
+    struct term *screen;
+    struct term_out key;
+    long long key_at;
+    size_t since_key;
+    struct record_key *keys;
+    size_t n_keys;
+    size_t allocated_keys;
+
+    unsigned long long chunks;
+    unsigned long long bytes;
+    unsigned long long dropped;
+};
+
+/*
+ * Create a recording at `path', of a terminal with this many rows and
+ * columns, and start the thread writing it. Returns -1 and sets errno
+ * on failure.
+ */
+int record_open(struct record *r, const char *path, int rows, int cols);
+
+/*
+ * Add a chunk. Never blocks; if there's no room, it's dropped. Output
+ * should go to r->screen (if set) first.
+ */
+void record_write(struct record *r, enum record_type type, const void *buf, size_t len);
+void record_resize(struct record *r, int rows, int cols);
+
+/*
+ * Write out whatever's left, unless that takes more than
+ * RECORD_CLOSE_TIMEOUT seconds, and stop the thread. Safe if never opened.
+ */
+void record_close(struct record *r);
+
+/* Encode `v' at `buf' as a varint, returning its length. */
+size_t record_put_varint(unsigned char *buf, uint64_t v);
+/*
+ * Decode a varint from the `len' bytes at `buf' into `*v'. Returns its
+ * length, or 0 if it's cut short or too long.
+ */
+size_t record_get_varint(const unsigned char *buf, size_t len, uint64_t *v);
+
+#endif
@@ -0,0 +1,453 @@
+/*
+ * Copyright (C) 2011 by Nelson Elhage
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "reptyr.h"
+#include "proxy.h"
+#include "reallocarray.h"
+#include "replay.h"
+
+int replay_chunk(struct replay *rp, size_t off, uint64_t time, struct replay_chunk *c) {
+    uint64_t delta, len;
+    size_t n;
+
+    if (off >= rp->end)
+        return -1;
+    c->type = rp->map[off++];
+    if ((n = record_get_varint(rp->map + off, rp->end - off, &delta)) == 0)
+        return -1;
+    off += n;
+    if ((n = record_get_varint(rp->map + off, rp->end - off, &len)) == 0 ||
+        len > rp->end - off - n)
+        return -1;
+    off += n;
+    c->time = time + delta;
+    c->data = rp->map + off;
+    c->len = len;
+    c->next = off + len;
+    return 0;
+}
+
+static int replay_add_key(struct replay *rp, size_t *allocated, uint64_t time, uint64_t offset) {
+    if (rp->n_keys == *allocated) {
+        size_t n = *allocated ? 2 * *allocated : 64;
+        struct record_key *keys = xreallocarray(rp->keys, n, sizeof *keys);
+
+        if (keys == NULL)
+            return -1;
+        rp->keys = keys;
+        *allocated = n;
+    }
+    rp->keys[rp->n_keys].time = time;
+    rp->keys[rp->n_keys].offset = offset;
+    rp->n_keys++;
+    return 0;
+}
+
+/* Load the keyframes from the index at the end, if there is one. */
+static int replay_load_index(struct replay *rp) {
+    const unsigned char *tail = rp->map + rp->size - 16;
+    struct replay_chunk c;
+    uint64_t at = 0, count, time = 0, offset = 0, v;
+    size_t allocated = 0, off, n;
+    int i;
+
+    if (rp->size < rp->data + 16 || memcmp(tail + 8, RECORD_INDEX_MAGIC, 8))
+        return -1;
+    for (i = 0; i < 8; i++)
+        at |= (uint64_t)tail[i] << (8 * i);
+    if (at < rp->data || at >= rp->size ||
+        replay_chunk(rp, at, 0, &c) < 0 || c.type != RECORD_INDEX)
+        return -1;
+    off = c.data - rp->map;
+    if ((n = record_get_varint(rp->map + off, rp->size - off, &count)) == 0)
+        return -1;
+    off += n;
+    while (count-- > 0) {
+        if ((n = record_get_varint(rp->map + off, rp->size - off, &v)) == 0)
+            return -1;
+        time += v;
+        off += n;
+        if ((n = record_get_varint(rp->map + off, rp->size - off, &v)) == 0)
+            return -1;
+        offset += v;
+        off += n;
+        if (offset < rp->data || offset >= at || replay_add_key(rp, &allocated, time, offset) < 0)
+            return -1;
+    }
+    rp->end = at;
+    rp->indexed = 1;
+    return 0;
+}
+
+/* No index, e.g. because we were killed: find the keyframes the slow way. */
+static int replay_scan(struct replay *rp) {
+    struct replay_chunk c;
+    size_t allocated = 0, off = rp->data;
+    uint64_t time = 0;
+
+    rp->n_keys = 0;
+    rp->end = rp->size;
+    while (replay_chunk(rp, off, time, &c) == 0 && c.type != RECORD_INDEX) {
+        if (c.type == RECORD_KEYFRAME && replay_add_key(rp, &allocated, c.time, off) < 0)
+            return -1;
+        off = c.next;
+        time = c.time;
+    }
+    rp->end = off;
+    return 0;
+}
+
+int replay_open(struct replay *rp, const char *path) {
+    struct stat st;
+    uint64_t v[3];
+    size_t off = RECORD_MAGIC_LEN, n;
+    int fd, i, err;
+
+    memset(rp, 0, sizeof *rp);
+    if ((fd = open(path, O_RDONLY | O_CLOEXEC)) < 0)
+        return -1;
+    if (fstat(fd, &st) < 0) {
+        err = errno;
+        close(fd);
+        errno = err;
+        return -1;
+    }
+    if (st.st_size < RECORD_MAGIC_LEN) {
+        close(fd);
+        errno = EINVAL;
+        return -1;
+    }
+    rp->size = st.st_size;
+    rp->map = mmap(NULL, rp->size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (rp->map == MAP_FAILED) {
+        rp->map = NULL;
+        return -1;
+    }
+    madvise((void *)rp->map, rp->size, MADV_SEQUENTIAL);
+    if (memcmp(rp->map, RECORD_MAGIC, RECORD_MAGIC_LEN))
+        goto invalid;
+    for (i = 0; i < 3; i++) {
+        if ((n = record_get_varint(rp->map + off, rp->size - off, &v[i])) == 0)
+            goto invalid;
+        off += n;
+    }
+    rp->start = v[0];
+    rp->rows = v[1] && v[1] < 10000 ? v[1] : 24;
+    rp->cols = v[2] && v[2] < 10000 ? v[2] : 80;
+    rp->data = off;
+    rp->end = rp->size;
+    if (replay_load_index(rp) < 0 && replay_scan(rp) < 0) {
+        replay_close(rp);
+        errno = ENOMEM;
+        return -1;
+    }
+    return 0;
+
+invalid:
+    replay_close(rp);
+    errno = EINVAL;
+    return -1;
+}
+
+void replay_close(struct replay *rp) {
+    if (rp->map)
+        munmap((void *)rp->map, rp->size);
+    free(rp->keys);
+    memset(rp, 0, sizeof *rp);
+}
+
+static int replay_resize(struct term *t, const struct replay_chunk *c) {
+    uint64_t rows, cols;
+    size_t n;
+
+    if ((n = record_get_varint(c->data, c->len, &rows)) == 0 ||
+        record_get_varint(c->data + n, c->len - n, &cols) == 0 ||
+        !rows || !cols || rows >= 10000 || cols >= 10000)
+        return 0;
+    return term_resize(t, rows, cols);
+}
+
+int replay_seek(struct replay *rp, uint64_t time, struct term *t) {
+    struct replay_chunk c;
+    size_t lo = 0, hi = rp->n_keys, off = rp->data, n = 0, k;
+    uint64_t now = 0, v[3];
+    int i;
+
+    /* The last keyframe at or before `time' */
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+
+        if (rp->keys[mid].time <= time)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    if (lo > 0 && replay_chunk(rp, rp->keys[lo - 1].offset, 0, &c) == 0) {
+        for (i = 0; i < 3; i++) {
+            if ((k = record_get_varint(c.data + n, c.len - n, &v[i])) == 0)
+                break;
+            n += k;
+        }
+        if (i == 3 && v[1] && v[2] && v[1] < 10000 && v[2] < 10000) {
+            if (term_init(t, v[1], v[2]) < 0)
+                return -1;
+            term_write(t, (const char *)c.data + n, c.len - n);
+            now = v[0];
+            off = c.next;
+        }
+    }
+    if (off == rp->data && term_init(t, rp->rows, rp->cols) < 0)
+        return -1;
+
+    while (replay_chunk(rp, off, now, &c) == 0 && c.time <= time) {
+        if (c.type == RECORD_OUTPUT)
+            term_write(t, (const char *)c.data, c.len);
+        else if (c.type == RECORD_RESIZE && replay_resize(t, &c) < 0)
+            return -1;
+        off = c.next;
+        now = c.time;
+    }
+    return 0;
+}
+
+static void format_time(char *buf, size_t size, struct replay *rp, uint64_t time) {
+    time_t wall = (rp->start + time) / 1000000;
+    struct tm tm;
+    size_t n;
+
+    n = snprintf(buf, size, "+%02llu:%02llu:%02llu.%03llu  ",
+                 (unsigned long long)(time / 3600000000ULL),
+                 (unsigned long long)(time / 60000000 % 60),
+                 (unsigned long long)(time / 1000000 % 60),
+                 (unsigned long long)(time / 1000 % 1000));
+    localtime_r(&wall, &tm);
+    strftime(buf + n, size - n, "%Y-%m-%d %H:%M:%S", &tm);
+}
+
+/*
+ * Parse a time to replay to: +SECONDS after the start, or HH:MM[:SS] on
+ * the clock, the first time it came round after the start.
+ */
+static int parse_at(struct replay *rp, const char *at, uint64_t *time) {
+    time_t start = rp->start / 1000000, wall;
+    int h, m, s = 0, end = 0;
+    struct tm tm;
+    char *p;
+    double secs;
+
+    if (at == NULL || !strcmp(at, "end")) {
+        *time = UINT64_MAX;
+        return 0;
+    }
+    if (at[0] == '+') {
+        secs = strtod(at + 1, &p);
+        if (p == at + 1 || *p || secs < 0)
+            return -1;
+        *time = secs * 1000000;
+        return 0;
+    }
+    if ((sscanf(at, "%d:%d%n:%d%n", &h, &m, &end, &s, &end) < 2) || at[end] ||
+        h < 0 || h > 23 || m < 0 || m > 59 || s < 0 || s > 60)
+        return -1;
+    localtime_r(&start, &tm);
+    tm.tm_hour = h;
+    tm.tm_min = m;
+    tm.tm_sec = s;
+    tm.tm_isdst = -1;
+    wall = mktime(&tm);
+    if (wall < start) {
+        tm.tm_mday++;
+        tm.tm_isdst = -1;
+        wall = mktime(&tm);
+    }
+    *time = (uint64_t)wall * 1000000 - rp->start;
+    return 0;
+}
+
+int replay_show(const char *path, const char *at) {
+    struct replay rp;
+    struct term t;
+    struct term_out out = {};
+    uint64_t time;
+    char when[64];
+    int err;
+
+    if (replay_open(&rp, path) < 0) {
+        error("Unable to read a recording from %s: %s", path, strerror(errno));
+        return 1;
+    }
+    if (parse_at(&rp, at, &time) < 0) {
+        error("Invalid time (want +SECONDS or HH:MM[:SS]): %s", at);
+        replay_close(&rp);
+        return 1;
+    }
+    debug("%s: %zu keyframes%s.", path, rp.n_keys, rp.indexed ? ", indexed" : "");
+    memset(&t, 0, sizeof t);
+    err = replay_seek(&rp, time, &t);
+    /* On a terminal, draw it as it was; otherwise just the text. */
+    if (err == 0)
+        err = isatty(1) ? term_redraw(&t, &out, 0) : term_snapshot(&t, &out);
+    if (err == 0 && writeall(1, out.buf, out.len) < 0)
+        err = -1;
+    if (err == 0 && time != UINT64_MAX) {
+        format_time(when, sizeof when, &rp, time);
+        fprintf(stderr, "%sScreen at %s\n", isatty(1) ? "\r\n" : "", when);
+    }
+    if (err < 0)
+        error("Unable to show the screen: %s", strerror(errno));
+    term_out_free(&out);
+    term_free(&t);
+    replay_close(&rp);
+    return err < 0;
+}
+
+/* Print the line around a match, without escape sequences and the like. */
+static void print_context(const unsigned char *buf, size_t len, size_t at) {
+    size_t start = at, end = at, i;
+
+    while (start > 0 && at - start < 160 && buf[start - 1] != '\n' && buf[start - 1] != '\r')
+        start--;
+    while (end < len && end - at < 160 && buf[end] != '\n' && buf[end] != '\r')
+        end++;
+    for (i = start; i < end; i++) {
+        if (buf[i] == 0x1b && i + 1 < end && buf[i + 1] == '[') {
+            /* Skip a CSI sequence, up to its final byte. */
+            for (i += 2; i < end && (buf[i] < 0x40 || buf[i] > 0x7e); i++)
+                ;
+        } else if (buf[i] >= 0x20 && buf[i] != 0x7f) {
+            putchar(buf[i]);
+        }
+    }
+    putchar('\n');
+}
+
+/*
+ * Pick the byte of the needle that's rarest in a sample of the output,
+ * for memchr() to look for: that's where the time goes, and it's as
+ * vectorized as it gets, so the fewer false starts the better.
+ */
+static size_t rarest_byte(struct replay *rp, const unsigned char *needle, size_t len) {
+    size_t count[256] = {}, off = rp->data, seen = 0, best = 0, i;
+    struct replay_chunk c;
+    uint64_t time = 0;
+
+    while (seen < 65536 && replay_chunk(rp, off, time, &c) == 0) {
+        if (c.type == RECORD_OUTPUT)
+            for (i = 0; i < c.len; i++)
+                count[c.data[i]]++;
+        seen += c.len;
+        off = c.next;
+        time = c.time;
+    }
+    for (i = 1; i < len; i++)
+        if (count[needle[i]] < count[needle[best]])
+            best = i;
+    return best;
+}
+
+int replay_search(const char *path, const char *needle) {
+    const unsigned char *n = (const unsigned char *)needle, *p, *end;
+    size_t len = strlen(needle), off, pick, carry_len = 0, i;
+    unsigned char *carry, *join;
+    unsigned long long matches = 0;
+    struct replay_chunk c;
+    struct replay rp;
+    uint64_t time = 0;
+    char when[64];
+
+    if (len == 0) {
+        error("Nothing to search for.");
+        return 1;
+    }
+    if (replay_open(&rp, path) < 0) {
+        error("Unable to read a recording from %s: %s", path, strerror(errno));
+        return 1;
+    }
+    /* The end of the last chunk, and that plus the start of the next, for matches across the two */
+    carry = malloc(len);
+    join = malloc(2 * len);
+    if (carry == NULL || join == NULL) {
+        error("Out of memory.");
+        free(carry);
+        free(join);
+        replay_close(&rp);
+        return 1;
+    }
+    pick = rarest_byte(&rp, n, len);
+    for (off = rp.data; replay_chunk(&rp, off, time, &c) == 0; off = c.next, time = c.time) {
+        if (c.type != RECORD_OUTPUT)
+            continue;
+        if (carry_len) {
+            size_t head = c.len < len - 1 ? c.len : len - 1;
+
+            memcpy(join, carry, carry_len);
+            memcpy(join + carry_len, c.data, head);
+            for (i = 0; i + len <= carry_len + head; i++) {
+                if (i < carry_len && !memcmp(join + i, n, len)) {
+                    format_time(when, sizeof when, &rp, c.time);
+                    printf("%s  ", when);
+                    print_context(join, carry_len + head, i);
+                    matches++;
+                }
+            }
+        }
+        p = c.data + pick;
+        end = c.data + c.len;
+        while (p < end && (p = memchr(p, n[pick], end - p)) != NULL) {
+            const unsigned char *m = p - pick;
+
+            if (m + len <= end && !memcmp(m, n, len)) {
+                format_time(when, sizeof when, &rp, c.time);
+                printf("%s  ", when);
+                print_context(c.data, c.len, m - c.data);
+                matches++;
+            }
+            p++;
+        }
+        /* Keep the last len - 1 bytes of output, across chunks if need be. */
+        if (c.len >= len - 1) {
+            carry_len = len - 1;
+            memcpy(carry, c.data + c.len - carry_len, carry_len);
+        } else {
+            size_t keep = carry_len + c.len > len - 1 ? len - 1 - c.len : carry_len;
+
+            memmove(carry, carry + carry_len - keep, keep);
+            memcpy(carry + keep, c.data, c.len);
+            carry_len = keep + c.len;
+        }
+    }
+    debug("%llu matches.", matches);
+    free(carry);
+    free(join);
+    replay_close(&rp);
+    return matches == 0;
+}
@@ -0,0 +1,89 @@
+/*
+ * Copyright (C) 2011 by Nelson Elhage
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#ifndef REPLAY_H
+#define REPLAY_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "record.h"
+#include "term.h"
+
+/*
+ * Reading recordings made with --record (see record.h): rebuilding the
+ * screen as it was at some point, and searching the output.
+ */
+
+struct replay {
+    const unsigned char *map;
+    size_t size;
+    /* Wall clock time at the start, in microseconds since the epoch */
+    uint64_t start;
+    int rows;
+    int cols;
+    /* Where the chunks start and end */
+    size_t data;
+    size_t end;
+    struct record_key *keys;
+    size_t n_keys;
+    /* Whether the keys came from the index, rather than a scan */
+    int indexed;
+};
+
+struct replay_chunk {
+    enum record_type type;
+    /* Microseconds since the start */
+    uint64_t time;
+    const unsigned char *data;
+    size_t len;
+    /* Where the next one starts */
+    size_t next;
+};
+
+/* Returns -1 and sets errno if `path' can't be read as a recording. */
+int replay_open(struct replay *rp, const char *path);
+void replay_close(struct replay *rp);
+
+/*
+ * Parse the chunk at `off', given the time of the one before. Returns
+ * -1 past the last one, including one that was cut short.
+ */
+int replay_chunk(struct replay *rp, size_t off, uint64_t time, struct replay_chunk *c);
+
+/*
+ * Set up `t' with the screen as it was `time' microseconds after the
+ * start, beginning from the last keyframe before then. Returns -1 if out
+ * of memory.
+ */
+int replay_seek(struct replay *rp, uint64_t time, struct term *t);
+
+/*
+ * Print the screen as it was at `at' (see the man page for the forms it
+ * takes; NULL means the end) from the recording at `path'. Returns the
+ * exit status for main().
+ */
+int replay_show(const char *path, const char *at);
+
+/* Print when and where `needle' turns up in the output. */
+int replay_search(const char *path, const char *needle);
+
+#endif
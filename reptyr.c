@@ -22,17 +22,25 @@
 #include <fcntl.h>
 #include <unistd.h>
 #include <sys/types.h>
-#include <sys/select.h>
 #include <sys/ioctl.h>
 #include <stdio.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <errno.h>
 #include <string.h>
 #include <stdarg.h>
 #include <termios.h>
 #include <signal.h>
+#include <getopt.h>
 
 #include "reptyr.h"
+#include "proxy.h"
+#include "mux.h"
+#include "capture.h"
+#include "filter.h"
+#include "shmring.h"
+#include "trigger.h"
+#include "replay.h"
 #include "reallocarray.h"
 #include "platform/platform.h"
 
@@ -86,109 +94,452 @@ void setup_raw(struct termios *save) {
         die("Unable to set terminal attributes: %m");
 }
 
-void resize_pty(int pty) {
-    struct winsize sz;
-    if (ioctl(0, TIOCGWINSZ, &sz) < 0) {
-        // provide fake size to workaround some problems
-        struct winsize defaultsize = {30, 80, 640, 480};
-        if (ioctl(pty, TIOCSWINSZ, &defaultsize) < 0) {
-            fprintf(stderr, "Cannot set terminal size\n");
+void usage(char *me) {
+    fprintf(stderr, "Usage: %s [-s] [--direct] PID\n", me);
+    fprintf(stderr, "       %s -l|-L [COMMAND [ARGS]]\n", me);
+    fprintf(stderr, "       %s --view=PATH|--control=PATH|--dump-history=PATH\n", me);
+    fprintf(stderr, "       %s --take=PATH\n", me);
+    fprintf(stderr, "  -l    Create a new pty pair and print the name of the slave.\n");
+    fprintf(stderr, "           if there are command-line arguments after -l\n");
+    fprintf(stderr, "           they are executed with REPTYR_PTY set to path of pty.\n");
+    fprintf(stderr, "  -L    Like '-l', but also redirect the child's stdio to the slave.\n");
+    fprintf(stderr, "  -s    Attach fds 0-2 on the target, even if it is not attached to a tty.\n");
+    fprintf(stderr, "  -T    Steal the entire terminal session of the target.\n");
+    fprintf(stderr, "           [experimental] May be more reliable, and will attach all\n");
+    fprintf(stderr, "           processes running on the terminal.\n");
+    fprintf(stderr, "  -h    Print this help message and exit.\n");
+    fprintf(stderr, "  -v    Print the version number and exit.\n");
+    fprintf(stderr, "  -V    Print verbose debug output.\n");
+    fprintf(stderr, "  --direct\n");
+    fprintf(stderr, "        Attach PID to this terminal itself, with no pty or proxy in\n");
+    fprintf(stderr, "           between, and wait for it to exit. Only works as the\n");
+    fprintf(stderr, "           terminal's session leader, e.g. a new tmux pane's command.\n");
+    fprintf(stderr, "  --backend=auto|io_uring|epoll\n");
+    fprintf(stderr, "        Choose how the proxy waits for I/O. 'auto' uses io_uring\n");
+    fprintf(stderr, "           if the kernel supports it, and epoll otherwise.\n");
+    fprintf(stderr, "  --splice\n");
+    fprintf(stderr, "        Relay with splice(2) instead of copying through reptyr,\n");
+    fprintf(stderr, "           where the kernel supports it.\n");
+    fprintf(stderr, "  --output-buffer=SIZE, --input-buffer=SIZE\n");
+    fprintf(stderr, "        How much output (resp. input) to hold while the other side\n");
+    fprintf(stderr, "           catches up, e.g. 16K or 1M. Default 64K.\n");
+    fprintf(stderr, "  --flush-delay=MS\n");
+    fprintf(stderr, "        Let output wait up to MS milliseconds so that bursts go out\n");
+    fprintf(stderr, "           in fewer, larger writes. Default 0.\n");
+    fprintf(stderr, "  --fps=N\n");
+    fprintf(stderr, "        Redraw the screen at most N times a second, sending only\n");
+    fprintf(stderr, "           what changed, instead of every byte of output.\n");
+    fprintf(stderr, "  --feed=FILE\n");
+    fprintf(stderr, "        Type FILE (or what's written to a FIFO) into the program as\n");
+    fprintf(stderr, "           fast as it reads it, along with what's typed here.\n");
+    fprintf(stderr, "  --screen-socket=PATH\n");
+    fprintf(stderr, "        Keep track of what is on the screen, and send it as text to\n");
+    fprintf(stderr, "           anyone who connects to a Unix socket at PATH.\n");
+    fprintf(stderr, "  --share=PATH\n");
+    fprintf(stderr, "        Let other terminals watch this one through a Unix socket\n");
+    fprintf(stderr, "           at PATH, and take turns typing.\n");
+    fprintf(stderr, "  --session=PATH\n");
+    fprintf(stderr, "        Like --share, but keep the proxy running in the background,\n");
+    fprintf(stderr, "           so the program outlives this terminal. Attach to it\n");
+    fprintf(stderr, "           again with --control=PATH.\n");
+    fprintf(stderr, "  --scrollback=LINES\n");
+    fprintf(stderr, "        Lines of scrollback to keep for viewers. Default 10000.\n");
+    fprintf(stderr, "  --history=SIZE\n");
+    fprintf(stderr, "        Keep all output, compressed, in about SIZE of memory, e.g. 64M.\n");
+    fprintf(stderr, "           Older output is thrown away, or kept in --history-file.\n");
+    fprintf(stderr, "           SIGUSR1 dumps it to a file in the current directory.\n");
+    fprintf(stderr, "  --history-file=PATH\n");
+    fprintf(stderr, "        Move output that doesn't fit in --history to a file at PATH.\n");
+    fprintf(stderr, "  --record=FILE\n");
+    fprintf(stderr, "        Record all input and output, with timings, to FILE.\n");
+    fprintf(stderr, "  --ring=PATH [--ring-size=SIZE]\n");
+    fprintf(stderr, "        Publish output in shared memory (SIZE of it, default 1M),\n");
+    fprintf(stderr, "           for readers to map from a Unix socket at PATH.\n");
+    fprintf(stderr, "  --tail=PATH\n");
+    fprintf(stderr, "        Copy output published with --ring=PATH to stdout.\n");
+    fprintf(stderr, "  --match=STRING --exec=COMMAND|--notify=SOCKET|--send=TEXT\n");
+    fprintf(stderr, "        Whenever STRING turns up in the output (at most once a\n");
+    fprintf(stderr, "           second), run COMMAND with sh -c, write a line to a Unix\n");
+    fprintf(stderr, "           SOCKET, or type TEXT into the program. STRING and TEXT\n");
+    fprintf(stderr, "           may use \\n, \\r, \\t, \\e, \\\\ and \\xHH. Repeatable.\n");
+    fprintf(stderr, "  --filter=strip-ansi|timestamp|redact=STRING\n");
+    fprintf(stderr, "        Pass output through a filter before anything but this\n");
+    fprintf(stderr, "           terminal sees it: viewers, logs, recordings, triggers.\n");
+    fprintf(stderr, "           Repeatable; filters run in the order given.\n");
+    fprintf(stderr, "  --replay=FILE [--at=TIME]\n");
+    fprintf(stderr, "        Show the screen as it was at TIME in a --record FILE: +SECONDS\n");
+    fprintf(stderr, "           after the start, or HH:MM[:SS]. Default the end.\n");
+    fprintf(stderr, "  --replay=FILE --search=STRING\n");
+    fprintf(stderr, "        Show when STRING turned up in the output recorded in FILE.\n");
+    fprintf(stderr, "  --view=PATH, --control=PATH\n");
+    fprintf(stderr, "        Watch a session shared with --share. With --control, also\n");
+    fprintf(stderr, "           take the write lock. ^] w toggles it, ^] q quits.\n");
+    fprintf(stderr, "  --dump-history=PATH\n");
+    fprintf(stderr, "        Write the --history of a session shared at PATH to stdout.\n");
+    fprintf(stderr, "  --take=PATH\n");
+    fprintf(stderr, "        Take over a session shared with --share at PATH from the\n");
+    fprintf(stderr, "           reptyr running it, which exits, and carry on with it here.\n");
+    fprintf(stderr, "  --mux=PATH [-s|-T] [PID]\n");
+    fprintf(stderr, "        Without PID, start a process in the background that looks\n");
+    fprintf(stderr, "           after many sessions, served at PATH. With PID, have it\n");
+    fprintf(stderr, "           attach to PID and print the new session's id. Each\n");
+    fprintf(stderr, "           session keeps --history (default 1M) and --scrollback\n");
+    fprintf(stderr, "           (default 1000 lines) of its own.\n");
+    fprintf(stderr, "  --mux=PATH --list\n");
+    fprintf(stderr, "        List the sessions of the mux at PATH.\n");
+    fprintf(stderr, "  --capture=PATH [--rotate-size=SIZE] [--rotate-time=SECONDS] [--keep=N]\n");
+    fprintf(stderr, "        Don't proxy to this terminal: carry on in the background,\n");
+    fprintf(stderr, "           appending all output to PATH. Once it is SIZE big or\n");
+    fprintf(stderr, "           SECONDS old, or on SIGHUP, PATH moves to PATH.1, and so on\n");
+    fprintf(stderr, "           up to PATH.N (default 5).\n");
+    fprintf(stderr, "  --id=N\n");
+    fprintf(stderr, "        With --view, --control or --dump-history, PATH is a mux, and\n");
+    fprintf(stderr, "           N the session on it.\n");
+}
+
+/*
+ * Fork a child to carry on in the background, in a session of its own
+ * and with stdio on /dev/null. Like fork(), returns 0 in the child, with
+ * `*ready' set to a pipe to write a nonzero byte to once it's up and
+ * running. The parent waits for that, then gets the child's pid, or -1
+ * if it gave up.
+ */
+static pid_t background(int *ready) {
+    int fds[2], null;
+    char ok = 0;
+    pid_t pid;
+
+    if (pipe2(fds, O_CLOEXEC) < 0)
+        die("Unable to create a pipe: %m");
+    if ((pid = fork()) < 0)
+        die("Unable to fork: %m");
+    if (pid == 0) {
+        close(fds[0]);
+        setsid();
+        if ((null = open("/dev/null", O_RDWR)) >= 0) {
+            dup2(null, 0);
+            dup2(null, 1);
+            if (!verbose)
+                dup2(null, 2);
+            if (null > 2)
+                close(null);
         }
-        return;
+        *ready = fds[1];
+        return 0;
     }
-    ioctl(pty, TIOCSWINSZ, &sz);
+    close(fds[1]);
+    if (read(fds[0], &ok, 1) != 1 || !ok)
+        pid = -1;
+    close(fds[0]);
+    return pid;
 }
 
-int writeall(int fd, const void *buf, ssize_t count) {
-    ssize_t rv;
-    while (count > 0) {
-        rv = write(fd, buf, count);
-        if (rv < 0) {
-            if (errno == EINTR)
-                continue;
-            return rv;
-        }
-        count -= rv;
-        buf += rv;
+/*
+ * Leave the proxy running in a session of its own, where it keeps the
+ * pty open whatever happens to this terminal, and watch it from here
+ * like any other viewer.
+ */
+static int run_session(int pty, pid_t target, struct proxy_options *opts) {
+    struct termios saved_termios;
+    int err;
+    pid_t pid;
+
+    if ((pid = background(&opts->ready_fd)) == 0) {
+        do_proxy(pty, target, opts);
+        _exit(0);
+    }
+    close(pty);
+    if (pid < 0) {
+        fprintf(stderr, "Unable to start a session at %s.\n", opts->share);
+        return 1;
     }
+    printf("Session at %s; ^] q detaches, --control=%s attaches again.\n",
+           opts->share, opts->share);
+    fflush(stdout);
+
+    setup_raw(&saved_termios);
+    err = share_view(opts->share, -1, 1);
+    tcsetattr(0, TCSANOW, &saved_termios);
+    return err;
+}
+
+/* Proxy the pty on this terminal, or in a session of its own. */
+static int run_proxy(int pty, pid_t target, struct proxy_options *opts) {
+    struct termios saved_termios;
+
+    if (opts->detached)
+        return run_session(pty, target, opts);
+    setup_raw(&saved_termios);
+    do_proxy(pty, target, opts);
+    do {
+        errno = 0;
+        if (tcsetattr(0, TCSANOW, &saved_termios) && errno != EINTR)
+            die("Unable to tcsetattr: %m");
+    } while (errno == EINTR);
+
     return 0;
 }
 
-volatile sig_atomic_t winch_happened = 0;
+/*
+ * Take over the session shared at `path' from the reptyr running it,
+ * which exits, and carry on with it here.
+ */
+static int run_take(const char *path, struct proxy_options *opts) {
+    struct share_handoff taken;
+    int err;
 
-void do_winch(int signal) {
-    winch_happened = 1;
+    if (share_take(path, &taken) < 0)
+        return 1;
+    opts->taken = &taken;
+    opts->packet = !!(taken.flags & SHARE_HANDOFF_PACKET);
+    err = run_proxy(taken.pty, taken.target, opts);
+    share_handoff_free(&taken);
+    return err;
 }
 
-void do_proxy(int pty) {
-    char buf[4096];
-    ssize_t count;
-    fd_set set;
-    struct timeval timeout;
-    while (1) {
-        if (winch_happened) {
-            winch_happened = 0;
-            /*
-             * FIXME: If a signal comes in after this point but before
-             * select(), the resize will be delayed until we get more
-             * input. signalfd() is probably the cleanest solution.
-             */
-            resize_pty(pty);
-        }
-        FD_ZERO(&set);
-        FD_SET(0, &set);
-        FD_SET(pty, &set);
-        timeout.tv_sec = 0;
-        timeout.tv_usec = 1000;
-        if (select(pty + 1, &set, NULL, NULL, &timeout) < 0) {
-            if (errno == EINTR)
-                continue;
-            fprintf(stderr, "select: %m");
-            return;
-        }
-        if (FD_ISSET(0, &set)) {
-            count = read(0, buf, sizeof buf);
-            if (count < 0)
-                return;
-            writeall(pty, buf, count);
-        }
-        if (FD_ISSET(pty, &set)) {
-            count = read(pty, buf, sizeof buf);
-            if (count <= 0)
-                return;
-            writeall(1, buf, count);
-        }
+/* Start a mux in the background, to look after sessions we attach to later. */
+static int run_mux(const char *path, struct proxy_options *opts) {
+    pid_t pid;
+
+    if ((pid = background(&opts->ready_fd)) == 0) {
+        do_mux(path, opts);
+        _exit(0);
+    }
+    if (pid < 0) {
+        fprintf(stderr, "Unable to start a mux at %s.\n", path);
+        return 1;
     }
+    printf("Serving sessions at %s (pid %d); `reptyr --mux=%s PID' adds one.\n",
+           path, (int)pid, path);
+    return 0;
 }
 
-void usage(char *me) {
-    fprintf(stderr, "Usage: %s [-s] PID\n", me);
-    fprintf(stderr, "       %s -l|-L [COMMAND [ARGS]]\n", me);
-    fprintf(stderr, "  -l    Create a new pty pair and print the name of the slave.\n");
-    fprintf(stderr, "           if there are command-line arguments after -l\n");
-    fprintf(stderr, "           they are executed with REPTYR_PTY set to path of pty.\n");
-    fprintf(stderr, "  -L    Like '-l', but also redirect the child's stdio to the slave.\n");
-    fprintf(stderr, "  -s    Attach fds 0-2 on the target, even if it is not attached to a tty.\n");
-    fprintf(stderr, "  -T    Steal the entire terminal session of the target.\n");
-    fprintf(stderr, "           [experimental] May be more reliable, and will attach all\n");
-    fprintf(stderr, "           processes running on the terminal.\n");
-    fprintf(stderr, "  -h    Print this help message and exit.\n");
-    fprintf(stderr, "  -v    Print the version number and exit.\n");
-    fprintf(stderr, "  -V    Print verbose debug output.\n");
+/* Leave the output of the pty going to a log, with nothing on this terminal. */
+static int run_capture(int pty, pid_t target, struct capture_options *opts) {
+    pid_t pid;
+
+    if ((pid = background(&opts->ready_fd)) == 0) {
+        do_capture(pty, target, opts);
+        _exit(0);
+    }
+    close(pty);
+    if (pid < 0) {
+        fprintf(stderr, "Unable to capture to %s.\n", opts->path);
+        return 1;
+    }
+    printf("Capturing to %s (pid %d).\n", opts->path, (int)pid);
+    return 0;
+}
+
+/*
+ * Give our own terminal to `pid', with no new pty and no proxy in
+ * between. A terminal belongs to a single session, so only its session
+ * leader can hand it on: we have to be the command of a new tmux pane,
+ * say, or have been run with exec.
+ */
+static int attach_direct(pid_t pid, int force_stdio) {
+    const char *tty = ttyname(0);
+    int err;
+
+    if (tty == NULL)
+        die("--direct needs to run on a terminal: %m");
+    if (getsid(0) != getpid() || tcgetsid(0) != getpid())
+        die("--direct only works as the session leader on %s: run it as the "
+            "command of a new tmux pane or window, or with exec.", tty);
+    /* Giving up the terminal hangs up its foreground process group: us. */
+    signal(SIGHUP, SIG_IGN);
+    if (ioctl(0, TIOCNOTTY) < 0)
+        die("Unable to give up %s: %m", tty);
+    if ((err = attach_child(pid, tty, force_stdio)) && ioctl(0, TIOCSCTTY, 0) < 0)
+        debug("Unable to take %s back: %s", tty, strerror(errno));
+    return err;
 }
 
+static void direct_exited(struct event_loop *loop, struct watch *w, int revents) {
+    *(int *)w->data = 1;
+}
+
+/*
+ * Whatever runs the terminal (tmux, or an ssh session) usually closes
+ * it once we exit, so hang on until `pid' is done with it.
+ */
+static int wait_direct(pid_t pid) {
+    struct event_loop loop;
+    struct watch w;
+    int done = 0;
+
+    debug("Attached pid %d to this terminal; waiting for it to exit.", (int)pid);
+    if (ev_init(&loop) < 0)
+        die("Unable to create event loop: %m");
+    ev_watch_init(&w, -1, direct_exited, &done);
+    if (ev_add_exit(&loop, &w, pid) < 0) {
+        /* No way to be told, so look once a second. */
+        while (kill(pid, 0) == 0 || errno == EPERM)
+            sleep(1);
+        done = 1;
+    }
+    while (!done && ev_run_once(&loop, -1) >= 0)
+        ;
+    ev_del(&loop, &w);
+    if (w.fd >= 0)
+        close(w.fd);
+    ev_free(&loop);
+    return 0;
+}
+
+/* Ask the mux at `path' to take over pid `arg', and print the session's id. */
+static int mux_attach(const char *path, const char *arg, int force_stdio, int steal) {
+    unsigned char buf[5];
+    char *end;
+    long pid;
+
+    errno = 0;
+    pid = strtol(arg, &end, 10);
+    if (errno || *end || end == arg || pid < 1 || pid > INT32_MAX)
+        die("Invalid pid: %s", arg);
+    buf[0] = pid >> 24;
+    buf[1] = pid >> 16;
+    buf[2] = pid >> 8;
+    buf[3] = pid;
+    buf[4] = (force_stdio ? SHARE_ATTACH_STDIO : 0) | (steal ? SHARE_ATTACH_STEAL : 0);
+    return share_request(path, SHARE_ATTACH, buf, sizeof buf);
+}
+
+/* Parse a byte count with an optional K, M or G suffix. */
+static size_t parse_size(const char *opt, const char *arg) {
+    char *end;
+    unsigned long long n;
+
+    errno = 0;
+    n = strtoull(arg, &end, 10);
+    switch (*end) {
+    case 'g': case 'G':
+        n *= 1024;
+        /* fall through */
+    case 'm': case 'M':
+        n *= 1024;
+        /* fall through */
+    case 'k': case 'K':
+        n *= 1024;
+        end++;
+        break;
+    }
+    if (errno || end == arg || *end || n == 0 || n > (1ULL << 30))
+        die("Invalid size for --%s: %s", opt, arg);
+    return n;
+}
+
+enum {
+    OPT_SPLICE = 0x100,
+    OPT_BACKEND,
+    OPT_OUTPUT_BUFFER,
+    OPT_INPUT_BUFFER,
+    OPT_FLUSH_DELAY,
+    OPT_FPS,
+    OPT_SCREEN_SOCKET,
+    OPT_SHARE,
+    OPT_SESSION,
+    OPT_SCROLLBACK,
+    OPT_HISTORY,
+    OPT_HISTORY_FILE,
+    OPT_VIEW,
+    OPT_CONTROL,
+    OPT_DUMP_HISTORY,
+    OPT_MUX,
+    OPT_LIST,
+    OPT_ID,
+    OPT_RECORD,
+    OPT_REPLAY,
+    OPT_AT,
+    OPT_SEARCH,
+    OPT_CAPTURE,
+    OPT_ROTATE_SIZE,
+    OPT_ROTATE_TIME,
+    OPT_KEEP,
+    OPT_RING,
+    OPT_RING_SIZE,
+    OPT_TAIL,
+    OPT_MATCH,
+    OPT_EXEC,
+    OPT_NOTIFY,
+    OPT_SEND,
+    OPT_FILTER,
+    OPT_FEED,
+    OPT_TAKE,
+    OPT_DIRECT,
+};
+
+static struct option long_options[] = {
+    { "splice", no_argument, NULL, OPT_SPLICE },
+    { "backend", required_argument, NULL, OPT_BACKEND },
+    { "output-buffer", required_argument, NULL, OPT_OUTPUT_BUFFER },
+    { "input-buffer", required_argument, NULL, OPT_INPUT_BUFFER },
+    { "flush-delay", required_argument, NULL, OPT_FLUSH_DELAY },
+    { "fps", required_argument, NULL, OPT_FPS },
+    { "screen-socket", required_argument, NULL, OPT_SCREEN_SOCKET },
+    { "share", required_argument, NULL, OPT_SHARE },
+    { "session", required_argument, NULL, OPT_SESSION },
+    { "scrollback", required_argument, NULL, OPT_SCROLLBACK },
+    { "history", required_argument, NULL, OPT_HISTORY },
+    { "history-file", required_argument, NULL, OPT_HISTORY_FILE },
+    { "view", required_argument, NULL, OPT_VIEW },
+    { "control", required_argument, NULL, OPT_CONTROL },
+    { "dump-history", required_argument, NULL, OPT_DUMP_HISTORY },
+    { "mux", required_argument, NULL, OPT_MUX },
+    { "list", no_argument, NULL, OPT_LIST },
+    { "id", required_argument, NULL, OPT_ID },
+    { "record", required_argument, NULL, OPT_RECORD },
+    { "replay", required_argument, NULL, OPT_REPLAY },
+    { "at", required_argument, NULL, OPT_AT },
+    { "search", required_argument, NULL, OPT_SEARCH },
+    { "capture", required_argument, NULL, OPT_CAPTURE },
+    { "rotate-size", required_argument, NULL, OPT_ROTATE_SIZE },
+    { "rotate-time", required_argument, NULL, OPT_ROTATE_TIME },
+    { "keep", required_argument, NULL, OPT_KEEP },
+    { "ring", required_argument, NULL, OPT_RING },
+    { "ring-size", required_argument, NULL, OPT_RING_SIZE },
+    { "tail", required_argument, NULL, OPT_TAIL },
+    { "match", required_argument, NULL, OPT_MATCH },
+    { "exec", required_argument, NULL, OPT_EXEC },
+    { "notify", required_argument, NULL, OPT_NOTIFY },
+    { "send", required_argument, NULL, OPT_SEND },
+    { "filter", required_argument, NULL, OPT_FILTER },
+    { "feed", required_argument, NULL, OPT_FEED },
+    { "take", required_argument, NULL, OPT_TAKE },
+    { "direct", no_argument, NULL, OPT_DIRECT },
+    { NULL, 0, NULL, 0 },
+};
+
 int main(int argc, char **argv) {
     struct termios saved_termios;
-    struct sigaction act;
     int pty;
+    pid_t target = 0;
+    struct proxy_options proxy_opts = {};
+    struct capture_options capture_opts = { .keep = CAPTURE_DEFAULT_KEEP };
     int opt;
     int err;
     int do_attach = 1;
     int force_stdio = 0;
     int do_steal = 0;
     int unattached_script_redirection = 0;
+    const char *view = NULL;
+    const char *dump = NULL;
+    int view_writable = 0;
+    const char *mux = NULL;
+    int list = 0;
+    int id = -1;
+    const char *replay = NULL;
+    const char *replay_at = NULL;
+    const char *search = NULL;
+    const char *tail = NULL;
+    const char *take = NULL;
+    int direct = 0;
+    static struct triggers triggers;
+    static struct filter_chain filters;
+    const char *match = NULL;
+    int matched = 1;
 
-    while ((opt = getopt(argc, argv, "hlLsTvV")) != -1) {
+    while ((opt = getopt_long(argc, argv, "hlLsTvV", long_options, NULL)) != -1) {
         switch (opt) {
         case 'h':
             usage(argv[0]);
@@ -214,6 +565,161 @@ int main(int argc, char **argv) {
         case 'V':
             verbose = 1;
             break;
+        case OPT_SPLICE:
+            proxy_opts.splice = 1;
+            break;
+        case OPT_BACKEND:
+            if (!strcmp(optarg, "auto"))
+                proxy_opts.backend = PROXY_BACKEND_AUTO;
+            else if (!strcmp(optarg, "io_uring"))
+                proxy_opts.backend = PROXY_BACKEND_URING;
+            else if (!strcmp(optarg, "epoll") || !strcmp(optarg, "poll"))
+                proxy_opts.backend = PROXY_BACKEND_EVENT;
+            else
+                die("Unknown backend: %s", optarg);
+            break;
+        case OPT_OUTPUT_BUFFER:
+            proxy_opts.out_buffer = parse_size("output-buffer", optarg);
+            break;
+        case OPT_INPUT_BUFFER:
+            proxy_opts.in_buffer = parse_size("input-buffer", optarg);
+            break;
+        case OPT_FLUSH_DELAY: {
+            char *end;
+            long ms = strtol(optarg, &end, 10);
+            if (end == optarg || *end || ms < 0 || ms > 1000)
+                die("Invalid --flush-delay (want 0-1000 ms): %s", optarg);
+            proxy_opts.flush_delay = ms;
+            break;
+        }
+        case OPT_FPS: {
+            char *end;
+            long fps = strtol(optarg, &end, 10);
+            if (end == optarg || *end || fps < 1 || fps > 1000)
+                die("Invalid --fps (want 1-1000): %s", optarg);
+            proxy_opts.fps = fps;
+            break;
+        }
+        case OPT_SCREEN_SOCKET:
+            proxy_opts.screen_socket = optarg;
+            break;
+        case OPT_SHARE:
+            proxy_opts.share = optarg;
+            break;
+        case OPT_SESSION:
+            proxy_opts.share = optarg;
+            proxy_opts.detached = 1;
+            break;
+        case OPT_SCROLLBACK: {
+            char *end;
+            long lines = strtol(optarg, &end, 10);
+            if (end == optarg || *end || lines < 1 || lines > 1000000)
+                die("Invalid --scrollback (want 1-1000000 lines): %s", optarg);
+            proxy_opts.scrollback = lines;
+            break;
+        }
+        case OPT_HISTORY:
+            proxy_opts.history = parse_size("history", optarg);
+            break;
+        case OPT_HISTORY_FILE:
+            proxy_opts.history_file = optarg;
+            break;
+        case OPT_DUMP_HISTORY:
+            dump = optarg;
+            break;
+        case OPT_RECORD:
+            proxy_opts.record = optarg;
+            break;
+        case OPT_REPLAY:
+            replay = optarg;
+            break;
+        case OPT_AT:
+            replay_at = optarg;
+            break;
+        case OPT_SEARCH:
+            search = optarg;
+            break;
+        case OPT_RING:
+            proxy_opts.ring = optarg;
+            break;
+        case OPT_RING_SIZE:
+            proxy_opts.ring_size = parse_size("ring-size", optarg);
+            break;
+        case OPT_TAIL:
+            tail = optarg;
+            break;
+        case OPT_MATCH:
+            if (!matched)
+                die("--match=%s needs --exec, --notify or --send after it.", match);
+            match = optarg;
+            matched = 0;
+            break;
+        case OPT_EXEC:
+        case OPT_NOTIFY:
+        case OPT_SEND:
+            if (match == NULL)
+                die("--exec, --notify and --send need a --match before them.");
+            if (triggers_add(&triggers, match,
+                             opt == OPT_EXEC ? TRIGGER_EXEC :
+                             opt == OPT_NOTIFY ? TRIGGER_NOTIFY : TRIGGER_SEND, optarg) < 0)
+                die("Unable to add a trigger for %s: %m", match);
+            matched = 1;
+            break;
+        case OPT_FEED:
+            proxy_opts.feed = optarg;
+            break;
+        case OPT_FILTER:
+            if (filter_add(&filters, optarg) < 0)
+                die("Invalid --filter: %s", optarg);
+            proxy_opts.filters = capture_opts.filters = &filters;
+            break;
+        case OPT_CAPTURE:
+            capture_opts.path = optarg;
+            break;
+        case OPT_ROTATE_SIZE:
+            capture_opts.rotate_size = parse_size("rotate-size", optarg);
+            break;
+        case OPT_ROTATE_TIME: {
+            char *end;
+            long secs = strtol(optarg, &end, 10);
+            if (end == optarg || *end || secs < 1 || secs > INT32_MAX)
+                die("Invalid --rotate-time (want seconds): %s", optarg);
+            capture_opts.rotate_time = secs;
+            break;
+        }
+        case OPT_KEEP: {
+            char *end;
+            long n = strtol(optarg, &end, 10);
+            if (end == optarg || *end || n < 0 || n > 1000)
+                die("Invalid --keep (want 0-1000): %s", optarg);
+            capture_opts.keep = n;
+            break;
+        }
+        case OPT_MUX:
+            mux = optarg;
+            break;
+        case OPT_LIST:
+            list = 1;
+            break;
+        case OPT_ID: {
+            char *end;
+            long n = strtol(optarg, &end, 10);
+            if (end == optarg || *end || n < 1 || n > INT32_MAX)
+                die("Invalid --id: %s", optarg);
+            id = n;
+            break;
+        }
+        case OPT_TAKE:
+            take = optarg;
+            break;
+        case OPT_DIRECT:
+            direct = 1;
+            break;
+        case OPT_VIEW:
+        case OPT_CONTROL:
+            view = optarg;
+            view_writable = opt == OPT_CONTROL;
+            break;
         default:
             usage(argv[0]);
             return 1;
@@ -221,13 +727,55 @@ int main(int argc, char **argv) {
         if (opt == 'l' || opt == 'L') break; // the rest is a command line
     }
 
+    if (!matched)
+        die("--match=%s needs --exec, --notify or --send after it.", match);
+    if (triggers.count) {
+        if (triggers_compile(&triggers) < 0)
+            die("Unable to compile the triggers: %m");
+        proxy_opts.triggers = capture_opts.triggers = &triggers;
+    }
+
+    if (dump)
+        return share_dump(dump, id);
+    if (tail)
+        return shmring_tail(tail);
+    if (replay && search)
+        return replay_search(replay, search);
+    if (replay)
+        return replay_show(replay, replay_at);
+    if (mux && list)
+        return share_request(mux, SHARE_LIST, NULL, 0);
+    if (mux && do_attach && optind < argc)
+        return mux_attach(mux, argv[optind], force_stdio, do_steal);
+    if (mux && do_attach)
+        return run_mux(mux, &proxy_opts);
+    if (proxy_opts.history_file && !proxy_opts.history)
+        proxy_opts.history = PROXY_DEFAULT_HISTORY;
+    if (proxy_opts.fps && proxy_opts.filters)
+        die("--fps draws this terminal from the screen viewers see, which --filter changes.");
+    if (take) {
+        if (optind < argc || !do_attach || do_steal || capture_opts.path)
+            die("--take carries on with the session as it is: no PID, -l, -L, -T or --capture.");
+        return run_take(take, &proxy_opts);
+    }
+    if (view) {
+        setup_raw(&saved_termios);
+        err = share_view(view, id, view_writable);
+        tcsetattr(0, TCSANOW, &saved_termios);
+        return err;
+    }
+
     if (do_attach && optind >= argc) {
         fprintf(stderr, "%s: No pid specified to attach\n", argv[0]);
         usage(argv[0]);
         return 1;
     }
 
-    if (!do_steal) {
+    if (direct && (!do_attach || do_steal || capture_opts.path || proxy_opts.detached))
+        die("--direct attaches a PID to this terminal as it is: no -l, -L, -T, "
+            "--capture or --session.");
+
+    if (!do_steal && !direct) {
         if ((pty = get_pt()) < 0)
             die("Unable to allocate a new pseudo-terminal: %m");
         if (unlockpt(pty) < 0)
@@ -251,8 +799,11 @@ int main(int argc, char **argv) {
 
         if (do_steal) {
             err = steal_pty(child, &pty);
+        } else if (direct) {
+            err = attach_direct(child, force_stdio);
         } else {
             err = attach_child(child, ptsname(pty), force_stdio);
+            target = child;
         }
         if (err) {
             fprintf(stderr, "Unable to attach to pid %d: %s\n", child, strerror(err));
@@ -261,10 +812,21 @@ int main(int argc, char **argv) {
             }
             return 1;
         }
+        if (direct)
+            return wait_direct(child);
     } else {
         printf("Opened a new pty: %s\n", ptsname(pty));
         fflush(stdout);
-        if (argc > 2) {
+        if (optind < argc) {
+            /*
+             * A capture gives up once nothing has the slave open, so
+             * hold off until the child has it, i.e. has exec'd.
+             */
+            int started[2] = { -1, -1 };
+            char c;
+            if (capture_opts.path && unattached_script_redirection &&
+                pipe2(started, O_CLOEXEC) < 0)
+                die("Unable to create a pipe: %m");
             if (!fork()) {
                 setenv("REPTYR_PTY", ptsname(pty), 1);
                 if (unattached_script_redirection) {
@@ -280,24 +842,22 @@ int main(int argc, char **argv) {
                     close(f);
                 }
                 close(pty);
-                execvp(argv[2], argv + 2);
+                execvp(argv[optind], argv + optind);
                 exit(1);
             }
+            if (started[0] >= 0) {
+                close(started[1]);
+                while (read(started[0], &c, 1) < 0 && errno == EINTR)
+                    ;
+                close(started[0]);
+            }
         }
     }
 
-    setup_raw(&saved_termios);
-    memset(&act, 0, sizeof act);
-    act.sa_handler = do_winch;
-    act.sa_flags   = 0;
-    sigaction(SIGWINCH, &act, NULL);
-    resize_pty(pty);
-    do_proxy(pty);
-    do {
-        errno = 0;
-        if (tcsetattr(0, TCSANOW, &saved_termios) && errno != EINTR)
-            die("Unable to tcsetattr: %m");
-    } while (errno == EINTR);
+    if (capture_opts.path)
+        return run_capture(pty, target, &capture_opts);
 
-    return 0;
+    /* Leave the mode of a stolen pty's master alone. */
+    proxy_opts.packet = !do_steal;
+    return run_proxy(pty, target, &proxy_opts);
 }
@@ -0,0 +1,94 @@
+/*
+ * Copyright (C) 2011 by Nelson Elhage
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#include <stdlib.h>
+#include <string.h>
+
+#include "ringbuf.h"
+
+int ringbuf_init(struct ringbuf *rb, size_t size) {
+    memset(rb, 0, sizeof *rb);
+    rb->buf = malloc(size);
+    if (rb->buf == NULL)
+        return -1;
+    rb->size = size;
+    return 0;
+}
+
+void ringbuf_free(struct ringbuf *rb) {
+    free(rb->buf);
+    memset(rb, 0, sizeof *rb);
+}
+
+int ringbuf_free_iov(struct ringbuf *rb, struct iovec iov[2]) {
+    size_t tail = (rb->start + rb->len) % rb->size;
+    size_t space = ringbuf_space(rb);
+
+    if (space == 0)
+        return 0;
+    iov[0].iov_base = rb->buf + tail;
+    if (tail + space <= rb->size) {
+        iov[0].iov_len = space;
+        return 1;
+    }
+    iov[0].iov_len = rb->size - tail;
+    iov[1].iov_base = rb->buf;
+    iov[1].iov_len = space - iov[0].iov_len;
+    return 2;
+}
+
+int ringbuf_used_iov(struct ringbuf *rb, struct iovec iov[2]) {
+    if (rb->len == 0)
+        return 0;
+    iov[0].iov_base = rb->buf + rb->start;
+    if (rb->start + rb->len <= rb->size) {
+        iov[0].iov_len = rb->len;
+        return 1;
+    }
+    iov[0].iov_len = rb->size - rb->start;
+    iov[1].iov_base = rb->buf;
+    iov[1].iov_len = rb->len - iov[0].iov_len;
+    return 2;
+}
+
+void ringbuf_commit(struct ringbuf *rb, size_t n) {
+    rb->len += n;
+}
+
+void ringbuf_consume(struct ringbuf *rb, size_t n) {
+    rb->len -= n;
+    rb->start = rb->len ? (rb->start + n) % rb->size : 0;
+}
+
+size_t ringbuf_put(struct ringbuf *rb, const void *buf, size_t n) {
+    struct iovec iov[2];
+    size_t done = 0, chunk;
+    int i, niov;
+
+    niov = ringbuf_free_iov(rb, iov);
+    for (i = 0; i < niov && done < n; i++) {
+        chunk = n - done < iov[i].iov_len ? n - done : iov[i].iov_len;
+        memcpy(iov[i].iov_base, (const char *)buf + done, chunk);
+        done += chunk;
+    }
+    ringbuf_commit(rb, done);
+    return done;
+}
@@ -0,0 +1,62 @@
+/*
+ * Copyright (C) 2011 by Nelson Elhage
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#ifndef RINGBUF_H
+#define RINGBUF_H
+
+#include <sys/types.h>
+#include <sys/uio.h>
+
+/* A fixed-capacity byte FIFO. */
+struct ringbuf {
+    char *buf;
+    size_t size;
+    size_t start;
+    size_t len;
+};
+
+int ringbuf_init(struct ringbuf *rb, size_t size);
+void ringbuf_free(struct ringbuf *rb);
+
+static inline size_t ringbuf_used(const struct ringbuf *rb) {
+    return rb->len;
+}
+
+static inline size_t ringbuf_space(const struct ringbuf *rb) {
+    return rb->size - rb->len;
+}
+
+/*
+ * Describe the free (resp. used) part of the ring as at most two
+ * iovecs, for readv() into (resp. writev() out of) the ring. Returns the
+ * number of iovecs filled in.
+ */
+int ringbuf_free_iov(struct ringbuf *rb, struct iovec iov[2]);
+int ringbuf_used_iov(struct ringbuf *rb, struct iovec iov[2]);
+
+/* Mark n bytes as written into (resp. taken out of) the ring. */
+void ringbuf_commit(struct ringbuf *rb, size_t n);
+void ringbuf_consume(struct ringbuf *rb, size_t n);
+
+/* Copy in as much of buf as fits. Returns the number of bytes taken. */
+size_t ringbuf_put(struct ringbuf *rb, const void *buf, size_t n);
+
+#endif
@@ -0,0 +1,447 @@
+/*
+ * Copyright (C) 2011 by Nelson Elhage
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+
+#include "reptyr.h"
+#include "share.h"
+
+size_t share_header(unsigned char *buf, enum share_msg type, size_t len) {
+    buf[0] = type;
+    buf[1] = len >> 8;
+    buf[2] = len & 0xff;
+    return SHARE_HEADER;
+}
+
+static void viewer_close(struct share_viewer *v) {
+    struct share_server *s = v->server;
+    int i;
+
+    if (s->writer == v) {
+        debug("Viewer with the write lock left.");
+        s->writer = NULL;
+    }
+    for (i = 0; i < SHARE_MAX_VIEWERS; i++)
+        if (s->viewers[i] == v)
+            s->viewers[i] = NULL;
+    ev_del(s->loop, &v->watch);
+    close(v->watch.fd);
+    ringbuf_free(&v->queue);
+    free(v);
+}
+
+/* Let the writer's terminal decide the size of the screen. */
+static void viewer_resize(struct share_viewer *v) {
+    struct share_server *s = v->server;
+
+    if (s->writer == v && s->resize && v->rows > 0 && v->cols > 0)
+        s->resize(s->data, v->rows, v->cols);
+}
+
+/* Queue a whole message for `v', or nothing if it doesn't fit. */
+static int viewer_queue(struct share_viewer *v, enum share_msg type,
+                        const void *buf, size_t len) {
+    unsigned char hdr[SHARE_HEADER];
+
+    if (ringbuf_space(&v->queue) < SHARE_HEADER + len)
+        return -1;
+    ringbuf_put(&v->queue, hdr, share_header(hdr, type, len));
+    ringbuf_put(&v->queue, buf, len);
+    return 0;
+}
+
+static int viewer_queue_output(struct share_viewer *v, const char *buf, size_t len) {
+    size_t n;
+
+    while (len > 0) {
+        n = len < SHARE_MAX_PAYLOAD ? len : SHARE_MAX_PAYLOAD;
+        if (viewer_queue(v, SHARE_OUTPUT, buf, n) < 0)
+            return -1;
+        buf += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/* Queue the whole screen, and `history' lines of scrollback before it. */
+static int viewer_redraw(struct share_viewer *v, int history) {
+    struct term_out redraw = {};
+    int err;
+
+    err = term_redraw(v->server->screen, &redraw, history);
+    /* All or nothing, so a fallback doesn't follow half a redraw. */
+    if (err == 0 && ringbuf_space(&v->queue) < redraw.len +
+        SHARE_HEADER * (redraw.len / SHARE_MAX_PAYLOAD + 1))
+        err = -1;
+    if (err == 0)
+        err = viewer_queue_output(v, redraw.buf, redraw.len);
+    term_out_free(&redraw);
+    return err;
+}
+
+/*
+ * Send what we can without blocking. Once the queue is empty, a
+ * viewer that fell behind gets the screen redrawn. Returns -1 if the
+ * viewer should be dropped.
+ */
+static int viewer_flush(struct share_viewer *v) {
+    struct iovec iov[2];
+    struct msghdr msg = { .msg_iov = iov };
+    unsigned char status;
+    ssize_t n;
+    int niov;
+
+    for (;;) {
+        if (v->status) {
+            status = v->status;
+            if (viewer_queue(v, SHARE_STATUS, &status, 1) == 0)
+                v->status = 0;
+        }
+        while ((niov = ringbuf_used_iov(&v->queue, iov)) > 0) {
+            /* A viewer that hung up mustn't take us down with SIGPIPE. */
+            msg.msg_iovlen = niov;
+            n = sendmsg(v->watch.fd, &msg, MSG_NOSIGNAL);
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n < 0)
+                return errno == EAGAIN ? 0 : -1;
+            ringbuf_consume(&v->queue, n);
+        }
+        if (!v->resync)
+            return 0;
+        /* A new viewer gets the scrollback too, if there's room for it. */
+        if ((!v->fresh || viewer_redraw(v, v->server->screen->rows) < 0) &&
+            viewer_redraw(v, 0) < 0)
+            return -1;
+        v->resync = v->fresh = 0;
+    }
+}
+
+static void viewer_update(struct share_viewer *v) {
+    int events = EV_READ;
+
+    if (ringbuf_used(&v->queue) || v->resync || v->status)
+        events |= EV_WRITE;
+    if (ev_set(v->server->loop, &v->watch, events) < 0)
+        viewer_close(v);
+}
+
+static void viewer_status(struct share_viewer *v, enum share_status status) {
+    v->status = status;
+}
+
+static void viewer_message(struct share_viewer *v, int type, const unsigned char *buf,
+                           size_t len) {
+    struct share_server *s = v->server;
+
+    if (!v->hello && type == SHARE_DUMP) {
+        if (s->dump)
+            s->dump(s->data, v->watch.fd);
+        v->done = 1;
+        return;
+    }
+    if (!v->hello && type == SHARE_HANDOFF) {
+        /* Hanging up without an answer says no. */
+        if (s->handoff)
+            s->handoff(s->data, v->watch.fd);
+        v->done = 1;
+        return;
+    }
+    if (!v->hello && type != SHARE_HELLO)
+        return;
+    switch (type) {
+    case SHARE_HELLO:
+        v->hello = 1;
+        v->writable = len > 0 && buf[0];
+        v->resync = v->fresh = 1;
+        s->joined++;
+        debug("A %s viewer joined.", v->writable ? "read-write" : "read-only");
+        break;
+    case SHARE_INPUT:
+        if (s->writer == v && s->input)
+            s->input(s->data, (const char *)buf, len);
+        break;
+    case SHARE_LOCK:
+        if (!v->writable) {
+            viewer_status(v, SHARE_READ_ONLY);
+        } else if (s->writer == NULL || s->writer == v) {
+            s->writer = v;
+            viewer_status(v, SHARE_LOCKED);
+            viewer_resize(v);
+        } else {
+            viewer_status(v, SHARE_LOCK_BUSY);
+        }
+        break;
+    case SHARE_UNLOCK:
+        if (s->writer == v)
+            s->writer = NULL;
+        viewer_status(v, SHARE_UNLOCKED);
+        break;
+    case SHARE_REDRAW:
+        v->resync = 1;
+        break;
+    case SHARE_RESIZE:
+        if (len < 4)
+            break;
+        v->rows = buf[0] << 8 | buf[1];
+        v->cols = buf[2] << 8 | buf[3];
+        viewer_resize(v);
+        break;
+    }
+}
+
+/* Returns -1 if the viewer hung up or broke the protocol. */
+static int viewer_read(struct share_viewer *v) {
+    size_t len;
+    ssize_t n;
+
+    n = read(v->watch.fd, v->in + v->in_len, sizeof v->in - v->in_len);
+    if (n == 0 || (n < 0 && errno != EAGAIN && errno != EINTR))
+        return -1;
+    if (n < 0)
+        return 0;
+    v->in_len += n;
+    while (v->in_len >= SHARE_HEADER && !v->done) {
+        len = v->in[1] << 8 | v->in[2];
+        if (v->in_len < SHARE_HEADER + len)
+            break;
+        viewer_message(v, v->in[0], v->in + SHARE_HEADER, len);
+        v->in_len -= SHARE_HEADER + len;
+        memmove(v->in, v->in + SHARE_HEADER + len, v->in_len);
+    }
+    return v->done ? -1 : 0;
+}
+
+static void viewer_ready(struct event_loop *loop, struct watch *w, int revents) {
+    struct share_viewer *v = w->data;
+
+    if (revents & (EV_READ | EV_ERROR) && viewer_read(v) < 0) {
+        viewer_close(v);
+        return;
+    }
+    if (viewer_flush(v) < 0) {
+        viewer_close(v);
+        return;
+    }
+    viewer_update(v);
+}
+
+int share_adopt(struct share_server *s, int fd) {
+    struct share_viewer *v = NULL;
+    int i, slot = -1;
+
+    for (i = 0; i < SHARE_MAX_VIEWERS && slot < 0; i++)
+        if (s->viewers[i] == NULL)
+            slot = i;
+    if (slot < 0 || (v = calloc(1, sizeof *v)) == NULL ||
+        ringbuf_init(&v->queue, SHARE_QUEUE_SIZE) < 0) {
+        free(v);
+        close(fd);
+        return -1;
+    }
+    ev_watch_init(&v->watch, fd, viewer_ready, v);
+    v->server = s;
+    s->viewers[slot] = v;
+    viewer_update(v);
+    return 0;
+}
+
+static void share_accept(struct event_loop *loop, struct watch *w, int revents) {
+    struct share_server *s = w->data;
+    int fd;
+
+    while ((fd = accept4(s->fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0)
+        share_adopt(s, fd);
+}
+
+void share_output(struct share_server *s, const void *buf, size_t len) {
+    struct share_viewer *v;
+    int i;
+
+    for (i = 0; i < SHARE_MAX_VIEWERS; i++) {
+        v = s->viewers[i];
+        if (v == NULL || !v->hello || v->resync)
+            continue;
+        if (viewer_queue_output(v, buf, len) < 0) {
+            /* Too slow: stop queueing, and catch up later with a redraw. */
+            v->resync = 1;
+            s->resyncs++;
+        }
+        viewer_update(v);
+    }
+}
+
+void share_resync(struct share_server *s) {
+    struct share_viewer *v;
+    int i;
+
+    for (i = 0; i < SHARE_MAX_VIEWERS; i++) {
+        v = s->viewers[i];
+        if (v == NULL || !v->hello)
+            continue;
+        v->resync = 1;
+        viewer_update(v);
+    }
+}
+
+void share_init(struct share_server *s, struct event_loop *loop, struct term *screen) {
+    memset(s, 0, sizeof *s);
+    s->fd = -1;
+    s->loop = loop;
+    s->screen = screen;
+}
+
+int share_listen(struct share_server *s, struct event_loop *loop, struct term *screen,
+                 const char *path) {
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    mode_t mask;
+    int err;
+
+    share_init(s, loop, screen);
+    if (strlen(path) >= sizeof addr.sun_path) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    strcpy(addr.sun_path, path);
+    if ((s->fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) < 0)
+        goto fail;
+    /* Viewers see, and may type into, the whole session. */
+    mask = umask(0077);
+    err = bind(s->fd, (struct sockaddr *)&addr, sizeof addr);
+    umask(mask);
+    if (err < 0)
+        goto fail;
+    s->path = strdup(path);
+    if (listen(s->fd, SHARE_MAX_VIEWERS) < 0)
+        goto fail;
+    ev_watch_init(&s->watch, s->fd, share_accept, s);
+    if (ev_add(loop, &s->watch, EV_READ) < 0)
+        goto fail;
+    return 0;
+
+fail:
+    err = errno;
+    share_close(s);
+    errno = err;
+    return -1;
+}
+
+/* Like writeall(), but a client that hung up mustn't take us down with SIGPIPE. */
+static int share_sendall(int fd, const void *buf, size_t len) {
+    ssize_t n;
+
+    while (len > 0) {
+        n = send(fd, buf, len, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0)
+            return -1;
+        buf = (const char *)buf + n;
+        len -= n;
+    }
+    return 0;
+}
+
+/* Send a payload of any length, in as many messages as it takes. */
+static int share_send(int fd, enum share_msg type, const char *buf, size_t len) {
+    unsigned char hdr[SHARE_HEADER];
+    size_t n;
+
+    while (len > 0) {
+        n = len < SHARE_MAX_PAYLOAD ? len : SHARE_MAX_PAYLOAD;
+        if (share_sendall(fd, hdr, share_header(hdr, type, n)) < 0 ||
+            share_sendall(fd, buf, n) < 0)
+            return -1;
+        buf += n;
+        len -= n;
+    }
+    return 0;
+}
+
+int share_give(int fd, const struct share_handoff *h) {
+    unsigned char msg[SHARE_HEADER + 5];
+    char cbuf[CMSG_SPACE(sizeof(int))] = {};
+    struct iovec iov = { .iov_base = msg, .iov_len = sizeof msg };
+    struct msghdr hdr = {
+        .msg_iov = &iov,
+        .msg_iovlen = 1,
+        .msg_control = cbuf,
+        .msg_controllen = sizeof cbuf,
+    };
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&hdr);
+    ssize_t n;
+
+    share_header(msg, SHARE_HANDOFF, 5);
+    msg[SHARE_HEADER] = h->target >> 24;
+    msg[SHARE_HEADER + 1] = h->target >> 16;
+    msg[SHARE_HEADER + 2] = h->target >> 8;
+    msg[SHARE_HEADER + 3] = h->target;
+    msg[SHARE_HEADER + 4] = h->flags;
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &h->pty, sizeof(int));
+    do {
+        n = sendmsg(fd, &hdr, MSG_NOSIGNAL);
+    } while (n < 0 && errno == EINTR);
+    /* A short send still passed the pty, so the rest has to follow. */
+    if (n < 0 || (n < (ssize_t)sizeof msg &&
+                  share_sendall(fd, msg + n, sizeof msg - n) < 0))
+        return -1;
+    if (share_send(fd, SHARE_OUTPUT, h->output, h->output_len) < 0 ||
+        share_send(fd, SHARE_INPUT, h->input, h->input_len) < 0)
+        return -1;
+    return 0;
+}
+
+void share_close(struct share_server *s) {
+    int i;
+
+    if (s->loop == NULL)
+        return;
+    for (i = 0; i < SHARE_MAX_VIEWERS; i++) {
+        if (s->viewers[i]) {
+            /* Let them see how it ended, if they're keeping up. */
+            viewer_flush(s->viewers[i]);
+            viewer_close(s->viewers[i]);
+        }
+    }
+    if (s->fd >= 0) {
+        ev_del(s->loop, &s->watch);
+        close(s->fd);
+    }
+    s->fd = -1;
+    s->loop = NULL;
+    if (s->path) {
+        unlink(s->path);
+        free(s->path);
+        s->path = NULL;
+    }
+}
@@ -0,0 +1,233 @@
+/*
+ * Copyright (C) 2011 by Nelson Elhage
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#ifndef SHARE_H
+#define SHARE_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "event.h"
+#include "ringbuf.h"
+#include "term.h"
+
+/*
+ * Sharing a session with other local viewers over a Unix socket.
+ *
+ * Everything on the socket travels in messages: a type byte, then the
+ * length of the payload as a big-endian 16-bit number, then the payload.
+ * A viewer starts with SHARE_HELLO, gets the last screenful of
+ * scrollback and the whole screen redrawn, and from then on sees the
+ * program's output as it happens.
+ *
+ * Only one party at a time may type: whoever holds the write lock. While
+ * no viewer holds it, that's the terminal reptyr runs in.
+ */
+
+enum share_msg {
+    /* server -> viewer: output for the terminal */
+    SHARE_OUTPUT = 1,
+    /* server -> viewer: one of enum share_status */
+    SHARE_STATUS,
+    /* viewer -> server: 1 for read-write, 0 for read-only */
+    SHARE_HELLO,
+    /* viewer -> server: keystrokes; dropped unless we hold the lock */
+    SHARE_INPUT,
+    /* viewer -> server: ask for or give back the write lock */
+    SHARE_LOCK,
+    SHARE_UNLOCK,
+    /* viewer -> server: send the whole screen again */
+    SHARE_REDRAW,
+    /* viewer -> server: our terminal's rows and columns, 16 bits each */
+    SHARE_RESIZE,
+    /*
+     * client -> server, instead of SHARE_HELLO: send all the output
+     * there's a history of, as is rather than in messages, then hang up
+     */
+    SHARE_DUMP,
+    /*
+     * client -> mux (see mux.h), first thing: a session id, 32 bits.
+     * From then on, the client talks to that session as above.
+     */
+    SHARE_SELECT,
+    /* client -> mux: list the sessions, as text, then hang up */
+    SHARE_LIST,
+    /*
+     * client -> mux: attach to a process and manage it as a new session.
+     * The payload is its pid, 32 bits, then SHARE_ATTACH_* flags, 8 bits.
+     * The reply is the new session's id as text, or a line starting with
+     * "error: ".
+     */
+    SHARE_ATTACH,
+    /*
+     * client -> server, instead of SHARE_HELLO: take the session over.
+     * The server stops reading the pty and answers with a SHARE_HANDOFF
+     * of its own, carrying the pty master (SCM_RIGHTS), with the
+     * target's pid, 32 bits, then SHARE_HANDOFF_* flags, 8 bits, as the
+     * payload. Then come the screen, as SHARE_OUTPUT, and keystrokes it
+     * hadn't written to the pty yet, as SHARE_INPUT; then it hangs up
+     * and exits.
+     */
+    SHARE_HANDOFF,
+};
+
+#define SHARE_ATTACH_STDIO 0x1
+#define SHARE_ATTACH_STEAL 0x2
+
+/* The pty master is in packet mode (TIOCPKT). */
+#define SHARE_HANDOFF_PACKET 0x1
+
+enum share_status {
+    SHARE_LOCKED = 1,
+    SHARE_LOCK_BUSY,
+    SHARE_UNLOCKED,
+    SHARE_READ_ONLY,
+};
+
+/* A session on its way from one reptyr to another */
+struct share_handoff {
+    int pty;
+    pid_t target;
+    int flags;
+    /* What it takes to draw the screen, as term_keyframe() has it */
+    char *output;
+    size_t output_len;
+    /* Keystrokes still to be written to the pty */
+    char *input;
+    size_t input_len;
+};
+
+#define SHARE_HEADER 3
+#define SHARE_MAX_PAYLOAD 65535
+#define SHARE_MAX_VIEWERS 16
+/* How much output may queue up for one viewer before it has to resync. */
+#define SHARE_QUEUE_SIZE (256 * 1024)
+
+struct share_server;
+
+struct share_viewer {
+    struct share_server *server;
+    struct watch watch;
+    int writable;
+    int hello;
+    /* Output waiting for the viewer to read it */
+    struct ringbuf queue;
+    /*
+     * The viewer fell behind and lost output; once the queue drains,
+     * redraw the screen instead of sending what it missed.
+     */
+    int resync;
+    /* ... and since it has seen nothing yet, include the scrollback. */
+    int fresh;
+    int rows;
+    int cols;
+    /* A share_status to tell the viewer about, once there's room */
+    int status;
+    unsigned char in[SHARE_HEADER + SHARE_MAX_PAYLOAD];
+    size_t in_len;
+    /* Hang up once the messages already read are handled. */
+    int done;
+};
+
+struct share_server {
+    int fd;
+    char *path;
+    struct event_loop *loop;
+    struct term *screen;
+    struct watch watch;
+    /* Allocated as viewers connect, since each needs a fair bit of memory */
+    struct share_viewer *viewers[SHARE_MAX_VIEWERS];
+    /* The viewer holding the write lock, if any */
+    struct share_viewer *writer;
+    /* Called with keystrokes from the writer */
+    void (*input)(void *data, const char *buf, size_t len);
+    /* If set, called with the size of the writer's terminal */
+    void (*resize)(void *data, int rows, int cols);
+    /* If set, called to write the history to a client's socket */
+    void (*dump)(void *data, int fd);
+    /* If set, called to hand the session over to a client (see share_give()) */
+    void (*handoff)(void *data, int fd);
+    void *data;
+
+    unsigned long long joined;
+    unsigned long long resyncs;
+};
+
+/* Get ready to serve viewers of `screen' from `loop', as share_adopt() hands them over. */
+void share_init(struct share_server *s, struct event_loop *loop, struct term *screen);
+/*
+ * ... and also create a socket at `path' (which must not exist),
+ * accessible only to us, and take whoever connects to it.
+ */
+int share_listen(struct share_server *s, struct event_loop *loop, struct term *screen,
+                 const char *path);
+/*
+ * Serve a viewer that connected somewhere else, and hasn't sent anything
+ * we haven't read yet. Takes over (or, if we're full, closes) `fd'.
+ */
+int share_adopt(struct share_server *s, int fd);
+/* Hang up on every viewer and remove the socket. Safe if never started. */
+void share_close(struct share_server *s);
+
+/*
+ * Pass output from the program on to every viewer. Call this only once
+ * `screen' has seen it too. Never blocks; viewers that can't keep up
+ * are resynced later.
+ */
+void share_output(struct share_server *s, const void *buf, size_t len);
+
+/* Redraw the screen for every viewer, e.g. because its size changed. */
+void share_resync(struct share_server *s);
+
+/* Build a message in `buf' (which needs SHARE_HEADER spare bytes). */
+size_t share_header(unsigned char *buf, enum share_msg type, size_t len);
+
+/*
+ * Hand the session in `h' over to the client at the other end of `fd',
+ * which asked for it with SHARE_HANDOFF. Blocks until it's all sent.
+ */
+int share_give(int fd, const struct share_handoff *h);
+
+/*
+ * Connect to a shared session at `path' and show it on our terminal
+ * until it ends or we detach. If `id' isn't negative, `path' is a mux
+ * and `id' is the session on it. Returns the exit status for main().
+ */
+int share_view(const char *path, int id, int writable);
+
+/* Write the history of a shared session at `path' to stdout. */
+int share_dump(const char *path, int id);
+
+/*
+ * Send a single message to `path' and copy the reply to stdout. Returns
+ * the exit status for main(): 1 if the reply says there was an error.
+ */
+int share_request(const char *path, enum share_msg type, const void *buf, size_t len);
+
+/*
+ * Ask the reptyr sharing a session at `path' to hand it over, and fill
+ * in `h' with what it sends. Returns -1, having said why, if it doesn't.
+ */
+int share_take(const char *path, struct share_handoff *h);
+/* Free what share_take() read, but leave the pty open. */
+void share_handoff_free(struct share_handoff *h);
+
+#endif
@@ -0,0 +1,285 @@
+/*
+ * Copyright (C) 2011 by Nelson Elhage
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include "reptyr.h"
+#include "shmring.h"
+#include "proxy.h"
+
+/* How long an idle reader sleeps between looks, at most. */
+#define SHMRING_POLL_MAX_MS 64
+
+static void shmring_accept(struct event_loop *loop, struct watch *w, int revents) {
+    struct shmring *r = w->data;
+    char cbuf[CMSG_SPACE(sizeof(int))];
+    char byte = 0;
+    struct iovec iov = { .iov_base = &byte, .iov_len = 1 };
+    struct msghdr msg = {
+        .msg_iov = &iov, .msg_iovlen = 1,
+        .msg_control = cbuf, .msg_controllen = sizeof cbuf,
+    };
+    struct cmsghdr *cmsg;
+    int fd;
+
+    while ((fd = accept4(r->fd, NULL, NULL, SOCK_CLOEXEC)) >= 0) {
+        memset(cbuf, 0, sizeof cbuf);
+        cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+        memcpy(CMSG_DATA(cmsg), &r->ro_fd, sizeof(int));
+        /* A single byte always fits in a fresh socket's buffer. */
+        if (sendmsg(fd, &msg, MSG_DONTWAIT | MSG_NOSIGNAL) < 0)
+            debug("Unable to hand out the output ring: %s", strerror(errno));
+        else
+            r->served++;
+        close(fd);
+    }
+}
+
+int shmring_listen(struct shmring *r, struct event_loop *loop, const char *path,
+                   size_t size) {
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    char self[64];
+    size_t ring = 4096;
+    mode_t mask;
+    int err;
+
+    memset(r, 0, sizeof *r);
+    r->memfd = r->ro_fd = r->fd = -1;
+    r->loop = loop;
+    while (ring < size)
+        ring <<= 1;
+    if (strlen(path) >= sizeof addr.sun_path) {
+        errno = ENAMETOOLONG;
+        goto fail;
+    }
+    strcpy(addr.sun_path, path);
+
+    r->map_size = SHMRING_HEADER_SIZE + ring;
+    r->memfd = memfd_create("reptyr-output", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if (r->memfd < 0 || ftruncate(r->memfd, r->map_size) < 0)
+        goto fail;
+    /* Readers can rely on the size, and on the pages being there. */
+    fcntl(r->memfd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL);
+    r->hdr = mmap(NULL, r->map_size, PROT_READ | PROT_WRITE, MAP_SHARED, r->memfd, 0);
+    if (r->hdr == MAP_FAILED) {
+        r->hdr = NULL;
+        goto fail;
+    }
+    r->data = (unsigned char *)r->hdr + SHMRING_HEADER_SIZE;
+    memcpy(r->hdr->magic, SHMRING_MAGIC, sizeof r->hdr->magic);
+    r->hdr->version = SHMRING_VERSION;
+    r->hdr->header_size = SHMRING_HEADER_SIZE;
+    r->hdr->size = ring;
+    r->hdr->pid = getpid();
+
+    /* A description of its own, opened read-only, so readers can't map it writable. */
+    snprintf(self, sizeof self, "/proc/self/fd/%d", r->memfd);
+    if ((r->ro_fd = open(self, O_RDONLY | O_CLOEXEC)) < 0)
+        goto fail;
+
+    if ((r->fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) < 0)
+        goto fail;
+    mask = umask(0077);
+    err = bind(r->fd, (struct sockaddr *)&addr, sizeof addr);
+    umask(mask);
+    if (err < 0)
+        goto fail;
+    /* From here on it's ours to remove. */
+    r->path = strdup(path);
+    if (listen(r->fd, SHMRING_MAX_BACKLOG) < 0)
+        goto fail;
+    ev_watch_init(&r->watch, r->fd, shmring_accept, r);
+    if (ev_add(loop, &r->watch, EV_READ) < 0)
+        goto fail;
+    return 0;
+
+fail:
+    err = errno;
+    shmring_close(r);
+    errno = err;
+    return -1;
+}
+
+void shmring_close(struct shmring *r) {
+    if (r->loop == NULL)
+        return;
+    if (r->fd >= 0) {
+        ev_del(r->loop, &r->watch);
+        close(r->fd);
+    }
+    if (r->path) {
+        unlink(r->path);
+        free(r->path);
+    }
+    if (r->hdr) {
+        __atomic_store_n(&r->hdr->closed, 1, __ATOMIC_RELEASE);
+        munmap(r->hdr, r->map_size);
+    }
+    if (r->ro_fd >= 0)
+        close(r->ro_fd);
+    if (r->memfd >= 0)
+        close(r->memfd);
+    r->hdr = NULL;
+    r->path = NULL;
+    r->loop = NULL;
+    r->fd = r->ro_fd = r->memfd = -1;
+}
+
+void shmring_write(struct shmring *r, const void *buf, size_t len) {
+    struct shmring_header *h = r->hdr;
+    uint64_t head = h->head, size = h->size;
+    size_t off, first;
+
+    /* Only the last lap would survive anyway. */
+    if (len > size) {
+        buf = (const char *)buf + (len - size);
+        head += len - size;
+        len = size;
+    }
+    __atomic_store_n(&h->claim, head + len, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    off = head & (size - 1);
+    first = size - off < len ? size - off : len;
+    memcpy(r->data + off, buf, first);
+    memcpy(r->data, (const char *)buf + first, len - first);
+    __atomic_store_n(&h->head, head + len, __ATOMIC_RELEASE);
+}
+
+/* Get a read-only fd for the ring served at `path'. */
+static int shmring_connect(const char *path) {
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    char cbuf[CMSG_SPACE(sizeof(int))];
+    char byte;
+    struct iovec iov = { .iov_base = &byte, .iov_len = 1 };
+    struct msghdr msg = {
+        .msg_iov = &iov, .msg_iovlen = 1,
+        .msg_control = cbuf, .msg_controllen = sizeof cbuf,
+    };
+    struct cmsghdr *cmsg;
+    int sock, fd = -1;
+
+    if (strlen(path) >= sizeof addr.sun_path) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    strcpy(addr.sun_path, path);
+    if ((sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0)
+        return -1;
+    if (connect(sock, (struct sockaddr *)&addr, sizeof addr) < 0 ||
+        recvmsg(sock, &msg, MSG_CMSG_CLOEXEC) < 0)
+        goto out;
+    cmsg = CMSG_FIRSTHDR(&msg);
+    if (cmsg && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS)
+        memcpy(&fd, CMSG_DATA(cmsg), sizeof(int));
+    else
+        errno = EPROTO;
+out:
+    close(sock);
+    return fd;
+}
+
+int shmring_tail(const char *path) {
+    const struct shmring_header *h;
+    const unsigned char *data;
+    unsigned char *buf;
+    struct stat st;
+    uint64_t size, pos, head, claim, start, n, off, first;
+    unsigned long long lost = 0;
+    int fd, idle_ms = 0;
+
+    if ((fd = shmring_connect(path)) < 0) {
+        fprintf(stderr, "Unable to get the output ring at %s: %s\n", path, strerror(errno));
+        return 1;
+    }
+    if (fstat(fd, &st) < 0 || st.st_size < SHMRING_HEADER_SIZE ||
+        (h = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0)) == MAP_FAILED) {
+        fprintf(stderr, "Unable to map the output ring at %s.\n", path);
+        close(fd);
+        return 1;
+    }
+    close(fd);
+    size = h->size;
+    if (memcmp(h->magic, SHMRING_MAGIC, sizeof h->magic) || h->version != SHMRING_VERSION ||
+        size == 0 || (size & (size - 1)) || h->header_size + size > (uint64_t)st.st_size) {
+        fprintf(stderr, "%s doesn't serve an output ring we understand.\n", path);
+        return 1;
+    }
+    data = (const unsigned char *)h + h->header_size;
+    if ((buf = malloc(size)) == NULL)
+        die("Out of memory.");
+
+    head = __atomic_load_n(&h->head, __ATOMIC_ACQUIRE);
+    pos = head > size ? head - size : 0;
+    for (;;) {
+        head = __atomic_load_n(&h->head, __ATOMIC_ACQUIRE);
+        if (head == pos) {
+            if (__atomic_load_n(&h->closed, __ATOMIC_ACQUIRE) &&
+                __atomic_load_n(&h->head, __ATOMIC_ACQUIRE) == pos)
+                break;
+            /* Poll, backing off while nothing turns up. */
+            if (idle_ms == SHMRING_POLL_MAX_MS && kill(h->pid, 0) < 0 && errno == ESRCH)
+                break;
+            idle_ms = idle_ms ? idle_ms * 2 : 1;
+            if (idle_ms > SHMRING_POLL_MAX_MS)
+                idle_ms = SHMRING_POLL_MAX_MS;
+            nanosleep(&(struct timespec){ 0, idle_ms * 1000000L }, NULL);
+            continue;
+        }
+        idle_ms = 0;
+        start = head - pos > size ? head - size : pos;
+        n = head - start;
+        off = start & (size - 1);
+        first = size - off < n ? size - off : n;
+        memcpy(buf, data + off, first);
+        memcpy(buf + first, data, n - first);
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        claim = __atomic_load_n(&h->claim, __ATOMIC_RELAXED);
+        /* Drop whatever the writer may have lapped while we copied. */
+        off = claim > size && claim - size > start ? claim - size - start : 0;
+        if (off > n)
+            off = n;
+        lost += start + off - pos;
+        if (start + off > pos)
+            debug("Lost %llu bytes of output.", (unsigned long long)(start + off - pos));
+        pos = start + n;
+        if (writeall(1, buf + off, n - off) < 0)
+            break;
+    }
+    if (lost)
+        fprintf(stderr, "Fell behind, and lost %llu bytes of output.\n", lost);
+    free(buf);
+    munmap((void *)h, st.st_size);
+    return 0;
+}
@@ -0,0 +1,109 @@
+/*
+ * Copyright (C) 2011 by Nelson Elhage
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#ifndef SHMRING_H
+#define SHMRING_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "event.h"
+
+/*
+ * The program's output, published in shared memory for local readers
+ * that want all of it without costing us a write per reader.
+ *
+ * Whoever connects to the ring's Unix socket gets a read-only fd for a
+ * memfd (in an SCM_RIGHTS message, with a single byte of payload) and is
+ * then disconnected. The memfd holds a struct shmring_header, then at
+ * header_size the ring itself: size bytes, a power of two.
+ *
+ * Positions are counts of bytes since the start, and never wrap; byte
+ * `pos' lives at data[pos & (size - 1)]. The single writer
+ *
+ *   1. stores claim = head + len, then a release fence,
+ *   2. copies the bytes into the ring,
+ *   3. stores head = head + len, with release.
+ *
+ * A reader at `pos' loads head with acquire and skips ahead to
+ * head - size if it's further behind than that. It copies out up to
+ * head, then after an acquire fence loads claim: whatever it copied from
+ * before claim - size may have been overwritten while it copied, and
+ * must be thrown away (and counted as lost). No locks, and no system
+ * calls for either side; a reader with nothing to read polls.
+ */
+
+#define SHMRING_MAGIC "reptyrsr"
+#define SHMRING_VERSION 1
+#define SHMRING_DEFAULT_SIZE (1024 * 1024)
+
+struct shmring_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t header_size;
+    uint64_t size;
+    /* The writer's pid, so readers can tell if it went away */
+    int32_t pid;
+    /* Set once the writer is done; nothing will follow head. */
+    uint32_t closed;
+    uint64_t head;
+    uint64_t claim;
+};
+
+#define SHMRING_HEADER_SIZE 4096
+
+#define SHMRING_MAX_BACKLOG 8
+
+struct shmring {
+    struct shmring_header *hdr;
+    unsigned char *data;
+    size_t map_size;
+    int memfd;
+    /* The memfd again, opened read-only, to hand out */
+    int ro_fd;
+    int fd;
+    char *path;
+    struct event_loop *loop;
+    struct watch watch;
+    unsigned long long served;
+};
+
+/*
+ * Create a ring of (at least) `size' bytes, and a socket at `path'
+ * (which must not exist), accessible only to us, to hand it out from
+ * `loop'.
+ */
+int shmring_listen(struct shmring *r, struct event_loop *loop, const char *path,
+                   size_t size);
+/* Tell readers we're done, and remove the socket. Safe if never started. */
+void shmring_close(struct shmring *r);
+
+/* Publish output. Never blocks; readers that fall behind lose some. */
+void shmring_write(struct shmring *r, const void *buf, size_t len);
+
+/*
+ * Connect to the ring at `path' and copy what's published there to
+ * stdout as it turns up, until the writer is done. Returns the exit
+ * status for main().
+ */
+int shmring_tail(const char *path);
+
+#endif
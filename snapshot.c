@@ -0,0 +1,156 @@
+/*
+ * Copyright (C) 2011 by Nelson Elhage
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include "reptyr.h"
+#include "snapshot.h"
+
+static void client_close(struct snapshot_client *c) {
+    ev_del(c->server->loop, &c->watch);
+    close(c->watch.fd);
+    c->watch.fd = -1;
+    c->text.len = c->off = 0;
+}
+
+/* Returns 1 once everything was sent or the client went away. */
+static int client_send(struct snapshot_client *c) {
+    ssize_t n;
+
+    while (c->off < c->text.len) {
+        /* A client that hung up mustn't take us down with SIGPIPE. */
+        n = send(c->watch.fd, c->text.buf + c->off, c->text.len - c->off, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0)
+            return errno != EAGAIN;
+        c->off += n;
+    }
+    return 1;
+}
+
+static void client_ready(struct event_loop *loop, struct watch *w, int revents) {
+    struct snapshot_client *c = w->data;
+
+    if (client_send(c))
+        client_close(c);
+}
+
+static void snapshot_accept(struct event_loop *loop, struct watch *w, int revents) {
+    struct snapshot_server *s = w->data;
+    struct snapshot_client *c;
+    int fd, i;
+
+    while ((fd = accept4(s->fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0) {
+        for (i = 0, c = NULL; i < SNAPSHOT_MAX_CLIENTS && c == NULL; i++)
+            if (s->clients[i].watch.fd < 0)
+                c = &s->clients[i];
+        if (c == NULL) {
+            close(fd);
+            continue;
+        }
+        ev_watch_init(&c->watch, fd, client_ready, c);
+        c->server = s;
+        c->text.len = c->off = 0;
+        if (term_snapshot(s->screen, &c->text) < 0) {
+            error("Out of memory for a screen snapshot.");
+            close(fd);
+            c->watch.fd = -1;
+            continue;
+        }
+        s->served++;
+        if (client_send(c))
+            client_close(c);
+        else if (ev_set(loop, &c->watch, EV_WRITE) < 0)
+            client_close(c);
+    }
+}
+
+int snapshot_listen(struct snapshot_server *s, struct event_loop *loop,
+                    struct term *screen, const char *path) {
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    mode_t mask;
+    int i, err;
+
+    memset(s, 0, sizeof *s);
+    s->fd = -1;
+    s->loop = loop;
+    s->screen = screen;
+    for (i = 0; i < SNAPSHOT_MAX_CLIENTS; i++)
+        s->clients[i].watch.fd = -1;
+    if (strlen(path) >= sizeof addr.sun_path) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    strcpy(addr.sun_path, path);
+    if ((s->fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) < 0)
+        return -1;
+    /* What's on the screen is as private as the session it's from. */
+    mask = umask(0077);
+    err = bind(s->fd, (struct sockaddr *)&addr, sizeof addr);
+    umask(mask);
+    if (err < 0)
+        goto fail;
+    /* From here on it's ours to remove. */
+    s->path = strdup(path);
+    if (listen(s->fd, SNAPSHOT_MAX_CLIENTS) < 0)
+        goto fail;
+    ev_watch_init(&s->watch, s->fd, snapshot_accept, s);
+    if (ev_add(loop, &s->watch, EV_READ) < 0)
+        goto fail;
+    return 0;
+
+fail:
+    err = errno;
+    snapshot_close(s);
+    errno = err;
+    return -1;
+}
+
+void snapshot_close(struct snapshot_server *s) {
+    int i;
+
+    if (s->loop == NULL)
+        return;
+    for (i = 0; i < SNAPSHOT_MAX_CLIENTS; i++) {
+        if (s->clients[i].watch.fd >= 0)
+            client_close(&s->clients[i]);
+        term_out_free(&s->clients[i].text);
+    }
+    ev_del(s->loop, &s->watch);
+    if (s->fd >= 0)
+        close(s->fd);
+    s->fd = -1;
+    s->loop = NULL;
+    if (s->path) {
+        unlink(s->path);
+        free(s->path);
+        s->path = NULL;
+    }
+}
@@ -0,0 +1,65 @@
+/*
+ * Copyright (C) 2011 by Nelson Elhage
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#include "event.h"
+#include "term.h"
+
+/*
+ * A Unix socket that hands out what is on the screen: everyone who
+ * connects gets the current contents of a struct term as text, and is
+ * then disconnected.
+ */
+
+#define SNAPSHOT_MAX_CLIENTS 8
+
+struct snapshot_server;
+
+struct snapshot_client {
+    struct snapshot_server *server;
+    struct watch watch;
+    struct term_out text;
+    size_t off;
+};
+
+struct snapshot_server {
+    int fd;
+    char *path;
+    struct term *screen;
+    struct event_loop *loop;
+    struct watch watch;
+    unsigned long long served;
+    /* Slow readers hold on to a slot; past this many, we hang up at once. */
+    struct snapshot_client clients[SNAPSHOT_MAX_CLIENTS];
+};
+
+/*
+ * Create a socket at `path' (which must not exist), accessible only to
+ * us, and serve snapshots of `screen' on it from `loop'.
+ */
+int snapshot_listen(struct snapshot_server *s, struct event_loop *loop,
+                    struct term *screen, const char *path);
+/* Stop serving and remove the socket. Safe to call if never started. */
+void snapshot_close(struct snapshot_server *s);
+
+#endif
@@ -0,0 +1,1392 @@
+/*
+ * Copyright (C) 2011 by Nelson Elhage
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "term.h"
+
+enum {
+    STATE_GROUND = 0,
+    STATE_ESC,
+    STATE_CSI,
+    STATE_OSC,
+    STATE_STRING,
+    STATE_STRING_ESC,
+    STATE_CHARSET,
+    STATE_SKIP,
+};
+
+/* DEC special graphics, for 0x60-0x7e after ESC ( 0 */
+static const uint16_t dec_graphics[31] = {
+    0x25c6, 0x2592, 0x2409, 0x240c, 0x240d, 0x240a, 0x00b0, 0x00b1,
+    0x2424, 0x240b, 0x2518, 0x2510, 0x250c, 0x2514, 0x253c, 0x23ba,
+    0x23bb, 0x2500, 0x23bc, 0x23bd, 0x251c, 0x2524, 0x2534, 0x252c,
+    0x2502, 0x2264, 0x2265, 0x03c0, 0x2260, 0x00a3, 0x00b7,
+};
+
+/*
+ * Columns taken by a code point. This only knows the common wide
+ * (CJK, emoji) and zero-width ranges, which is what matters for
+ * keeping the cursor in the right place.
+ */
+static int char_width(uint32_t ch) {
+    if (ch < 0x300)
+        return 1;
+    if ((ch >= 0x300 && ch <= 0x36f) || (ch >= 0x200b && ch <= 0x200f) ||
+        (ch >= 0xfe00 && ch <= 0xfe0f))
+        return 0;
+    if ((ch >= 0x1100 && ch <= 0x115f) || (ch >= 0x2e80 && ch <= 0xa4cf) ||
+        (ch >= 0xac00 && ch <= 0xd7a3) || (ch >= 0xf900 && ch <= 0xfaff) ||
+        (ch >= 0xfe30 && ch <= 0xfe4f) || (ch >= 0xff00 && ch <= 0xff60) ||
+        (ch >= 0xffe0 && ch <= 0xffe6) || (ch >= 0x1f300 && ch <= 0x1f64f) ||
+        (ch >= 0x1f900 && ch <= 0x1f9ff) || (ch >= 0x20000 && ch <= 0x3fffd))
+        return 2;
+    return 1;
+}
+
+static struct term_cell blank_cell(const struct term_cell *pen) {
+    struct term_cell c = { 0, pen->attr & TERM_BG, 0, pen->attr & TERM_BG ? pen->bg : 0 };
+    return c;
+}
+
+static void mark_dirty(struct term *t, int from, int to) {
+    if (from < 0)
+        from = 0;
+    if (to >= t->rows)
+        to = t->rows - 1;
+    if (from <= to)
+        memset(t->dirty + from, 1, to - from + 1);
+}
+
+static int is_wide(uint32_t ch) {
+    return ch != TERM_WIDE_TAIL && char_width(ch) == 2;
+}
+
+/* Blank out a half of a wide character whose other half got lost at x. */
+static void fix_wide(struct term *t, struct term_cell *row, int x) {
+    if (x < 0 || x >= t->cols)
+        return;
+    if (row[x].ch == TERM_WIDE_TAIL && (x == 0 || !is_wide(row[x - 1].ch)))
+        row[x] = blank_cell(&t->pen);
+    else if (is_wide(row[x].ch) && (x + 1 == t->cols || row[x + 1].ch != TERM_WIDE_TAIL))
+        row[x] = blank_cell(&t->pen);
+}
+
+static void clear_cells(struct term *t, int y, int from, int to) {
+    struct term_cell blank = blank_cell(&t->pen);
+    struct term_cell *row = term_row(t, y);
+    int x;
+
+    if (blank.attr == 0)
+        memset(row + from, 0, (to - from) * sizeof *row);
+    else
+        for (x = from; x < to; x++)
+            row[x] = blank;
+    fix_wide(t, row, from - 1);
+    fix_wide(t, row, to);
+    mark_dirty(t, y, y);
+}
+
+static void clear_rows(struct term *t, int from, int to) {
+    int y;
+
+    for (y = from; y < to; y++)
+        clear_cells(t, y, 0, t->cols);
+}
+
+static void reset(struct term *t) {
+    memset(&t->pen, 0, sizeof t->pen);
+    t->x = t->y = 0;
+    t->wrap_next = 0;
+    t->autowrap = 1;
+    t->origin = 0;
+    t->top = 0;
+    t->bottom = t->rows - 1;
+    t->modes = 0;
+    t->gfx = 0;
+    t->saved.x = t->saved.y = 0;
+    t->saved.pen = t->pen;
+    t->saved.origin = 0;
+    t->state = STATE_GROUND;
+    t->utf8_left = 0;
+}
+
+/* One block of cells, and pointers to its rows so that scrolling is cheap. */
+static struct term_cell **alloc_lines(int rows, int cols) {
+    struct term_cell **lines = malloc(rows * sizeof *lines);
+    struct term_cell *cells = calloc((size_t)rows * cols, sizeof *cells);
+    int y;
+
+    if (lines == NULL || cells == NULL) {
+        free(lines);
+        free(cells);
+        return NULL;
+    }
+    for (y = 0; y < rows; y++)
+        lines[y] = cells + (size_t)y * cols;
+    return lines;
+}
+
+/* Scrolling reorders the rows, so the block is wherever the lowest one is. */
+static void free_lines(struct term_cell **lines, int rows) {
+    struct term_cell *block = NULL;
+    int y;
+
+    if (lines == NULL)
+        return;
+    for (y = 0; y < rows; y++)
+        if (block == NULL || lines[y] < block)
+            block = lines[y];
+    free(block);
+    free(lines);
+}
+
+int term_init(struct term *t, int rows, int cols) {
+    memset(t, 0, sizeof *t);
+    t->lines = alloc_lines(rows, cols);
+    t->alt_lines = alloc_lines(rows, cols);
+    t->dirty = calloc(rows, 1);
+    t->rows = rows;
+    t->cols = cols;
+    if (!t->lines || !t->alt_lines || !t->dirty) {
+        term_free(t);
+        return -1;
+    }
+    reset(t);
+    mark_dirty(t, 0, rows - 1);
+    return 0;
+}
+
+static void free_history(struct term *t) {
+    int i;
+
+    for (i = 0; i < t->history_size; i++)
+        free(t->history[i].cells);
+    free(t->history);
+    t->history = NULL;
+    t->history_size = t->history_len = t->history_next = 0;
+}
+
+int term_set_history(struct term *t, int lines) {
+    free_history(t);
+    if (lines <= 0)
+        return 0;
+    t->history = calloc(lines, sizeof *t->history);
+    if (t->history == NULL)
+        return -1;
+    t->history_size = lines;
+    return 0;
+}
+
+void term_free(struct term *t) {
+    free_history(t);
+    free_lines(t->lines, t->rows);
+    free_lines(t->alt_lines, t->rows);
+    free(t->dirty);
+    free(t->reply.buf);
+    memset(t, 0, sizeof *t);
+}
+
+static struct term_cell **copy_lines(struct term_cell **from, int rows, int cols,
+                                     int new_rows, int new_cols) {
+    struct term_cell **to = alloc_lines(new_rows, new_cols);
+    int y;
+
+    if (to == NULL)
+        return NULL;
+    for (y = 0; y < rows && y < new_rows; y++)
+        memcpy(to[y], from[y], (cols < new_cols ? cols : new_cols) * sizeof **to);
+    return to;
+}
+
+int term_resize(struct term *t, int rows, int cols) {
+    struct term_cell **lines, **alt_lines;
+    unsigned char *dirty;
+
+    if (rows == t->rows && cols == t->cols)
+        return 0;
+    lines = copy_lines(t->lines, t->rows, t->cols, rows, cols);
+    alt_lines = copy_lines(t->alt_lines, t->rows, t->cols, rows, cols);
+    dirty = calloc(rows, 1);
+    if (!lines || !alt_lines || !dirty) {
+        free_lines(lines, rows);
+        free_lines(alt_lines, rows);
+        free(dirty);
+        return -1;
+    }
+    free_lines(t->lines, t->rows);
+    free_lines(t->alt_lines, t->rows);
+    free(t->dirty);
+    t->lines = lines;
+    t->alt_lines = alt_lines;
+    t->dirty = dirty;
+    t->rows = rows;
+    t->cols = cols;
+    if (t->x >= cols)
+        t->x = cols - 1;
+    if (t->y >= rows)
+        t->y = rows - 1;
+    t->wrap_next = 0;
+    t->top = 0;
+    t->bottom = rows - 1;
+    t->scrolled = -1;
+    mark_dirty(t, 0, rows - 1);
+    return 0;
+}
+
+static void reverse_lines(struct term_cell **lines, int from, int to) {
+    struct term_cell *tmp;
+
+    for (to--; from < to; from++, to--) {
+        tmp = lines[from];
+        lines[from] = lines[to];
+        lines[to] = tmp;
+    }
+}
+
+/* Rotate rows [top, bottom] up by n, so that the first n end up last. */
+static void rotate_up(struct term *t, int top, int bottom, int n) {
+    struct term_cell *first = t->lines[top];
+
+    /* The usual case: a line at a time. */
+    if (n == 1) {
+        memmove(t->lines + top, t->lines + top + 1, (bottom - top) * sizeof *t->lines);
+        t->lines[bottom] = first;
+        return;
+    }
+    reverse_lines(t->lines, top, top + n);
+    reverse_lines(t->lines, top + n, bottom + 1);
+    reverse_lines(t->lines, top, bottom + 1);
+}
+
+/* Copy a row that is about to scroll off into the history ring. */
+static void push_history(struct term *t, const struct term_cell *row) {
+    struct term_line *l = &t->history[t->history_next];
+    int len = t->cols;
+
+    while (len > 0 && row[len - 1].ch == 0 && row[len - 1].attr == 0)
+        len--;
+    if (len > l->size) {
+        struct term_cell *cells = realloc(l->cells, len * sizeof *cells);
+
+        /* Better a blank line than none; the rest keep their place. */
+        if (cells == NULL)
+            len = 0;
+        else
+            l->cells = cells, l->size = len;
+    }
+    if (len > 0)
+        memcpy(l->cells, row, len * sizeof *row);
+    l->len = len;
+    t->history_next = (t->history_next + 1) % t->history_size;
+    if (t->history_len < t->history_size)
+        t->history_len++;
+}
+
+static void scroll_up(struct term *t, int top, int bottom, int n) {
+    int rows = bottom - top + 1;
+    int y;
+
+    if (n > rows)
+        n = rows;
+    if (top == 0 && !t->alt && t->history_size)
+        for (y = 0; y < n; y++)
+            push_history(t, t->lines[y]);
+    rotate_up(t, top, bottom, n);
+    clear_rows(t, bottom - n + 1, bottom + 1);
+    mark_dirty(t, top, bottom);
+    if (top == 0 && bottom == t->rows - 1 && t->scrolled >= 0 && !t->alt)
+        t->scrolled = t->scrolled + n < t->rows ? t->scrolled + n : t->rows;
+    else
+        t->scrolled = -1;
+}
+
+static void scroll_down(struct term *t, int top, int bottom, int n) {
+    int rows = bottom - top + 1;
+
+    if (n > rows)
+        n = rows;
+    rotate_up(t, top, bottom, rows - n);
+    clear_rows(t, top, top + n);
+    mark_dirty(t, top, bottom);
+    t->scrolled = -1;
+}
+
+static void newline(struct term *t) {
+    if (t->y == t->bottom)
+        scroll_up(t, t->top, t->bottom, 1);
+    else if (t->y < t->rows - 1)
+        t->y++;
+}
+
+static void move_to(struct term *t, int x, int y) {
+    int top = t->origin ? t->top : 0;
+    int bottom = t->origin ? t->bottom : t->rows - 1;
+
+    y += top;
+    t->x = x < 0 ? 0 : x >= t->cols ? t->cols - 1 : x;
+    t->y = y < top ? top : y > bottom ? bottom : y;
+    t->wrap_next = 0;
+}
+
+/* Move up or down without leaving the scroll region we started in. */
+static void move_rel(struct term *t, int dy) {
+    int top = t->y >= t->top ? t->top : 0;
+    int bottom = t->y <= t->bottom ? t->bottom : t->rows - 1;
+    int y = t->y + dy;
+
+    t->y = y < top ? top : y > bottom ? bottom : y;
+    t->wrap_next = 0;
+}
+
+static void put_char(struct term *t, uint32_t ch) {
+    struct term_cell *row;
+    int w;
+
+    if (t->gfx && ch >= 0x60 && ch <= 0x7e)
+        ch = dec_graphics[ch - 0x60];
+    w = char_width(ch);
+    if (w == 0)
+        return;
+    if (t->wrap_next) {
+        t->x = 0;
+        newline(t);
+        t->wrap_next = 0;
+    }
+    if (w > t->cols)
+        return;
+    if (t->x + w > t->cols) {
+        if (!t->autowrap)
+            return;
+        clear_cells(t, t->y, t->x, t->cols);
+        t->x = 0;
+        newline(t);
+    }
+    row = term_row(t, t->y);
+    /* Don't leave half of a wide character behind. */
+    if (row[t->x].ch == TERM_WIDE_TAIL && t->x > 0)
+        row[t->x - 1] = blank_cell(&t->pen);
+    if (t->x + w < t->cols && row[t->x + w].ch == TERM_WIDE_TAIL)
+        row[t->x + w] = blank_cell(&t->pen);
+    row[t->x] = t->pen;
+    row[t->x].ch = ch == ' ' ? 0 : ch;
+    if (w == 2) {
+        row[t->x + 1] = t->pen;
+        row[t->x + 1].ch = TERM_WIDE_TAIL;
+    }
+    t->dirty[t->y] = 1;
+    if (t->x + w >= t->cols) {
+        t->x = t->cols - 1;
+        t->wrap_next = t->autowrap;
+    } else {
+        t->x += w;
+    }
+}
+
+/*
+ * The common case: a run of printable ASCII going onto the current line
+ * is copied straight into the cells, without put_char()'s per-character
+ * checks. Returns how many bytes it took, if any.
+ */
+static size_t put_text(struct term *t, const unsigned char *p, const unsigned char *end) {
+    struct term_cell *row = term_row(t, t->y);
+    struct term_cell cell = t->pen;
+    size_t room = t->cols - t->x, n, i;
+
+    if (t->gfx || t->wrap_next)
+        return 0;
+    for (n = 0; p + n < end && n < room; n++)
+        if (p[n] < 0x20 || p[n] >= 0x7f)
+            break;
+    if (n == 0)
+        return 0;
+    for (i = 0; i < n; i++) {
+        cell.ch = p[i] == ' ' ? 0 : p[i];
+        row[t->x + i] = cell;
+    }
+    fix_wide(t, row, t->x - 1);
+    fix_wide(t, row, t->x + n);
+    t->dirty[t->y] = 1;
+    if (t->x + n >= t->cols) {
+        t->x = t->cols - 1;
+        t->wrap_next = t->autowrap;
+    } else {
+        t->x += n;
+    }
+    return n;
+}
+
+static int param(struct term *t, int i, int def) {
+    return i < t->nparams && t->params[i] ? t->params[i] : def;
+}
+
+static void reply(struct term *t, const char *s) {
+    size_t n = strlen(s);
+    char *buf;
+
+    if (!t->answer)
+        return;
+    if (t->reply.len + n > t->reply.size) {
+        buf = realloc(t->reply.buf, t->reply.len + n + 64);
+        if (buf == NULL)
+            return;
+        t->reply.buf = buf;
+        t->reply.size = t->reply.len + n + 64;
+    }
+    memcpy(t->reply.buf + t->reply.len, s, n);
+    t->reply.len += n;
+}
+
+/* Map a 24-bit color onto the 6x6x6 cube of the 256-color palette. */
+static uint8_t rgb_to_256(int r, int g, int b) {
+    return 16 + 36 * (r * 5 / 255) + 6 * (g * 5 / 255) + b * 5 / 255;
+}
+
+static void sgr(struct term *t) {
+    static const uint16_t set[10] = {
+        0, TERM_BOLD, TERM_DIM, TERM_ITALIC, TERM_UNDERLINE, TERM_BLINK, 0,
+        TERM_REVERSE, TERM_INVISIBLE, TERM_STRIKE,
+    };
+    int i, p;
+
+    if (t->nparams == 0) {
+        t->pen.attr = 0;
+        return;
+    }
+    for (i = 0; i < t->nparams; i++) {
+        p = t->params[i];
+        if (p == 0) {
+            t->pen.attr = 0;
+        } else if (p < 10) {
+            t->pen.attr |= set[p];
+        } else if (p == 21 || p == 22) {
+            t->pen.attr &= ~(TERM_BOLD | TERM_DIM);
+        } else if (p >= 23 && p <= 29 && p != 26) {
+            t->pen.attr &= ~set[p - 20];
+        } else if ((p >= 30 && p <= 37) || (p >= 90 && p <= 97)) {
+            t->pen.attr |= TERM_FG;
+            t->pen.fg = p >= 90 ? p - 90 + 8 : p - 30;
+        } else if ((p >= 40 && p <= 47) || (p >= 100 && p <= 107)) {
+            t->pen.attr |= TERM_BG;
+            t->pen.bg = p >= 100 ? p - 100 + 8 : p - 40;
+        } else if (p == 39) {
+            t->pen.attr &= ~TERM_FG;
+        } else if (p == 49) {
+            t->pen.attr &= ~TERM_BG;
+        } else if ((p == 38 || p == 48) && i + 1 < t->nparams) {
+            int color;
+
+            if (t->params[i + 1] == 5 && i + 2 < t->nparams) {
+                color = t->params[i + 2] & 0xff;
+                i += 2;
+            } else if (t->params[i + 1] == 2 && i + 4 < t->nparams) {
+                color = rgb_to_256(t->params[i + 2] & 0xff, t->params[i + 3] & 0xff,
+                                   t->params[i + 4] & 0xff);
+                i += 4;
+            } else {
+                break;
+            }
+            if (p == 38) {
+                t->pen.attr |= TERM_FG;
+                t->pen.fg = color;
+            } else {
+                t->pen.attr |= TERM_BG;
+                t->pen.bg = color;
+            }
+        }
+    }
+}
+
+static void save_cursor(struct term *t) {
+    t->saved.x = t->x;
+    t->saved.y = t->y;
+    t->saved.pen = t->pen;
+    t->saved.origin = t->origin;
+}
+
+static void restore_cursor(struct term *t) {
+    t->pen = t->saved.pen;
+    t->origin = t->saved.origin;
+    t->x = t->saved.x < t->cols ? t->saved.x : t->cols - 1;
+    t->y = t->saved.y < t->rows ? t->saved.y : t->rows - 1;
+    t->wrap_next = 0;
+}
+
+static void set_alt(struct term *t, int on) {
+    struct term_cell **tmp;
+
+    if (on == t->alt)
+        return;
+    tmp = t->lines;
+    t->lines = t->alt_lines;
+    t->alt_lines = tmp;
+    t->alt = on;
+    t->scrolled = -1;
+    mark_dirty(t, 0, t->rows - 1);
+}
+
+static void set_mode(struct term *t, int mode, int on) {
+    int flag = 0;
+
+    switch (mode) {
+    case 1:
+        flag = TERM_MODE_APPCURSOR;
+        break;
+    case 6:
+        t->origin = on;
+        move_to(t, 0, 0);
+        return;
+    case 7:
+        t->autowrap = on;
+        return;
+    case 25:
+        flag = TERM_MODE_HIDECURSOR;
+        on = !on;
+        break;
+    case 47:
+    case 1047:
+        set_alt(t, on);
+        return;
+    case 1049:
+        if (on) {
+            save_cursor(t);
+            set_alt(t, 1);
+            clear_rows(t, 0, t->rows);
+        } else {
+            set_alt(t, 0);
+            restore_cursor(t);
+        }
+        return;
+    case 1000:
+        flag = TERM_MODE_MOUSE;
+        break;
+    case 1002:
+        flag = TERM_MODE_MOUSE_DRAG;
+        break;
+    case 1003:
+        flag = TERM_MODE_MOUSE_ANY;
+        break;
+    case 1006:
+        flag = TERM_MODE_MOUSE_SGR;
+        break;
+    case 2004:
+        flag = TERM_MODE_PASTE;
+        break;
+    }
+    if (on)
+        t->modes |= flag;
+    else
+        t->modes &= ~flag;
+}
+
+static void insert_cells(struct term *t, int n) {
+    struct term_cell *row = term_row(t, t->y);
+
+    if (n > t->cols - t->x)
+        n = t->cols - t->x;
+    memmove(row + t->x + n, row + t->x, (t->cols - t->x - n) * sizeof *row);
+    fix_wide(t, row, t->cols - 1);
+    clear_cells(t, t->y, t->x, t->x + n);
+}
+
+static void delete_cells(struct term *t, int n) {
+    struct term_cell *row = term_row(t, t->y);
+
+    if (n > t->cols - t->x)
+        n = t->cols - t->x;
+    memmove(row + t->x, row + t->x + n, (t->cols - t->x - n) * sizeof *row);
+    fix_wide(t, row, t->x - 1);
+    fix_wide(t, row, t->x);
+    clear_cells(t, t->y, t->cols - n, t->cols);
+}
+
+static void csi_dispatch(struct term *t, char final) {
+    char buf[32];
+    int n = param(t, 0, 1);
+
+    if (t->priv == '?') {
+        int i;
+
+        if (final == 'h' || final == 'l')
+            for (i = 0; i < t->nparams; i++)
+                set_mode(t, t->params[i], final == 'h');
+        return;
+    }
+    if (t->priv || t->intermediate)
+        return;
+
+    switch (final) {
+    case '@':
+        insert_cells(t, n);
+        break;
+    case 'A':
+        move_rel(t, -n);
+        break;
+    case 'B':
+    case 'e':
+        move_rel(t, n);
+        break;
+    case 'C':
+    case 'a':
+        move_to(t, t->x + n, t->y - (t->origin ? t->top : 0));
+        break;
+    case 'D':
+        move_to(t, t->x - n, t->y - (t->origin ? t->top : 0));
+        break;
+    case 'E':
+        move_rel(t, n);
+        t->x = 0;
+        break;
+    case 'F':
+        move_rel(t, -n);
+        t->x = 0;
+        break;
+    case 'G':
+    case '`':
+        move_to(t, n - 1, t->y - (t->origin ? t->top : 0));
+        break;
+    case 'H':
+    case 'f':
+        move_to(t, param(t, 1, 1) - 1, n - 1);
+        break;
+    case 'd':
+        move_to(t, t->x, n - 1);
+        break;
+    case 'J':
+        switch (param(t, 0, 0)) {
+        case 0:
+            clear_cells(t, t->y, t->x, t->cols);
+            clear_rows(t, t->y + 1, t->rows);
+            break;
+        case 1:
+            clear_rows(t, 0, t->y);
+            clear_cells(t, t->y, 0, t->x + 1);
+            break;
+        case 2:
+        case 3:
+            clear_rows(t, 0, t->rows);
+            t->scrolled = -1;
+            break;
+        }
+        break;
+    case 'K':
+        switch (param(t, 0, 0)) {
+        case 0:
+            clear_cells(t, t->y, t->x, t->cols);
+            break;
+        case 1:
+            clear_cells(t, t->y, 0, t->x + 1);
+            break;
+        case 2:
+            clear_cells(t, t->y, 0, t->cols);
+            break;
+        }
+        break;
+    case 'L':
+        if (t->y >= t->top && t->y <= t->bottom)
+            scroll_down(t, t->y, t->bottom, n);
+        break;
+    case 'M':
+        if (t->y >= t->top && t->y <= t->bottom)
+            scroll_up(t, t->y, t->bottom, n);
+        break;
+    case 'P':
+        delete_cells(t, n);
+        break;
+    case 'X':
+        clear_cells(t, t->y, t->x, t->x + n < t->cols ? t->x + n : t->cols);
+        break;
+    case 'S':
+        scroll_up(t, t->top, t->bottom, n);
+        break;
+    case 'T':
+        scroll_down(t, t->top, t->bottom, n);
+        break;
+    case 'm':
+        sgr(t);
+        break;
+    case 'r': {
+        int top = param(t, 0, 1) - 1;
+        int bottom = param(t, 1, t->rows) - 1;
+
+        if (bottom >= t->rows)
+            bottom = t->rows - 1;
+        if (top < bottom) {
+            t->top = top;
+            t->bottom = bottom;
+            move_to(t, 0, 0);
+        }
+        break;
+    }
+    case 's':
+        save_cursor(t);
+        break;
+    case 'u':
+        restore_cursor(t);
+        break;
+    case 'n':
+        /*
+         * The real terminal only sees what we render, so it can't
+         * answer for the program; we do instead.
+         */
+        if (param(t, 0, 0) == 5) {
+            reply(t, "\033[0n");
+        } else if (param(t, 0, 0) == 6) {
+            snprintf(buf, sizeof buf, "\033[%d;%dR",
+                     t->y + 1 - (t->origin ? t->top : 0), t->x + 1);
+            reply(t, buf);
+        }
+        break;
+    case 'c':
+        if (param(t, 0, 0) == 0)
+            reply(t, "\033[?6c");
+        break;
+    }
+}
+
+static void esc_dispatch(struct term *t, unsigned char c) {
+    t->state = STATE_GROUND;
+    switch (c) {
+    case '[':
+        t->state = STATE_CSI;
+        t->nparams = 0;
+        t->params[0] = 0;
+        t->priv = 0;
+        t->intermediate = 0;
+        break;
+    case ']':
+        t->state = STATE_OSC;
+        break;
+    case 'P':
+    case 'X':
+    case '^':
+    case '_':
+        t->state = STATE_STRING;
+        break;
+    case '(':
+        t->state = STATE_CHARSET;
+        break;
+    case ')':
+    case '*':
+    case '+':
+    case '#':
+    case '%':
+        t->state = STATE_SKIP;
+        break;
+    case '7':
+        save_cursor(t);
+        break;
+    case '8':
+        restore_cursor(t);
+        break;
+    case 'D':
+        newline(t);
+        break;
+    case 'E':
+        t->x = 0;
+        newline(t);
+        break;
+    case 'M':
+        if (t->y == t->top)
+            scroll_down(t, t->top, t->bottom, 1);
+        else if (t->y > 0)
+            t->y--;
+        t->wrap_next = 0;
+        break;
+    case 'c':
+        if (t->alt)
+            set_alt(t, 0);
+        reset(t);
+        clear_rows(t, 0, t->rows);
+        t->scrolled = -1;
+        break;
+    case '=':
+        t->modes |= TERM_MODE_APPKEYPAD;
+        break;
+    case '>':
+        t->modes &= ~TERM_MODE_APPKEYPAD;
+        break;
+    }
+}
+
+static void control(struct term *t, unsigned char c) {
+    switch (c) {
+    case '\a':
+        t->bells++;
+        break;
+    case '\b':
+        if (t->x > 0)
+            t->x--;
+        t->wrap_next = 0;
+        break;
+    case '\t':
+        t->x = (t->x / 8 + 1) * 8;
+        if (t->x >= t->cols)
+            t->x = t->cols - 1;
+        t->wrap_next = 0;
+        break;
+    case '\n':
+    case '\v':
+    case '\f':
+        newline(t);
+        t->wrap_next = 0;
+        break;
+    case '\r':
+        t->x = 0;
+        t->wrap_next = 0;
+        break;
+    case 0x18:
+    case 0x1a:
+        t->state = STATE_GROUND;
+        break;
+    case 0x1b:
+        t->state = STATE_ESC;
+        break;
+    }
+}
+
+static void ground(struct term *t, unsigned char c) {
+    if (t->utf8_left) {
+        if ((c & 0xc0) == 0x80) {
+            t->utf8 = t->utf8 << 6 | (c & 0x3f);
+            if (--t->utf8_left == 0)
+                put_char(t, t->utf8);
+            return;
+        }
+        t->utf8_left = 0;
+        put_char(t, 0xfffd);
+    }
+    if (c < 0x80) {
+        put_char(t, c);
+    } else if ((c & 0xe0) == 0xc0) {
+        t->utf8 = c & 0x1f;
+        t->utf8_left = 1;
+    } else if ((c & 0xf0) == 0xe0) {
+        t->utf8 = c & 0x0f;
+        t->utf8_left = 2;
+    } else if ((c & 0xf8) == 0xf0) {
+        t->utf8 = c & 0x07;
+        t->utf8_left = 3;
+    } else {
+        put_char(t, 0xfffd);
+    }
+}
+
+static void csi(struct term *t, unsigned char c) {
+    if (c >= '0' && c <= '9') {
+        int *p = &t->params[t->nparams ? t->nparams - 1 : 0];
+
+        if (t->nparams == 0)
+            t->nparams = 1;
+        if (*p < 65535)
+            *p = *p * 10 + (c - '0');
+    } else if (c == ';' || c == ':') {
+        if (t->nparams == 0)
+            t->nparams = 1;
+        if (t->nparams < TERM_MAX_PARAMS)
+            t->params[t->nparams++] = 0;
+    } else if (c >= '<' && c <= '?') {
+        t->priv = c;
+    } else if (c >= 0x20 && c <= 0x2f) {
+        t->intermediate = c;
+    } else if (c >= 0x40 && c <= 0x7e) {
+        t->state = STATE_GROUND;
+        csi_dispatch(t, c);
+    }
+}
+
+void term_write(struct term *t, const char *buf, size_t len) {
+    const unsigned char *p = (const unsigned char *)buf;
+    const unsigned char *end = p + len;
+    unsigned char c;
+    size_t n;
+
+    for (; p < end; p++) {
+        c = *p;
+        if (t->state == STATE_GROUND && !t->utf8_left && (n = put_text(t, p, end)) > 0) {
+            p += n - 1;
+            continue;
+        }
+        if (c < 0x20 && t->state != STATE_OSC && t->state != STATE_STRING &&
+            t->state != STATE_STRING_ESC) {
+            control(t, c);
+            continue;
+        }
+        switch (t->state) {
+        case STATE_GROUND:
+            if (c != 0x7f)
+                ground(t, c);
+            break;
+        case STATE_ESC:
+            esc_dispatch(t, c);
+            break;
+        case STATE_CSI:
+            csi(t, c);
+            break;
+        case STATE_OSC:
+        case STATE_STRING:
+            /* Titles and the like: not part of the screen. */
+            if (c == '\a' || c == 0x18 || c == 0x1a)
+                t->state = STATE_GROUND;
+            else if (c == 0x1b)
+                t->state = STATE_STRING_ESC;
+            break;
+        case STATE_STRING_ESC:
+            t->state = c == '\\' ? STATE_GROUND : STATE_STRING;
+            break;
+        case STATE_CHARSET:
+            t->gfx = c == '0';
+            t->state = STATE_GROUND;
+            break;
+        case STATE_SKIP:
+            t->state = STATE_GROUND;
+            break;
+        }
+    }
+}
+
+int term_view_init(struct term_view *v, int rows, int cols) {
+    memset(v, 0, sizeof *v);
+    v->cells = calloc((size_t)rows * cols, sizeof *v->cells);
+    if (v->cells == NULL)
+        return -1;
+    v->rows = rows;
+    v->cols = cols;
+    v->x = v->y = -1;
+    v->invalid = 1;
+    return 0;
+}
+
+void term_view_free(struct term_view *v) {
+    free(v->cells);
+    memset(v, 0, sizeof *v);
+}
+
+void term_out_free(struct term_out *out) {
+    free(out->buf);
+    memset(out, 0, sizeof *out);
+}
+
+static int out_add(struct term_out *out, const void *buf, size_t len) {
+    if (out->len + len > out->size) {
+        size_t size = out->size ? out->size : 4096;
+        char *p;
+
+        while (size < out->len + len)
+            size *= 2;
+        p = realloc(out->buf, size);
+        if (p == NULL)
+            return -1;
+        out->buf = p;
+        out->size = size;
+    }
+    memcpy(out->buf + out->len, buf, len);
+    out->len += len;
+    return 0;
+}
+
+static int out_str(struct term_out *out, const char *s) {
+    return out_add(out, s, strlen(s));
+}
+
+static int out_utf8(struct term_out *out, uint32_t ch) {
+    char buf[4];
+    int n;
+
+    if (ch == 0) {
+        buf[0] = ' ';
+        n = 1;
+    } else if (ch < 0x80) {
+        buf[0] = ch;
+        n = 1;
+    } else if (ch < 0x800) {
+        buf[0] = 0xc0 | ch >> 6;
+        buf[1] = 0x80 | (ch & 0x3f);
+        n = 2;
+    } else if (ch < 0x10000) {
+        buf[0] = 0xe0 | ch >> 12;
+        buf[1] = 0x80 | (ch >> 6 & 0x3f);
+        buf[2] = 0x80 | (ch & 0x3f);
+        n = 3;
+    } else {
+        buf[0] = 0xf0 | ch >> 18;
+        buf[1] = 0x80 | (ch >> 12 & 0x3f);
+        buf[2] = 0x80 | (ch >> 6 & 0x3f);
+        buf[3] = 0x80 | (ch & 0x3f);
+        n = 4;
+    }
+    return out_add(out, buf, n);
+}
+
+static int same_attrs(const struct term_cell *a, const struct term_cell *b) {
+    return a->attr == b->attr && a->fg == b->fg && a->bg == b->bg;
+}
+
+static int same_cell(const struct term_cell *a, const struct term_cell *b) {
+    return a->ch == b->ch && same_attrs(a, b);
+}
+
+static int out_sgr(struct term_out *out, struct term_view *v, const struct term_cell *c) {
+    static const char *codes[8] = { "1", "2", "3", "4", "5", "7", "8", "9" };
+    char buf[128];
+    size_t n;
+    int i;
+
+    if (same_attrs(&v->pen, c))
+        return 0;
+    n = snprintf(buf, sizeof buf, "\033[0");
+    for (i = 0; i < 8; i++)
+        if (c->attr & (1 << i))
+            n += snprintf(buf + n, sizeof buf - n, ";%s", codes[i]);
+    if (c->attr & TERM_FG) {
+        if (c->fg < 8)
+            n += snprintf(buf + n, sizeof buf - n, ";3%d", c->fg);
+        else if (c->fg < 16)
+            n += snprintf(buf + n, sizeof buf - n, ";9%d", c->fg - 8);
+        else
+            n += snprintf(buf + n, sizeof buf - n, ";38;5;%d", c->fg);
+    }
+    if (c->attr & TERM_BG) {
+        if (c->bg < 8)
+            n += snprintf(buf + n, sizeof buf - n, ";4%d", c->bg);
+        else if (c->bg < 16)
+            n += snprintf(buf + n, sizeof buf - n, ";10%d", c->bg - 8);
+        else
+            n += snprintf(buf + n, sizeof buf - n, ";48;5;%d", c->bg);
+    }
+    n += snprintf(buf + n, sizeof buf - n, "m");
+    v->pen = *c;
+    v->pen.ch = 0;
+    return out_add(out, buf, n);
+}
+
+static int out_goto(struct term_out *out, struct term_view *v, int x, int y) {
+    char buf[32];
+
+    if (v->x == x && v->y == y)
+        return 0;
+    if (x == 0 && v->y >= 0 && (y == v->y || y == v->y + 1)) {
+        const char *move = y == v->y ? "\r" : "\r\n";
+
+        v->x = x;
+        v->y = y;
+        return out_str(out, move);
+    }
+    v->x = x;
+    v->y = y;
+    if (x == 0 && y == 0)
+        return out_str(out, "\033[H");
+    snprintf(buf, sizeof buf, "\033[%d;%dH", y + 1, x + 1);
+    return out_str(out, buf);
+}
+
+static int out_modes(struct term_out *out, struct term_view *v, int modes) {
+    static const struct {
+        int flag;
+        const char *on;
+        const char *off;
+    } map[] = {
+        { TERM_MODE_APPCURSOR, "\033[?1h", "\033[?1l" },
+        { TERM_MODE_APPKEYPAD, "\033=", "\033>" },
+        { TERM_MODE_PASTE, "\033[?2004h", "\033[?2004l" },
+        { TERM_MODE_MOUSE, "\033[?1000h", "\033[?1000l" },
+        { TERM_MODE_MOUSE_DRAG, "\033[?1002h", "\033[?1002l" },
+        { TERM_MODE_MOUSE_ANY, "\033[?1003h", "\033[?1003l" },
+        { TERM_MODE_MOUSE_SGR, "\033[?1006h", "\033[?1006l" },
+    };
+    size_t i;
+
+    for (i = 0; i < sizeof map / sizeof map[0]; i++) {
+        if ((v->modes ^ modes) & map[i].flag &&
+            out_str(out, modes & map[i].flag ? map[i].on : map[i].off) < 0)
+            return -1;
+    }
+    v->modes = (v->modes & TERM_MODE_HIDECURSOR) | (modes & ~TERM_MODE_HIDECURSOR);
+    return 0;
+}
+
+/* Where the run of blanks that an erase could produce ends the row. */
+static int blank_from(const struct term_cell *row, int cols) {
+    const struct term_cell *last = &row[cols - 1];
+    int x;
+
+    if (last->ch != 0 || (last->attr & ~TERM_BG))
+        return cols;
+    for (x = cols - 1; x > 0; x--)
+        if (!same_cell(&row[x - 1], last))
+            break;
+    return x;
+}
+
+/* Rewrite the changed parts of row y, pulling nearby unchanged cells into a run. */
+static int render_row(struct term *t, struct term_view *v, struct term_out *out, int y) {
+    struct term_cell *want = term_row(t, y);
+    struct term_cell *have = v->cells + (size_t)y * v->cols;
+    int tail = blank_from(want, t->cols);
+    int x = 0, end, i;
+
+    while (x < t->cols) {
+        if (same_cell(&want[x], &have[x])) {
+            x++;
+            continue;
+        }
+        if (want[x].ch == TERM_WIDE_TAIL && x > 0)
+            x--;
+        end = x;
+        for (i = x + 1; i < t->cols && i - end <= 4; i++)
+            if (!same_cell(&want[i], &have[i]))
+                end = i;
+        end++;
+        if (end > tail && x >= tail) {
+            /* Erase the rest of the line instead of writing spaces. */
+            if (out_goto(out, v, x, y) < 0 || out_sgr(out, v, &want[tail]) < 0 ||
+                out_str(out, "\033[K") < 0)
+                return -1;
+            for (i = x; i < t->cols; i++)
+                have[i] = want[i];
+            break;
+        }
+        if (out_goto(out, v, x, y) < 0)
+            return -1;
+        for (i = x; i < end; i++) {
+            if (out_sgr(out, v, &want[i]) < 0 || out_utf8(out, want[i].ch) < 0)
+                return -1;
+            have[i] = want[i];
+            v->x++;
+            /* The terminal fills in the other half by itself. */
+            if (is_wide(want[i].ch)) {
+                i++;
+                have[i] = want[i];
+                v->x++;
+            }
+        }
+        /* Past the margin, terminals disagree about where the cursor is. */
+        if (v->x >= t->cols)
+            v->x = v->y = -1;
+        x = end;
+    }
+    return 0;
+}
+
+int term_render(struct term *t, struct term_view *v, struct term_out *out) {
+    static const struct term_cell plain;
+    int visible = !(t->modes & TERM_MODE_HIDECURSOR);
+    size_t start = out->len, drawn;
+    int hid = visible, y;
+
+    if (v->rows != t->rows || v->cols != t->cols) {
+        term_view_free(v);
+        if (term_view_init(v, t->rows, t->cols) < 0)
+            return -1;
+    }
+    /* Don't let the cursor flicker around while we draw. */
+    if (visible && out_str(out, "\033[?25l") < 0)
+        return -1;
+    drawn = out->len;
+
+    if (v->invalid) {
+        if (out_str(out, "\033[0m\033[r\033[H\033[2J") < 0)
+            return -1;
+        memset(v->cells, 0, (size_t)v->rows * v->cols * sizeof *v->cells);
+        memset(&v->pen, 0, sizeof v->pen);
+        v->x = v->y = 0;
+        v->invalid = 0;
+        mark_dirty(t, 0, t->rows - 1);
+    } else if (t->scrolled > 0) {
+        /*
+         * Scroll the real terminal the same way, so only the new lines
+         * need drawing (and the old ones end up in its scrollback).
+         */
+        if (out_sgr(out, v, &plain) < 0 || out_goto(out, v, 0, t->rows - 1) < 0)
+            return -1;
+        for (y = 0; y < t->scrolled; y++)
+            if (out_str(out, "\n") < 0)
+                return -1;
+        memmove(v->cells, v->cells + (size_t)t->scrolled * v->cols,
+                (size_t)(v->rows - t->scrolled) * v->cols * sizeof *v->cells);
+        memset(v->cells + (size_t)(v->rows - t->scrolled) * v->cols, 0,
+               (size_t)t->scrolled * v->cols * sizeof *v->cells);
+    }
+    t->scrolled = 0;
+
+    for (y = 0; y < t->rows; y++) {
+        if (!t->dirty[y])
+            continue;
+        t->dirty[y] = 0;
+        if (render_row(t, v, out, y) < 0)
+            return -1;
+    }
+    /* Nothing changed after all: drop the cursor hiding. */
+    if (out->len == drawn) {
+        out->len = start;
+        hid = 0;
+    }
+
+    if (out_modes(out, v, t->modes) < 0)
+        return -1;
+    if (t->bells) {
+        if (out_str(out, "\a") < 0)
+            return -1;
+        t->bells = 0;
+    }
+    if (out_goto(out, v, t->x, t->y) < 0)
+        return -1;
+    if ((hid || (v->modes & TERM_MODE_HIDECURSOR)) != !visible &&
+        out_str(out, visible ? "\033[?25h" : "\033[?25l") < 0)
+        return -1;
+    v->modes = (v->modes & ~TERM_MODE_HIDECURSOR) | (t->modes & TERM_MODE_HIDECURSOR);
+    return 0;
+}
+
+int term_render_exit(struct term *t, struct term_view *v, struct term_out *out) {
+    static const struct term_cell plain;
+
+    if (out_sgr(out, v, &plain) < 0 || out_modes(out, v, 0) < 0)
+        return -1;
+    v->x = v->y = -1;
+    if (out_goto(out, v, t->x, t->y) < 0)
+        return -1;
+    if (v->modes & TERM_MODE_HIDECURSOR && out_str(out, "\033[?25h") < 0)
+        return -1;
+    v->modes &= ~TERM_MODE_HIDECURSOR;
+    return 0;
+}
+
+/*
+ * Write the last n lines of history from the bottom of the screen, so
+ * they scroll up into the terminal's scrollback, then keep going until
+ * the screen is blank again.
+ */
+static int redraw_history(struct term *t, struct term_view *v, struct term_out *out,
+                          int n) {
+    static const struct term_cell plain;
+    const struct term_line *l;
+    char buf[32];
+    int i, x, err;
+
+    snprintf(buf, sizeof buf, "\033[%d;1H", t->rows);
+    err = out_str(out, buf);
+    for (i = n; i > 0 && err == 0; i--) {
+        l = &t->history[(t->history_next - i + t->history_size) % t->history_size];
+        err = out_str(out, "\r\n");
+        for (x = 0; x < l->len && x < t->cols && err == 0; x++) {
+            if (l->cells[x].ch == TERM_WIDE_TAIL)
+                continue;
+            if (is_wide(l->cells[x].ch) && x + 1 >= t->cols)
+                break;
+            err = out_sgr(out, v, &l->cells[x]);
+            if (err == 0)
+                err = out_utf8(out, l->cells[x].ch);
+        }
+    }
+    if (err == 0)
+        err = out_sgr(out, v, &plain);
+    for (i = 0; i < t->rows && err == 0; i++)
+        err = out_str(out, "\n");
+    v->x = v->y = -1;
+    return err;
+}
+
+int term_redraw(struct term *t, struct term_out *out, int history) {
+    struct term_view v;
+    int y, err;
+
+    if (term_view_init(&v, t->rows, t->cols) < 0)
+        return -1;
+    /* Every mode gets set one way or the other. */
+    v.modes = ~t->modes;
+    v.x = v.y = 0;
+    err = out_str(out, "\033[0m\033[r\033[H\033[2J");
+    if (history > t->history_len)
+        history = t->history_len;
+    if (history > 0 && err == 0)
+        err = redraw_history(t, &v, out, history);
+    for (y = 0; y < t->rows && err == 0; y++)
+        err = render_row(t, &v, out, y);
+    if (err == 0)
+        err = out_modes(out, &v, t->modes);
+    if (err == 0)
+        err = out_goto(out, &v, t->x, t->y);
+    if (err == 0)
+        err = out_str(out, t->modes & TERM_MODE_HIDECURSOR ? "\033[?25l" : "\033[?25h");
+    term_view_free(&v);
+    return err;
+}
+
+int term_keyframe(struct term *t, struct term_out *out) {
+    struct term_view v;
+    struct term_cell **lines;
+    char buf[64];
+    int err = 0;
+
+    if (t->alt) {
+        /* The main screen is still there underneath: draw it first. */
+        lines = t->lines;
+        t->lines = t->alt_lines;
+        err = term_redraw(t, out, 0);
+        t->lines = lines;
+    }
+    /* Where the cursor was saved, e.g. by switching to the alternate screen */
+    memset(&v, 0, sizeof v);
+    v.x = v.y = -1;
+    v.pen.attr = ~t->saved.pen.attr;
+    if (err == 0)
+        err = out_goto(out, &v, t->saved.x, t->saved.y);
+    if (err == 0)
+        err = out_sgr(out, &v, &t->saved.pen);
+    if (err == 0)
+        err = out_str(out, t->alt ? "\0337\033[?1047h" : "\0337");
+    if (err == 0)
+        err = term_redraw(t, out, 0);
+    if (err == 0 && (t->top != 0 || t->bottom != t->rows - 1)) {
+        /* Setting the margins homes the cursor, so put it back. */
+        snprintf(buf, sizeof buf, "\033[%d;%dr\033[%d;%dH",
+                 t->top + 1, t->bottom + 1, t->y + 1, t->x + 1);
+        err = out_str(out, buf);
+    }
+    if (err == 0 && !t->autowrap)
+        err = out_str(out, "\033[?7l");
+    if (err == 0) {
+        /* Whatever the redraw left the pen as, make it the program's. */
+        v.pen.attr = ~t->pen.attr;
+        err = out_sgr(out, &v, &t->pen);
+    }
+    return err;
+}
+
+int term_snapshot(struct term *t, struct term_out *out) {
+    struct term_cell *row;
+    int x, y, end;
+
+    for (y = 0; y < t->rows; y++) {
+        row = term_row(t, y);
+        for (end = t->cols; end > 0 && row[end - 1].ch == 0; end--)
+            ;
+        for (x = 0; x < end; x++)
+            if (row[x].ch != TERM_WIDE_TAIL && out_utf8(out, row[x].ch) < 0)
+                return -1;
+        if (out_str(out, "\n") < 0)
+            return -1;
+    }
+    return 0;
+}
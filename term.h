@@ -0,0 +1,215 @@
+/*
+ * Copyright (C) 2011 by Nelson Elhage
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#ifndef TERM_H
+#define TERM_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+/*
+ * An in-memory model of the screen of a VT100/xterm-like terminal, fed
+ * with whatever the program on the pty writes. It understands enough
+ * of the usual escape sequences (cursor motion, erasing, scroll
+ * regions, SGR attributes, the alternate screen) to know what the
+ * screen looks like, and ignores the rest.
+ */
+
+#define TERM_BOLD       0x001
+#define TERM_DIM        0x002
+#define TERM_ITALIC     0x004
+#define TERM_UNDERLINE  0x008
+#define TERM_BLINK      0x010
+#define TERM_REVERSE    0x020
+#define TERM_INVISIBLE  0x040
+#define TERM_STRIKE     0x080
+/* fg (resp. bg) holds one of 256 colors rather than the default */
+#define TERM_FG         0x100
+#define TERM_BG         0x200
+
+/* The right half of a double-width character */
+#define TERM_WIDE_TAIL  0xffffffff
+
+struct term_cell {
+    /* A Unicode code point, or 0 for a blank that was never written */
+    uint32_t ch;
+    uint16_t attr;
+    uint8_t fg;
+    uint8_t bg;
+};
+
+/* Private modes we pass on, since they change what the keyboard sends */
+#define TERM_MODE_APPCURSOR   0x01
+#define TERM_MODE_APPKEYPAD   0x02
+#define TERM_MODE_HIDECURSOR  0x04
+#define TERM_MODE_PASTE       0x08
+#define TERM_MODE_MOUSE       0x10
+#define TERM_MODE_MOUSE_DRAG  0x20
+#define TERM_MODE_MOUSE_ANY   0x40
+#define TERM_MODE_MOUSE_SGR   0x80
+
+#define TERM_MAX_PARAMS 16
+
+/* A line that scrolled off the screen, without its trailing blanks. */
+struct term_line {
+    struct term_cell *cells;
+    int len;
+    int size;
+};
+
+/* A growable byte buffer for rendered output. */
+struct term_out {
+    char *buf;
+    size_t len;
+    size_t size;
+};
+
+struct term {
+    int rows;
+    int cols;
+    struct term_cell **lines;
+    struct term_cell **alt_lines;
+    int alt;
+    /* rows changed since the last term_render() */
+    unsigned char *dirty;
+    /*
+     * Lines the whole screen has scrolled up by since the last render,
+     * or -1 if anything else moved text around.
+     */
+    int scrolled;
+    int bells;
+
+    /*
+     * The last history_size lines to scroll off the top of the main
+     * screen, in a ring: history_next is where the next one goes.
+     */
+    struct term_line *history;
+    int history_size;
+    int history_len;
+    int history_next;
+
+    int x;
+    int y;
+    /* The cursor is past the last column; the next character wraps. */
+    int wrap_next;
+    int autowrap;
+    int origin;
+    int top;
+    int bottom;
+    struct term_cell pen;
+    int modes;
+    /* G0 is the DEC line drawing set */
+    int gfx;
+    struct {
+        int x, y;
+        struct term_cell pen;
+        int origin;
+    } saved;
+
+    /* Escape sequence parser */
+    int state;
+    int params[TERM_MAX_PARAMS];
+    int nparams;
+    char priv;
+    char intermediate;
+    uint32_t utf8;
+    int utf8_left;
+
+    /*
+     * If set, answers to status queries, for the caller to send to the
+     * program, since the real terminal won't see them
+     */
+    int answer;
+    struct term_out reply;
+};
+
+/*
+ * What the real terminal currently shows, as far as we know, so that
+ * term_render() only has to send what changed.
+ */
+struct term_view {
+    int rows;
+    int cols;
+    struct term_cell *cells;
+    /* -1 if unknown */
+    int x;
+    int y;
+    struct term_cell pen;
+    int modes;
+    /* Redraw everything on the next render. */
+    int invalid;
+};
+
+int term_init(struct term *t, int rows, int cols);
+void term_free(struct term *t);
+/* Keeps what fits of the old screen, anchored at the top left. */
+int term_resize(struct term *t, int rows, int cols);
+void term_write(struct term *t, const char *buf, size_t len);
+/*
+ * Keep up to `lines' lines of scrollback (0 for none, the default),
+ * dropping whatever was kept before. Returns -1 if out of memory.
+ */
+int term_set_history(struct term *t, int lines);
+
+static inline struct term_cell *term_row(struct term *t, int y) {
+    return t->lines[y];
+}
+
+int term_view_init(struct term_view *v, int rows, int cols);
+void term_view_free(struct term_view *v);
+
+/*
+ * Append to `out' the bytes that turn what `v' says is on the real
+ * terminal into what `t' says should be, and update `v' to match.
+ * Returns -1 if out of memory.
+ */
+int term_render(struct term *t, struct term_view *v, struct term_out *out);
+
+/*
+ * Append what it takes to draw the whole screen from scratch, on a
+ * terminal in any state, to `out'. Before that, up to `history' lines
+ * of scrollback are scrolled into the terminal's own. Unlike
+ * term_render(), this leaves `t' alone, and takes time in proportion
+ * to the size of the screen (and `history'), however much was written
+ * to it. Returns -1 if out of memory.
+ */
+int term_redraw(struct term *t, struct term_out *out, int history);
+
+/*
+ * Like term_redraw(), but for a fresh term of the same size to pick up
+ * where `t' is: the main screen under the alternate one, the saved
+ * cursor, the scrolling region and the pen are brought along too.
+ */
+int term_keyframe(struct term *t, struct term_out *out);
+
+/*
+ * Append the text on the screen to `out', a line per row with trailing
+ * blanks dropped. Takes time in proportion to the size of the screen,
+ * however much was written to it. Returns -1 if out of memory.
+ */
+int term_snapshot(struct term *t, struct term_out *out);
+
+/* Leave the real terminal in a sane state, with the cursor where `t' has it. */
+int term_render_exit(struct term *t, struct term_view *v, struct term_out *out);
+
+void term_out_free(struct term_out *out);
+
+#endif
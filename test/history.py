@@ -0,0 +1,89 @@
+import os
+import random
+import shutil
+import signal
+import tempfile
+import time
+
+import pexpect
+
+# --history keeps output in 64K blocks, compressed once they fill up.
+# Write well over a block of both repetitive and incompressible output,
+# and check that a dump gives it back byte for byte.
+
+reptyr = os.path.abspath("./reptyr")
+tmp = tempfile.mkdtemp()
+
+
+def make_data(size):
+    rand = random.Random(size)
+    lines = []
+    n = 0
+    i = 0
+    while n < size // 2:
+        lines.append("%06d: the quick brown fox jumps over the lazy dog\n" % i)
+        n += len(lines[-1])
+        i += 1
+    while n < size:
+        line = "".join(chr(rand.randint(0x20, 0x7e)) for _ in range(79)) + "\n"
+        lines.append(line)
+        n += len(line)
+    return "".join(lines).encode()
+
+
+def run(data, args):
+    path = os.path.join(tmp, "data")
+    with open(path, "wb") as f:
+        f.write(data)
+    child = pexpect.spawn(reptyr, ["-V"] + args +
+                          ["-L", "sh", "-c", "cat %s; echo END-OF-DATA; exec cat" % path],
+                          cwd=tmp, timeout=30, searchwindowsize=100)
+    child.expect("END-OF-DATA\r\n")
+    return child
+
+
+def wait_for(path, size):
+    for _ in range(100):
+        if os.path.exists(path) and os.path.getsize(path) >= size:
+            break
+        time.sleep(0.1)
+    with open(path, "rb") as f:
+        return f.read()
+
+
+def finish(child):
+    child.sendeof()
+    child.expect("history: (\\d+) bytes, (\\d+) compressed to (\\d+), (\\d+) spilled")
+    stats = [int(x) for x in child.match.groups()]
+    child.expect(pexpect.EOF)
+    return stats
+
+
+def expected(data):
+    return (data + b"END-OF-DATA\n").replace(b"\n", b"\r\n")
+
+
+# All in memory, dumped with SIGUSR1.
+data = make_data(400 * 1024)
+child = run(data, ["--history=512K"])
+os.kill(child.pid, signal.SIGUSR1)
+dump = wait_for(os.path.join(tmp, "reptyr-%d-1.history" % child.pid),
+                len(expected(data)))
+total, packed_in, packed_out, spilled = finish(child)
+assert dump == expected(data), "SIGUSR1 dump differs from the output"
+assert packed_in > 0 and packed_out < packed_in
+
+# Most of it spilled to --history-file, dumped with --dump-history.
+data = make_data(1024 * 1024)
+sock = os.path.join(tmp, "sock")
+child = run(data, ["--history=128K",
+                   "--history-file=%s" % os.path.join(tmp, "spill"),
+                   "--share=%s" % sock])
+out = os.path.join(tmp, "dumped")
+assert os.system("%s --dump-history=%s > %s" % (reptyr, sock, out)) == 0
+dump = wait_for(out, len(expected(data)))
+total, packed_in, packed_out, spilled = finish(child)
+assert dump == expected(data), "--dump-history differs from the output"
+assert spilled > 0
+
+shutil.rmtree(tmp)
@@ -0,0 +1,69 @@
+import os
+import shutil
+import tempfile
+import time
+
+import pexpect
+
+# --filter=redact=STRING holds back what might be the start of the
+# secret from one read to the next. Write it across several writes,
+# with false starts and overlapping partial matches, and check the
+# --capture log against replacing it in everything written at once.
+
+reptyr = os.path.abspath("./reptyr")
+tmp = tempfile.mkdtemp()
+
+
+def gone(pid):
+    try:
+        with open("/proc/%d/stat" % pid) as f:
+            return f.read().split(") ")[1][0] == "Z"
+    except IOError:
+        return True
+
+
+def capture(secret, writes):
+    log = os.path.join(tmp, "log")
+    script = "; sleep 0.3; ".join("printf '%%s' '%s'" % w for w in writes)
+    child = pexpect.spawn(reptyr, ["--capture=%s" % log, "--filter=redact=%s" % secret,
+                                   "-L", "sh", "-c", script], timeout=10)
+    child.expect("\\(pid (\\d+)\\)")
+    pid = int(child.match.group(1))
+    child.expect(pexpect.EOF)
+    for _ in range(100):
+        if gone(pid):
+            break
+        time.sleep(0.1)
+    assert gone(pid), "reptyr --capture didn't exit with the program"
+    with open(log, "rb") as f:
+        got = f.read()
+    os.unlink(log)
+    want = "".join(writes).replace(secret, "[redacted]").replace("\n", "\r\n")
+    assert got == want.encode(), "%r != %r" % (got, want)
+
+
+# Split across writes, a false start, and a three-way split.
+capture("s3cr3t", ["pass=s3c", "r3t end\n",
+                   "s3", "cx no\n",
+                   "s3cr", "3", "t\n"])
+
+# Overlapping partial matches.
+capture("abab", ["ababab\n",
+                 "aba", "babab", "aab", "ab\n",
+                 "abaababab\n"])
+
+# A mismatch that has to fall back to a partial match, not start over.
+capture("ababc", ["abab", "ab", "abc\n",
+                  "ababab", "c\n",
+                  "aba", "b", "abab", "c\n"])
+
+# --fps would draw this terminal from the filtered screen, hiding the
+# secret from the one person meant to see it. That's refused outright.
+child = pexpect.spawn(reptyr, ["--fps=20", "--filter=redact=red",
+                               "-L", "sh", "-c", "echo hello-red"], timeout=10)
+child.expect(pexpect.EOF)
+child.close()
+assert child.exitstatus != 0, "--fps with --filter wasn't refused"
+assert b"--fps" in child.before and b"hello" not in child.before
+
+shutil.rmtree(tmp)
@@ -0,0 +1,65 @@
+import os
+import re
+import shutil
+import struct
+import subprocess
+import tempfile
+
+import pexpect
+
+# Record a session with --record: enough output for a couple of
+# keyframes, then two screens a few seconds apart, the last with a word
+# written across two reads. Check --replay --at shows the right screen,
+# that --search finds the word, and that both still work with the index
+# at the end cut off, so the keyframes have to be found by scanning.
+
+reptyr = os.path.abspath("./reptyr")
+tmp = tempfile.mkdtemp()
+
+
+def replay(path, args):
+    p = subprocess.Popen([reptyr, "-V", "--replay=%s" % path] + args,
+                         stdout=subprocess.PIPE, stderr=subprocess.PIPE)
+    out, err = p.communicate()
+    return p.returncode, out.decode(), err.decode()
+
+
+def screen(path, at):
+    rv, out, err = replay(path, ["--at=%s" % at] if at else [])
+    assert rv == 0, err
+    return [line for line in out.split("\n") if line], err
+
+
+rec = os.path.join(tmp, "rec")
+script = ("seq 1 300000; sleep 1; printf '\\033[2J\\033[Hscreen-one\\n'; sleep 3; "
+          "printf '\\033[2J\\033[Hscreen-two\\n'; printf 'spl'; sleep 0.3; printf 'it-word\\n'")
+child = pexpect.spawn(reptyr, ["--record=%s" % rec, "-L", "sh", "-c", script], timeout=30)
+child.expect(pexpect.EOF)
+
+# The same file, up to where the index starts.
+cut = os.path.join(tmp, "cut")
+with open(rec, "rb") as f:
+    data = f.read()
+assert data.endswith(b"reptyidx"), "the recording doesn't end with an index"
+with open(cut, "wb") as f:
+    f.write(data[:struct.unpack("<Q", data[-16:-8])[0]])
+
+keys = []
+for path, indexed in ((rec, True), (cut, False)):
+    lines, err = screen(path, "+2.5")
+    assert lines == ["screen-one"], "--at=+2.5 shows %r" % lines
+    assert ("indexed" in err) == indexed, err
+    keys.append(re.search(r"(\d+) keyframes", err).group(1))
+
+    lines, err = screen(path, None)
+    assert lines == ["screen-two", "split-word"], "the end shows %r" % lines
+
+    rv, out, err = replay(path, ["--search=split-word"])
+    assert rv == 0, "--search didn't find a word written across two reads"
+    assert out.count("split-word") == 1 and out.endswith("  split-word\n"), out
+
+rv, out, err = replay(rec, ["--search=not-there"])
+assert rv != 0 and out == ""
+assert keys[0] == keys[1] and int(keys[0]) > 0, "keyframes: %r" % keys
+
+shutil.rmtree(tmp)
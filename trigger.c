@@ -0,0 +1,399 @@
+/*
+ * Copyright (C) 2011 by Nelson Elhage
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+
+#include "reptyr.h"
+#include "event.h"
+#include "trigger.h"
+
+static int hex(int c) {
+    if (c >= '0' && c <= '9')
+        return c - '0';
+    if (c >= 'a' && c <= 'f')
+        return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F')
+        return c - 'A' + 10;
+    return -1;
+}
+
+/* Undo \n, \r, \t, \e, \\ and \xHH into a new buffer, and say how long it is. */
+static char *unescape(const char *s, size_t *len) {
+    char *out = malloc(strlen(s) + 1), *o = out;
+
+    if (out == NULL)
+        return NULL;
+    for (; *s; s++) {
+        if (*s != '\\' || !s[1]) {
+            *o++ = *s;
+            continue;
+        }
+        switch (*++s) {
+        case 'n': *o++ = '\n'; break;
+        case 'r': *o++ = '\r'; break;
+        case 't': *o++ = '\t'; break;
+        case 'e': *o++ = '\033'; break;
+        case 'x':
+            if (hex(s[1]) >= 0 && hex(s[2]) >= 0) {
+                *o++ = hex(s[1]) << 4 | hex(s[2]);
+                s += 2;
+                break;
+            }
+            /* fall through */
+        default:
+            *o++ = *s;
+        }
+    }
+    *len = o - out;
+    return out;
+}
+
+int triggers_add(struct triggers *ts, const char *pattern, enum trigger_action action,
+                 const char *arg) {
+    struct trigger *t;
+
+    if (ts->count == TRIGGER_MAX) {
+        errno = E2BIG;
+        return -1;
+    }
+    t = &ts->t[ts->count];
+    memset(t, 0, sizeof *t);
+    t->action = action;
+    if ((t->pattern = unescape(pattern, &t->len)) == NULL)
+        return -1;
+    if (t->len == 0 || t->len > TRIGGER_MAX_PATTERN) {
+        free(t->pattern);
+        errno = EINVAL;
+        return -1;
+    }
+    if (action == TRIGGER_SEND)
+        t->arg = unescape(arg, &t->arg_len);
+    else if ((t->arg = strdup(arg)) != NULL)
+        t->arg_len = strlen(arg);
+    if (t->arg == NULL) {
+        free(t->pattern);
+        return -1;
+    }
+    ts->count++;
+    return 0;
+}
+
+int triggers_send(const struct triggers *ts) {
+    int i;
+
+    for (i = 0; ts && i < ts->count; i++)
+        if (ts->t[i].action == TRIGGER_SEND)
+            return 1;
+    return 0;
+}
+
+/* Set up the two-byte prefilter. */
+static void triggers_prefilter(struct triggers *ts) {
+    unsigned char first[TRIGGER_MAX], second[TRIGGER_MAX], any[TRIGGER_MAX];
+    int i, j, n = 0;
+
+    for (i = 0; i < ts->count; i++) {
+        const unsigned char *p = (const unsigned char *)ts->t[i].pattern;
+        int single = ts->t[i].len == 1;
+
+        ts->start[p[0]] = 1;
+        if (single)
+            memset(ts->pairs[p[0]], 0xff, sizeof ts->pairs[p[0]]);
+        else
+            ts->pairs[p[0]][p[1] >> 6] |= 1ULL << (p[1] & 63);
+        for (j = 0; j < n; j++)
+            if (first[j] == p[0] && (any[j] || (!single && second[j] == p[1])))
+                break;
+        if (j < n)
+            continue;
+        first[n] = p[0];
+        second[n] = single ? 0 : p[1];
+        any[n++] = single;
+    }
+    ts->nvec = n <= TRIGGER_VECTOR_PAIRS ? n : 0;
+    for (i = 0; i < ts->nvec; i++)
+        for (j = 0; j < (int)sizeof(trigger_vec); j++) {
+            ts->first[i][j] = first[i];
+            ts->second[i][j] = second[i];
+            /* A one-byte pattern matches whatever comes after it. */
+            ts->mask[i][j] = any[i] ? 0 : 0xff;
+        }
+}
+
+int triggers_compile(struct triggers *ts) {
+    int *fail = NULL, *queue = NULL;
+    int32_t *next;
+    size_t states = 1;
+    int i, c, s, u, head = 0, tail = 0;
+
+    for (i = 0; i < ts->count; i++)
+        states += ts->t[i].len;
+    ts->delta = malloc(states * 256 * sizeof *ts->delta);
+    ts->out = calloc(states, sizeof *ts->out);
+    fail = calloc(states, sizeof *fail);
+    queue = malloc(states * sizeof *queue);
+    if (!ts->delta || !ts->out || !fail || !queue)
+        goto fail;
+    memset(ts->delta, 0xff, states * 256 * sizeof *ts->delta);
+
+    /* The trie, with -1 for no edge. */
+    ts->nstates = 1;
+    for (i = 0; i < ts->count; i++) {
+        const unsigned char *p = (const unsigned char *)ts->t[i].pattern;
+        size_t k;
+
+        for (s = 0, k = 0; k < ts->t[i].len; k++) {
+            next = &ts->delta[s * 256 + p[k]];
+            if (*next < 0)
+                *next = ts->nstates++;
+            s = *next;
+        }
+        ts->out[s] |= 1ULL << i;
+    }
+
+    /* Breadth first, fill in the missing edges from the failure links. */
+    for (c = 0; c < 256; c++) {
+        next = &ts->delta[c];
+        if (*next < 0) {
+            *next = 0;
+        } else {
+            fail[*next] = 0;
+            queue[tail++] = *next;
+        }
+    }
+    while (head < tail) {
+        s = queue[head++];
+        ts->out[s] |= ts->out[fail[s]];
+        for (c = 0; c < 256; c++) {
+            next = &ts->delta[s * 256 + c];
+            u = ts->delta[fail[s] * 256 + c];
+            if (*next < 0) {
+                *next = u;
+            } else {
+                fail[*next] = u;
+                queue[tail++] = *next;
+            }
+        }
+    }
+    free(fail);
+    free(queue);
+    triggers_prefilter(ts);
+    debug("Triggers: %d patterns, %d states, %s prefilter.", ts->count, ts->nstates,
+          ts->nvec ? "vector" : "scalar");
+    return 0;
+
+fail:
+    free(fail);
+    free(queue);
+    triggers_free(ts);
+    errno = ENOMEM;
+    return -1;
+}
+
+/* Fire and forget a command, with what matched in its environment. */
+static void trigger_exec(struct triggers *ts, struct trigger *t) {
+    char pid[16];
+    sigset_t none;
+    pid_t child = fork();
+    int fd;
+
+    /* Fork twice, so nobody has to reap the command. */
+    if (child == 0) {
+        if (fork() == 0) {
+            setsid();
+            sigemptyset(&none);
+            sigprocmask(SIG_SETMASK, &none, NULL);
+            if ((fd = open("/dev/null", O_RDWR)) >= 0) {
+                dup2(fd, 0);
+                dup2(fd, 1);
+                dup2(fd, 2);
+            }
+            if (close_range(3, ~0U, 0) < 0)
+                for (fd = 3; fd < 1024; fd++)
+                    close(fd);
+            snprintf(pid, sizeof pid, "%d", (int)ts->target);
+            setenv("REPTYR_MATCH", t->pattern, 1);
+            setenv("REPTYR_PID", pid, 1);
+            execl("/bin/sh", "sh", "-c", t->arg, (char *)NULL);
+            _exit(127);
+        }
+        _exit(0);
+    }
+    if (child < 0) {
+        error("Unable to fork for a trigger: %s", strerror(errno));
+        return;
+    }
+    waitpid(child, NULL, 0);
+}
+
+/* Send "TIME PID PATTERN\n" to a Unix socket, stream or datagram, if it's there. */
+static void trigger_notify(struct triggers *ts, struct trigger *t) {
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    char line[TRIGGER_MAX_PATTERN + 64];
+    int fd, len, type = SOCK_STREAM;
+
+    if (strlen(t->arg) >= sizeof addr.sun_path)
+        return;
+    strcpy(addr.sun_path, t->arg);
+    len = snprintf(line, sizeof line, "%lld %d %.*s\n", (long long)time(NULL),
+                   (int)ts->target, (int)t->len, t->pattern);
+    for (;;) {
+        if ((fd = socket(AF_UNIX, type | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) < 0)
+            return;
+        if (connect(fd, (struct sockaddr *)&addr, sizeof addr) == 0)
+            break;
+        close(fd);
+        if (errno != EPROTOTYPE || type == SOCK_DGRAM) {
+            debug("Unable to notify %s: %s", t->arg, strerror(errno));
+            return;
+        }
+        type = SOCK_DGRAM;
+    }
+    if (send(fd, line, len, MSG_DONTWAIT | MSG_NOSIGNAL) < 0)
+        debug("Unable to notify %s: %s", t->arg, strerror(errno));
+    close(fd);
+}
+
+static void trigger_fire(struct triggers *ts, struct trigger *t) {
+    long long now = ev_now();
+
+    if (t->fired && now - t->last < TRIGGER_HOLDOFF_US) {
+        t->held++;
+        return;
+    }
+    t->last = now;
+    t->fired++;
+    debug("Output matched \"%.*s\".", (int)t->len, t->pattern);
+    switch (t->action) {
+    case TRIGGER_EXEC:
+        trigger_exec(ts, t);
+        break;
+    case TRIGGER_NOTIFY:
+        trigger_notify(ts, t);
+        break;
+    case TRIGGER_SEND:
+        if (ts->send)
+            ts->send(ts->data, t->arg, t->arg_len);
+        break;
+    }
+}
+
+/*
+ * Where at or after `i' some pattern might start: its first byte, and
+ * its second, if that's in the buffer too.
+ */
+static size_t triggers_skip(const struct triggers *ts, const unsigned char *buf,
+                            size_t i, size_t len) {
+    trigger_vec a, b, hit;
+    uint64_t half[2];
+    int k;
+
+    if (ts->nvec) {
+        for (; i + sizeof a < len; i += sizeof a) {
+            memcpy(&a, buf + i, sizeof a);
+            memcpy(&b, buf + i + 1, sizeof b);
+            hit = (trigger_vec)(a == ts->first[0]) & (trigger_vec)((b & ts->mask[0]) == ts->second[0]);
+            for (k = 1; k < ts->nvec; k++)
+                hit |= (trigger_vec)(a == ts->first[k]) &
+                    (trigger_vec)((b & ts->mask[k]) == ts->second[k]);
+            memcpy(half, &hit, sizeof half);
+            if (half[0] | half[1]) {
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+                return i + (half[0] ? __builtin_ctzll(half[0]) / 8
+                                    : 8 + __builtin_ctzll(half[1]) / 8);
+#else
+                return i + (half[0] ? __builtin_clzll(half[0]) / 8
+                                    : 8 + __builtin_clzll(half[1]) / 8);
+#endif
+            }
+        }
+    }
+    for (; i < len; i++) {
+        if (!ts->start[buf[i]])
+            continue;
+        if (i + 1 == len ||
+            ts->pairs[buf[i]][buf[i + 1] >> 6] & (1ULL << (buf[i + 1] & 63)))
+            return i;
+    }
+    return len;
+}
+
+void triggers_scan(struct triggers *ts, const void *data, size_t len) {
+    const unsigned char *buf = data;
+    uint64_t hits;
+    size_t i = 0, j;
+    int s = ts->state;
+
+    if (ts->delta == NULL)
+        return;
+    ts->scanned += len;
+    while (i < len) {
+        if (s == 0) {
+            j = triggers_skip(ts, buf, i, len);
+            ts->skipped += j - i;
+            if ((i = j) == len)
+                break;
+        }
+        s = ts->delta[s * 256 + buf[i++]];
+        if ((hits = ts->out[s]) != 0) {
+            ts->state = s;
+            for (; hits; hits &= hits - 1)
+                trigger_fire(ts, &ts->t[__builtin_ctzll(hits)]);
+        }
+    }
+    ts->state = s;
+}
+
+void triggers_report(const struct triggers *ts) {
+    int i;
+
+    if (ts->delta == NULL)
+        return;
+    debug("Triggers: scanned %llu bytes, skipped %llu.", ts->scanned, ts->skipped);
+    for (i = 0; i < ts->count; i++)
+        if (ts->t[i].fired)
+            debug("  \"%.*s\": fired %llu times, held off %llu.", (int)ts->t[i].len,
+                  ts->t[i].pattern, ts->t[i].fired, ts->t[i].held);
+}
+
+void triggers_free(struct triggers *ts) {
+    int i;
+
+    for (i = 0; i < ts->count; i++) {
+        free(ts->t[i].pattern);
+        free(ts->t[i].arg);
+    }
+    ts->count = 0;
+    free(ts->delta);
+    free(ts->out);
+    ts->delta = NULL;
+    ts->out = NULL;
+}
@@ -0,0 +1,116 @@
+/*
+ * Copyright (C) 2011 by Nelson Elhage
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#ifndef TRIGGER_H
+#define TRIGGER_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+/*
+ * Watching the program's output for any of a set of strings, and doing
+ * something when one turns up.
+ *
+ * All the strings are matched at once, in a single pass, by an
+ * Aho-Corasick automaton compiled to a full transition table, which
+ * carries its state from one read to the next so matches may straddle
+ * reads. Most output matches nothing, so while the automaton is at its
+ * root we skip ahead 16 bytes at a time to the next place where the
+ * first two bytes of some string turn up, using the compiler's vector
+ * extensions (SSE2, NEON and so on, as the target has them).
+ */
+
+enum trigger_action {
+    /* Run a command with sh -c, in the background */
+    TRIGGER_EXEC = 1,
+    /* Write a line to a Unix socket */
+    TRIGGER_NOTIFY,
+    /* Type something into the program */
+    TRIGGER_SEND,
+};
+
+#define TRIGGER_MAX 64
+#define TRIGGER_MAX_PATTERN 1024
+/* No trigger fires more often than this (in us), so a flood can't fork-bomb us. */
+#define TRIGGER_HOLDOFF_US 1000000
+/* Up to this many distinct two-byte prefixes are looked for 16 bytes at a time. */
+#define TRIGGER_VECTOR_PAIRS 8
+
+typedef unsigned char trigger_vec __attribute__((vector_size(16)));
+
+struct trigger {
+    char *pattern;
+    size_t len;
+    enum trigger_action action;
+    /* The command, socket path, or bytes to send */
+    char *arg;
+    size_t arg_len;
+    long long last;
+    unsigned long long fired;
+    unsigned long long held;
+};
+
+struct triggers {
+    struct trigger t[TRIGGER_MAX];
+    int count;
+    /* The pid the output is from, for commands and notifications */
+    pid_t target;
+    /* For TRIGGER_SEND */
+    void (*send)(void *data, const char *buf, size_t len);
+    void *data;
+
+    /* delta[state * 256 + byte] is the next state; 0 is the root. */
+    int32_t *delta;
+    /* Which triggers match on entering each state, as a bit mask */
+    uint64_t *out;
+    int nstates;
+    int state;
+    /* Bytes that begin some pattern, and pairs of bytes that do */
+    unsigned char start[256];
+    uint64_t pairs[256][4];
+    /* ... and, if there are few enough pairs, the same in vectors. */
+    int nvec;
+    trigger_vec first[TRIGGER_VECTOR_PAIRS];
+    trigger_vec second[TRIGGER_VECTOR_PAIRS];
+    trigger_vec mask[TRIGGER_VECTOR_PAIRS];
+
+    unsigned long long scanned;
+    unsigned long long skipped;
+};
+
+/*
+ * Fire `action' when `pattern' turns up. `arg' may use \n, \r, \t, \e,
+ * \\ and \xHH escapes for TRIGGER_SEND. Returns -1 with errno set if the
+ * pattern is unusable or there are too many.
+ */
+int triggers_add(struct triggers *t, const char *pattern, enum trigger_action action,
+                 const char *arg);
+/* Build the automaton, once all the triggers are in. */
+int triggers_compile(struct triggers *t);
+/* Look for matches in the next `len' bytes of output, and act on them. */
+void triggers_scan(struct triggers *t, const void *buf, size_t len);
+/* Whether any trigger types into the program */
+int triggers_send(const struct triggers *t);
+void triggers_report(const struct triggers *t);
+void triggers_free(struct triggers *t);
+
+#endif
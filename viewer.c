@@ -0,0 +1,401 @@
+/*
+ * Copyright (C) 2011 by Nelson Elhage
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "reptyr.h"
+#include "proxy.h"
+#include "share.h"
+
+/*
+ * The other end of share.c: show a shared session on our terminal, and
+ * type into it while we hold the write lock.
+ *
+ * Keys after the escape character (^]):
+ *   w   take the write lock, or give it back
+ *   r   redraw the screen
+ *   q   stop watching
+ *   ^]  send a literal ^]
+ */
+
+#define VIEW_ESCAPE 0x1d
+
+struct viewer {
+    int fd;
+    int locked;
+    int escaped;
+    unsigned char in[SHARE_HEADER + SHARE_MAX_PAYLOAD];
+    size_t in_len;
+};
+
+static int view_send(struct viewer *v, enum share_msg type, const void *buf, size_t len) {
+    unsigned char msg[SHARE_HEADER + 256];
+    size_t hdr = share_header(msg, type, len);
+
+    memcpy(msg + hdr, buf, len);
+    return writeall(v->fd, msg, hdr + len);
+}
+
+static volatile sig_atomic_t winched;
+
+static void view_winch(int sig) {
+    winched = 1;
+}
+
+/* Tell the server our size; it's used while we hold the write lock. */
+static void view_send_size(struct viewer *v) {
+    struct winsize sz;
+    unsigned char buf[4];
+
+    if (ioctl(0, TIOCGWINSZ, &sz) < 0 || !sz.ws_row || !sz.ws_col)
+        return;
+    buf[0] = sz.ws_row >> 8;
+    buf[1] = sz.ws_row & 0xff;
+    buf[2] = sz.ws_col >> 8;
+    buf[3] = sz.ws_col & 0xff;
+    view_send(v, SHARE_RESIZE, buf, sizeof buf);
+}
+
+/* Put a note on the bottom line, where the next redraw will clean it up. */
+static void view_note(const char *msg) {
+    struct winsize sz;
+    char buf[256];
+    int len;
+
+    if (ioctl(1, TIOCGWINSZ, &sz) < 0 || !sz.ws_row)
+        sz.ws_row = 24;
+    len = snprintf(buf, sizeof buf, "\0337\033[%d;1H\033[7m reptyr: %s \033[m\033[K\0338",
+                   sz.ws_row, msg);
+    writeall(1, buf, len);
+}
+
+static void view_status(struct viewer *v, int status) {
+    switch (status) {
+    case SHARE_LOCKED:
+        v->locked = 1;
+        view_note("you have the write lock (^] w to give it back)");
+        break;
+    case SHARE_LOCK_BUSY:
+        view_note("someone else is typing; try again later");
+        break;
+    case SHARE_UNLOCKED:
+        v->locked = 0;
+        view_note("read-only (^] w to type)");
+        break;
+    case SHARE_READ_ONLY:
+        view_note("this viewer is read-only");
+        break;
+    }
+}
+
+/* Returns 0 on EOF, -1 on error. */
+static int view_read_socket(struct viewer *v) {
+    size_t len;
+    ssize_t n;
+
+    n = read(v->fd, v->in + v->in_len, sizeof v->in - v->in_len);
+    if (n <= 0)
+        return n < 0 && errno == EINTR ? 1 : n;
+    v->in_len += n;
+    while (v->in_len >= SHARE_HEADER) {
+        len = v->in[1] << 8 | v->in[2];
+        if (v->in_len < SHARE_HEADER + len)
+            break;
+        if (v->in[0] == SHARE_OUTPUT)
+            writeall(1, v->in + SHARE_HEADER, len);
+        else if (v->in[0] == SHARE_STATUS && len == 1)
+            view_status(v, v->in[SHARE_HEADER]);
+        v->in_len -= SHARE_HEADER + len;
+        memmove(v->in, v->in + SHARE_HEADER + len, v->in_len);
+    }
+    return 1;
+}
+
+/* Returns 0 once we're asked to quit. */
+static int view_read_keys(struct viewer *v) {
+    unsigned char buf[256], out[256];
+    size_t len = 0;
+    ssize_t n, i;
+
+    n = read(0, buf, sizeof buf);
+    if (n <= 0)
+        return n < 0 && errno == EINTR;
+    for (i = 0; i < n; i++) {
+        if (!v->escaped && buf[i] == VIEW_ESCAPE) {
+            v->escaped = 1;
+            continue;
+        }
+        if (!v->escaped) {
+            out[len++] = buf[i];
+            continue;
+        }
+        v->escaped = 0;
+        switch (buf[i]) {
+        case VIEW_ESCAPE:
+            out[len++] = buf[i];
+            break;
+        case 'w':
+            view_send(v, v->locked ? SHARE_UNLOCK : SHARE_LOCK, NULL, 0);
+            break;
+        case 'r':
+            view_send(v, SHARE_REDRAW, NULL, 0);
+            break;
+        case 'q':
+        case '.':
+            return 0;
+        }
+    }
+    /* The server drops it anyway unless we hold the lock. */
+    if (len && v->locked)
+        view_send(v, SHARE_INPUT, out, len);
+    return 1;
+}
+
+static int view_connect(const char *path) {
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    int fd;
+
+    if (strlen(path) >= sizeof addr.sun_path) {
+        error("Socket path too long: %s", path);
+        return -1;
+    }
+    strcpy(addr.sun_path, path);
+    if ((fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0 ||
+        connect(fd, (struct sockaddr *)&addr, sizeof addr) < 0) {
+        error("Unable to connect to %s: %s", path, strerror(errno));
+        if (fd >= 0)
+            close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/* Pick a session on a mux, if `id' says to. */
+static int view_select(struct viewer *v, int id) {
+    unsigned char buf[4];
+
+    if (id < 0)
+        return 0;
+    buf[0] = id >> 24;
+    buf[1] = id >> 16;
+    buf[2] = id >> 8;
+    buf[3] = id;
+    return view_send(v, SHARE_SELECT, buf, sizeof buf);
+}
+
+/* Copy whatever comes back to stdout, until the other end hangs up. */
+static int view_copy(struct viewer *v, const char *what) {
+    char buf[65536];
+    ssize_t n;
+
+    while ((n = read(v->fd, buf, sizeof buf)) != 0) {
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0 || writeall(1, buf, n) < 0) {
+            error("Unable to copy the %s: %s", what, strerror(errno));
+            return -1;
+        }
+        /* Keep the start, for share_request() to look at. */
+        if (v->in_len == 0) {
+            v->in_len = (size_t)n < sizeof v->in ? (size_t)n : sizeof v->in;
+            memcpy(v->in, buf, v->in_len);
+        }
+    }
+    return 0;
+}
+
+int share_dump(const char *path, int id) {
+    struct viewer v = {};
+    int err;
+
+    if ((v.fd = view_connect(path)) < 0)
+        return 1;
+    view_select(&v, id);
+    view_send(&v, SHARE_DUMP, NULL, 0);
+    err = view_copy(&v, "history");
+    close(v.fd);
+    return err < 0;
+}
+
+int share_request(const char *path, enum share_msg type, const void *buf, size_t len) {
+    struct viewer v = {};
+    int err;
+
+    if ((v.fd = view_connect(path)) < 0)
+        return 1;
+    view_send(&v, type, buf, len);
+    err = view_copy(&v, "reply");
+    close(v.fd);
+    return err < 0 || (v.in_len >= 7 && !memcmp(v.in, "error: ", 7));
+}
+
+static int take_append(char **buf, size_t *len, const unsigned char *data, size_t n) {
+    char *p;
+
+    if (n == 0)
+        return 0;
+    if ((p = realloc(*buf, *len + n)) == NULL)
+        return -1;
+    memcpy(p + *len, data, n);
+    *buf = p;
+    *len += n;
+    return 0;
+}
+
+/* One message of the server's answer to SHARE_HANDOFF. */
+static int take_message(struct share_handoff *h, int type, const unsigned char *buf,
+                        size_t len, int *answered) {
+    switch (type) {
+    case SHARE_HANDOFF:
+        if (len < 5)
+            break;
+        h->target = (pid_t)((uint32_t)buf[0] << 24 | buf[1] << 16 | buf[2] << 8 | buf[3]);
+        h->flags = buf[4];
+        *answered = 1;
+        break;
+    case SHARE_OUTPUT:
+        return take_append(&h->output, &h->output_len, buf, len);
+    case SHARE_INPUT:
+        return take_append(&h->input, &h->input_len, buf, len);
+    }
+    return 0;
+}
+
+int share_take(const char *path, struct share_handoff *h) {
+    struct viewer v = {};
+    char cbuf[CMSG_SPACE(sizeof(int))];
+    struct iovec iov;
+    struct msghdr msg = { .msg_iov = &iov, .msg_iovlen = 1 };
+    struct cmsghdr *cmsg;
+    int answered = 0, err = 0;
+    size_t len;
+    ssize_t n;
+
+    memset(h, 0, sizeof *h);
+    h->pty = -1;
+    if ((v.fd = view_connect(path)) < 0)
+        return -1;
+    if (view_send(&v, SHARE_HANDOFF, NULL, 0) < 0) {
+        error("Unable to ask for the session: %s", strerror(errno));
+        close(v.fd);
+        return -1;
+    }
+    /* Read until it hangs up: the pty comes with the first byte. */
+    for (;;) {
+        iov.iov_base = v.in + v.in_len;
+        iov.iov_len = sizeof v.in - v.in_len;
+        msg.msg_control = cbuf;
+        msg.msg_controllen = sizeof cbuf;
+        n = recvmsg(v.fd, &msg, MSG_CMSG_CLOEXEC);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            break;
+        cmsg = CMSG_FIRSTHDR(&msg);
+        if (cmsg && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS &&
+            h->pty < 0)
+            memcpy(&h->pty, CMSG_DATA(cmsg), sizeof(int));
+        v.in_len += n;
+        while (v.in_len >= SHARE_HEADER &&
+               v.in_len >= SHARE_HEADER + (len = v.in[1] << 8 | v.in[2])) {
+            if (!err && take_message(h, v.in[0], v.in + SHARE_HEADER, len, &answered) < 0)
+                err = errno;
+            v.in_len -= SHARE_HEADER + len;
+            memmove(v.in, v.in + SHARE_HEADER + len, v.in_len);
+        }
+    }
+    if (n < 0)
+        err = errno;
+    close(v.fd);
+    if (h->pty < 0 || !answered) {
+        error("%s didn't hand the session over.", path);
+        if (h->pty >= 0)
+            close(h->pty);
+        share_handoff_free(h);
+        return -1;
+    }
+    /* We have the pty, so carry on whatever else went missing. */
+    if (err)
+        error("Lost some of the session on the way over: %s", strerror(err));
+    return 0;
+}
+
+void share_handoff_free(struct share_handoff *h) {
+    free(h->output);
+    free(h->input);
+    h->output = h->input = NULL;
+    h->output_len = h->input_len = 0;
+}
+
+int share_view(const char *path, int id, int writable) {
+    struct viewer v = {};
+    struct sigaction sa = { .sa_handler = view_winch }, old_sa;
+    sigset_t winch, mask;
+    struct pollfd pfd[2];
+    unsigned char hello = writable;
+    int done = 0;
+
+    if ((v.fd = view_connect(path)) < 0)
+        return 1;
+    /* Only let SIGWINCH in while we wait, so it can't slip past. */
+    sigemptyset(&winch);
+    sigaddset(&winch, SIGWINCH);
+    sigprocmask(SIG_BLOCK, &winch, &mask);
+    sigaction(SIGWINCH, &sa, &old_sa);
+    view_select(&v, id);
+    view_send(&v, SHARE_HELLO, &hello, 1);
+    view_send_size(&v);
+    if (writable)
+        view_send(&v, SHARE_LOCK, NULL, 0);
+
+    pfd[0].fd = v.fd;
+    pfd[0].events = POLLIN;
+    pfd[1].fd = 0;
+    pfd[1].events = POLLIN;
+    while (!done) {
+        if (winched) {
+            winched = 0;
+            view_send_size(&v);
+        }
+        if (ppoll(pfd, 2, NULL, &mask) < 0) {
+            if (errno == EINTR)
+                continue;
+            break;
+        }
+        if (pfd[0].revents && view_read_socket(&v) <= 0)
+            done = 1;
+        if (pfd[1].revents && view_read_keys(&v) == 0)
+            done = 1;
+    }
+    sigaction(SIGWINCH, &old_sa, NULL);
+    sigprocmask(SIG_SETMASK, &mask, NULL);
+    close(v.fd);
+    return 0;
+}